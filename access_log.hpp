@@ -0,0 +1,357 @@
+#ifndef ACCESS_LOG_HPP
+#define ACCESS_LOG_HPP
+
+#include "http_parser.hpp"
+#include "spsc_ring.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define ACCESS_RING_CAPACITY 1024       // Entries per worker (a power of two)
+#define ACCESS_TEXT_SIZE 512            // Request line, referer, user agent
+#define ACCESS_BATCH_SIZE (256 * 1024)  // Bytes per write()
+#define ACCESS_ROTATE_BYTES (64 << 20)  // Default size before rotating
+#define ACCESS_KEEP_FILES 5             // path.1 ... path.5 kept after rotating
+#define ACCESS_IDLE_SLEEP_US 1000       // Writer nap when nothing was logged,
+#define ACCESS_IDLE_SLEEP_MAX_US 32000  // doubled per idle pass up to this
+#define ACCESS_BINARY_MAGIC "CSACCES1"  // First 8 bytes of a binary log
+
+enum class access_format { COMMON, COMBINED, BINARY };
+
+// One served request. The fields up to text are also the on-disk layout of
+// a binary record (host byte order), followed by text_length bytes of text:
+// method, target, version, referer and user agent back to back, each cut
+// to fit.
+struct AccessEntry {
+  uint16_t record_length; // Binary format: header plus text, in bytes
+  uint16_t status;        // 0 if no response was started
+  int32_t thread_id;
+  uint64_t request_id;
+  uint64_t time_us;  // Wall clock when the worker picked the request up
+  uint64_t bytes;    // Response bytes handed to the socket, headers included
+  uint32_t wait_us;  // Head complete -> worker starts
+  uint32_t parse_us; // Request parsed and routed
+  uint32_t handle_us; // Handler ran
+  uint32_t total_us;  // Head complete -> response queued
+  uint8_t family;    // AF_INET, AF_INET6 or 0 if unknown
+  uint8_t address[16];
+  uint8_t method_length;
+  uint8_t version_length;
+  uint8_t pad;
+  uint16_t target_length;
+  uint16_t referer_length;
+  uint16_t agent_length;
+  uint16_t text_length;
+  char text[ACCESS_TEXT_SIZE];
+
+  StrView method() const { return StrView(text, method_length); }
+  StrView target() const {
+    return StrView(text + method_length, target_length);
+  }
+  StrView version() const {
+    return StrView(text + method_length + target_length, version_length);
+  }
+  StrView referer() const {
+    return StrView(text + method_length + target_length + version_length,
+                   referer_length);
+  }
+  StrView agent() const {
+    return StrView(text + text_length - agent_length, agent_length);
+  }
+
+  // Fills text; the request line wins over referer and user agent for room
+  void setText(StrView method_in, StrView target_in, StrView version_in,
+               StrView referer_in, StrView agent_in) {
+    size_t room = sizeof(text);
+    method_length = static_cast<uint8_t>(std::min<size_t>(
+        std::min<size_t>(method_in.size, 32), room));
+    room -= method_length;
+    version_length = static_cast<uint8_t>(std::min<size_t>(
+        std::min<size_t>(version_in.size, 16), room));
+    room -= version_length;
+    target_length = static_cast<uint16_t>(std::min(target_in.size, room));
+    room -= target_length;
+    referer_length = static_cast<uint16_t>(std::min(referer_in.size, room / 2));
+    room -= referer_length;
+    agent_length = static_cast<uint16_t>(std::min(agent_in.size, room));
+    char *out = text;
+    memcpy(out, method_in.data, method_length);
+    out += method_length;
+    memcpy(out, target_in.data, target_length);
+    out += target_length;
+    memcpy(out, version_in.data, version_length);
+    out += version_length;
+    memcpy(out, referer_in.data, referer_length);
+    out += referer_length;
+    memcpy(out, agent_in.data, agent_length);
+    out += agent_length;
+    text_length = static_cast<uint16_t>(out - text);
+    record_length =
+        static_cast<uint16_t>(offsetof(AccessEntry, text) + text_length);
+  }
+};
+
+// Appends a quoted field, escaping quotes, backslashes and control bytes
+// so a request cannot forge log lines
+static inline char *access_quote(char *out, StrView field) {
+  *out++ = '"';
+  if (field.empty())
+    *out++ = '-';
+  for (size_t i = 0; i < field.size; ++i) {
+    unsigned char ch = static_cast<unsigned char>(field.data[i]);
+    if (ch == '"' || ch == '\\') {
+      *out++ = '\\';
+      *out++ = ch;
+    } else if (ch < 0x20 || ch >= 0x7f) {
+      out += sprintf(out, "\\x%02x", ch);
+    } else {
+      *out++ = ch;
+    }
+  }
+  *out++ = '"';
+  return out;
+}
+
+// Most bytes access_format_line() can produce for one entry
+static const size_t ACCESS_LINE_MAX = 4 * ACCESS_TEXT_SIZE + 256;
+
+// Common or combined log format, followed by the worker and the stage
+// timings in microseconds:
+//   host - - [time] "request" status bytes ["referer" "agent"] T<thread>
+//   wait=<us> parse=<us> handle=<us> total=<us>
+// Returns the line length, newline included.
+static inline size_t access_format_line(const AccessEntry &entry,
+                                        access_format format, char *line) {
+  char host[INET6_ADDRSTRLEN] = "-";
+  if (entry.family == AF_INET || entry.family == AF_INET6)
+    inet_ntop(entry.family, entry.address, host, sizeof(host));
+
+  time_t seconds = static_cast<time_t>(entry.time_us / 1000000);
+  struct tm local;
+  localtime_r(&seconds, &local);
+  char when[40];
+  strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S %z", &local);
+
+  char *out = line;
+  out += sprintf(out, "%s - - [%s] ", host, when);
+  // The request line, as one quoted field
+  char request[3 * ACCESS_TEXT_SIZE];
+  char *request_end = request;
+  StrView parts[3] = {entry.method(), entry.target(), entry.version()};
+  for (int i = 0; i < 3; ++i) {
+    if (parts[i].empty())
+      continue;
+    if (request_end != request)
+      *request_end++ = ' ';
+    memcpy(request_end, parts[i].data, parts[i].size);
+    request_end += parts[i].size;
+  }
+  out = access_quote(out, StrView(request, request_end - request));
+  if (entry.status != 0)
+    out += sprintf(out, " %u", entry.status);
+  else
+    out += sprintf(out, " -");
+  out += sprintf(out, " %llu",
+                 static_cast<unsigned long long>(entry.bytes));
+  if (format != access_format::COMMON) {
+    *out++ = ' ';
+    out = access_quote(out, entry.referer());
+    *out++ = ' ';
+    out = access_quote(out, entry.agent());
+  }
+  out += sprintf(out, " T%d wait=%u parse=%u handle=%u total=%u\n",
+                 entry.thread_id, entry.wait_us, entry.parse_us,
+                 entry.handle_us, entry.total_us);
+  return out - line;
+}
+
+// Access log. Workers fill an AccessEntry in their own ring (no lock, no
+// syscall); a writer thread turns the entries into text or binary records
+// and appends them to the file in large batches through an O_APPEND
+// descriptor. When the file would grow past the rotation size it is renamed
+// to path.1 (shifting older ones up to path.ACCESS_KEEP_FILES) and a new
+// one is started. Entries dropped because a ring was full are counted.
+class AccessLog {
+public:
+  typedef SpscRing<AccessEntry, ACCESS_RING_CAPACITY> Ring;
+
+  AccessLog()
+      : fd(-1), format(access_format::COMBINED),
+        rotate_bytes(ACCESS_ROTATE_BYTES), file_size(0), running(false),
+        total_dropped(0), batch(NULL), batch_length(0) {
+    pthread_mutex_init(&rings_mutex, NULL);
+  }
+
+  ~AccessLog() {
+    stop();
+    for (Ring *ring : rings)
+      delete ring;
+    delete[] batch;
+    pthread_mutex_destroy(&rings_mutex);
+  }
+
+  bool start(const std::string &file_path, access_format file_format,
+             uint64_t rotate_at) {
+    path = file_path;
+    format = file_format;
+    rotate_bytes = rotate_at;
+    batch = new char[ACCESS_BATCH_SIZE];
+    if (!openFile())
+      return false;
+    running.store(true);
+    if (pthread_create(&thread, NULL, writer_thread, this) != 0) {
+      running.store(false);
+      return false;
+    }
+    return true;
+  }
+
+  // Writes out everything already logged, then stops the writer
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    pthread_join(thread, NULL);
+    drain();
+    close(fd);
+    fd = -1;
+  }
+
+  bool enabled() const { return running.load(std::memory_order_relaxed); }
+
+  // Rings live as long as the log
+  Ring *openRing() {
+    Ring *ring = new Ring();
+    pthread_mutex_lock(&rings_mutex);
+    rings.push_back(ring);
+    pthread_mutex_unlock(&rings_mutex);
+    return ring;
+  }
+
+  uint64_t droppedEntries() const { return total_dropped.load(); }
+
+private:
+  std::string path;
+  int fd;
+  access_format format;
+  uint64_t rotate_bytes;
+  uint64_t file_size;
+  std::atomic<bool> running;
+  std::atomic<uint64_t> total_dropped;
+  pthread_t thread;
+  pthread_mutex_t rings_mutex;
+  std::vector<Ring *> rings;
+  char *batch;
+  size_t batch_length;
+
+  static void *writer_thread(void *arg) {
+    AccessLog *log = static_cast<AccessLog *>(arg);
+    // Backs off while idle, as the logger's writer does
+    useconds_t nap = ACCESS_IDLE_SLEEP_US;
+    while (log->running.load(std::memory_order_relaxed)) {
+      if (log->drain()) {
+        nap = ACCESS_IDLE_SLEEP_US;
+        continue;
+      }
+      usleep(nap);
+      if (nap < ACCESS_IDLE_SLEEP_MAX_US)
+        nap *= 2;
+    }
+    return NULL;
+  }
+
+  bool openFile() {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      perror(path.c_str());
+      return false;
+    }
+    struct stat info;
+    file_size = fstat(fd, &info) == 0 ? info.st_size : 0;
+    if (format == access_format::BINARY && file_size == 0) {
+      writeAll(ACCESS_BINARY_MAGIC, 8);
+      file_size = 8;
+    }
+    return true;
+  }
+
+  void rotate() {
+    close(fd);
+    for (int i = ACCESS_KEEP_FILES - 1; i >= 1; --i) {
+      std::string from = path + "." + std::to_string(i);
+      std::string to = path + "." + std::to_string(i + 1);
+      rename(from.c_str(), to.c_str());
+    }
+    rename(path.c_str(), (path + ".1").c_str());
+    if (!openFile())
+      fd = -1;
+  }
+
+  // One pass over every ring; false if there was nothing to write
+  bool drain() {
+    bool wrote = false;
+    pthread_mutex_lock(&rings_mutex);
+    for (Ring *ring : rings) {
+      const AccessEntry *entry;
+      while ((entry = ring->peek()) != NULL) {
+        append(*entry);
+        ring->pop();
+        wrote = true;
+      }
+      total_dropped.fetch_add(ring->takeDropped());
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    flush();
+    return wrote;
+  }
+
+  void append(const AccessEntry &entry) {
+    if (batch_length + ACCESS_LINE_MAX > ACCESS_BATCH_SIZE)
+      flush();
+    if (format == access_format::BINARY) {
+      memcpy(batch + batch_length, &entry, entry.record_length);
+      batch_length += entry.record_length;
+    } else {
+      batch_length += access_format_line(entry, format, batch + batch_length);
+    }
+  }
+
+  void flush() {
+    if (batch_length == 0)
+      return;
+    if (file_size > 8 && file_size + batch_length > rotate_bytes)
+      rotate();
+    if (fd != -1) {
+      writeAll(batch, batch_length);
+      file_size += batch_length;
+    }
+    batch_length = 0;
+  }
+
+  void writeAll(const char *data, size_t length) {
+    while (length > 0) {
+      ssize_t n = write(fd, data, length);
+      if (n > 0) {
+        data += n;
+        length -= n;
+      } else if (!(n == -1 && errno == EINTR)) {
+        return; // Disk full or similar; drop the batch
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include "http_parser.hpp"
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#define ARENA_BLOCK_SIZE (16 * 1024) // Inline block, and each block added later
+
+// Bump allocator for memory that lives exactly as long as one request.
+// Allocation moves a pointer forward; nothing is freed individually, and
+// reset() takes everything back at once. The first block is part of the
+// arena itself, and blocks added when a request outgrows it are kept for
+// later requests, so once a worker has seen its largest request it never
+// touches the heap for request data again. Single-threaded, like the
+// ConnectionContext that owns it.
+class RequestArena {
+public:
+  RequestArena()
+      : current(inline_block), used(0), capacity(ARENA_BLOCK_SIZE),
+        next_block(0) {}
+
+  ~RequestArena() {
+    reset();
+    for (char *block : blocks)
+      free(block);
+  }
+
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    size_t offset = (used + align - 1) & ~(align - 1);
+    if (offset + size > capacity)
+      return allocateSlow(size, align);
+    used = offset + size;
+    return current + offset;
+  }
+
+  // Invalidates everything handed out since the last reset
+  void reset() {
+    for (char *block : oversized)
+      free(block);
+    oversized.clear();
+    current = inline_block;
+    used = 0;
+    capacity = ARENA_BLOCK_SIZE;
+    next_block = 0;
+  }
+
+  // printf into the arena; the text is NUL-terminated and valid until reset()
+  StrView format(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    va_start(args, fmt);
+    va_list retry;
+    va_copy(retry, args);
+    char *text = current + used;
+    size_t room = capacity - used;
+    int length = vsnprintf(text, room, fmt, args);
+    va_end(args);
+    if (length < 0) {
+      va_end(retry);
+      return StrView();
+    }
+    if (static_cast<size_t>(length) < room) {
+      used += length + 1;
+    } else {
+      text = static_cast<char *>(allocate(length + 1, 1));
+      vsnprintf(text, length + 1, fmt, retry);
+    }
+    va_end(retry);
+    return StrView(text, length);
+  }
+
+  // Bytes in blocks kept beyond the inline one
+  size_t reservedBytes() const { return blocks.size() * ARENA_BLOCK_SIZE; }
+
+private:
+  alignas(std::max_align_t) char inline_block[ARENA_BLOCK_SIZE];
+  char *current; // Block being bumped through
+  size_t used;
+  size_t capacity;
+  std::vector<char *> blocks;    // Extra full-size blocks, reused
+  size_t next_block;             // blocks[next_block] is the next one to use
+  std::vector<char *> oversized; // Single allocations over a block; freed
+
+  void *allocateSlow(size_t size, size_t align) {
+    if (size + align > ARENA_BLOCK_SIZE) {
+      // malloc memory is aligned for any type
+      char *block = static_cast<char *>(malloc(size));
+      if (block == NULL)
+        throw std::bad_alloc();
+      oversized.push_back(block);
+      return block;
+    }
+    if (next_block == blocks.size()) {
+      char *block = static_cast<char *>(malloc(ARENA_BLOCK_SIZE));
+      if (block == NULL)
+        throw std::bad_alloc();
+      blocks.push_back(block);
+    }
+    current = blocks[next_block++];
+    used = 0;
+    capacity = ARENA_BLOCK_SIZE;
+    return allocate(size, align);
+  }
+};
+
+// Standard allocator handing out RequestArena memory, for request-scoped
+// containers. deallocate() does nothing, so containers that grow leave their
+// old storage behind until reset(); reserve() up front where the size is
+// known.
+template <typename T> class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(RequestArena *arena) : arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t count) {
+    return static_cast<T *>(arena->allocate(count * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+
+  template <typename U> bool operator==(const ArenaAllocator<U> &other) const {
+    return arena == other.arena;
+  }
+  template <typename U> bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena != other.arena;
+  }
+
+private:
+  template <typename U> friend class ArenaAllocator;
+  RequestArena *arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>
+    ArenaString;
+template <typename T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif
@@ -1,154 +1,960 @@
 #include "capture_server.hpp"
+#include "dir_listing.hpp"
+#include "fastcgi.hpp"
+#include "file_cache.hpp"
+#include "io_uring.hpp"
+#include "router.hpp"
+#include "simd_scan.hpp"
+#include "work_scheduler.hpp"
+#include <algorithm>
 #include <atomic>
 #include <errno.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <queue>
-#include <regex>
+#include <poll.h>
 #include <signal.h>
+#include <unordered_set>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#else
+#include <sys/event.h>
+#endif
+#include <sys/uio.h>
 
 extern char **environ;
 static std::atomic<bool> g_shutdown_requested(false);
-static int g_listen_fd = -1;
+static size_t g_total_workers = NUM_THREADS; // Across all shards
 static log_level LOG_LEVEL = log_level::TRACE;
-
+static AsyncLogger g_logger;
+static AccessLog g_access_log;
+static Metrics g_metrics;
+// Commands and CLI PHP runs in flight (php-cgi backends are counted by the
+// pool)
+static std::atomic<unsigned> g_active_children(0);
+static FileCache g_file_cache;
+static FastCgiPool g_php_pool;
+static DirListingCache g_dir_listings;
+// Dynamic response compression (--no-compress, --compress-*)
+static bool g_compress = true;
+static int g_compress_level = 0; // 0: each codec's default
+static size_t g_compress_min = COMPRESS_MIN_BYTES;
+static CompressBudget g_compress_budget;
+static CompressedCache g_compressed_cache;
+
+// Every event loop notices within one wait timeout and winds down
 static void handle_termination_signal(int /*sig*/) {
   g_shutdown_requested.store(true);
-  if (g_listen_fd != -1) {
-    close(g_listen_fd);
-  }
 }
 
-// Structure to pass both pool and context to each thread
-struct ThreadData {
-  class ThreadPool *pool;
-  ConnectionContext *context;
-};
+class ThreadPool;
+// Every running pool, for the queue depth in /metrics
+static pthread_mutex_t g_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ThreadPool *> g_pools;
 
-// Simple thread pool class
+// Serves connections on a work-stealing scheduler; each worker thread owns a
+// pre-allocated ConnectionContext
 class ThreadPool {
 public:
-  ThreadPool(size_t num_threads) { start(num_threads); }
+  // Worker thread ids start at first_thread_id so they are unique across
+  // shards
+  ThreadPool(size_t num_threads, int first_thread_id = 0) {
+    std::vector<void *> states;
+    for (size_t i = 0; i < num_threads; ++i) {
+      contexts.push_back(new ConnectionContext(first_thread_id + i));
+      states.push_back(contexts.back());
+    }
+    scheduler.start(states);
+    pthread_mutex_lock(&g_pools_mutex);
+    g_pools.push_back(this);
+    pthread_mutex_unlock(&g_pools_mutex);
+  }
 
-  ~ThreadPool() { stop(); }
+  ~ThreadPool() {
+    pthread_mutex_lock(&g_pools_mutex);
+    g_pools.erase(std::find(g_pools.begin(), g_pools.end(), this));
+    pthread_mutex_unlock(&g_pools_mutex);
+    stop();
+    for (ConnectionContext *ctx : contexts)
+      delete ctx;
+  }
+
+  // Drains queued work and joins the workers; safe to call more than once
+  void stop() { scheduler.stop(); }
+
+  void enqueue(Connection *conn) {
+    Task task = {serve_connection, conn};
+    scheduler.submit(task);
+  }
 
-  void enqueue(int socket_fd) {
-    pthread_mutex_lock(&tasks_mutex);
-    tasks.push(socket_fd);
-    pthread_cond_signal(&tasks_cond);
-    pthread_mutex_unlock(&tasks_mutex);
+  // Background work such as cache fills; runs on the submitting worker's
+  // deque when called from a task, so it stays local unless stolen
+  void spawn(void (*fn)(void *arg, void *worker_state), void *arg) {
+    Task task = {fn, arg};
+    scheduler.submit(task);
   }
 
+  // Tasks not yet picked up by a worker; approximate
+  size_t queued() const { return scheduler.queued(); }
+
 private:
-  std::vector<pthread_t> threads;
-  std::vector<ThreadData> thread_data; // Data passed to each thread
-  pthread_cond_t tasks_cond;
-  pthread_mutex_t tasks_mutex;
-  bool stopping;
-  std::queue<int> tasks;
+  std::vector<ConnectionContext *> contexts;
+  WorkScheduler scheduler;
+
+  static void serve_connection(void *arg, void *worker_state) {
+    Connection *conn = static_cast<Connection *>(arg);
+    ConnectionContext *ctx = static_cast<ConnectionContext *>(worker_state);
+
+    // Use the pre-allocated context for this thread
+    ctx->reset(conn);
+    if (conn->state == conn_state::WRITING) {
+      // Socket became writable again; push out the rest of the response
+      ctx->flushPending();
+    } else {
+      ctx->handleRequest();
+    }
+    // Return the connection to the event loop
+    ctx->cleanup();
+  }
+};
 
-  void start(size_t num_threads) {
-    pthread_cond_init(&tasks_cond, NULL);
-    pthread_mutex_init(&tasks_mutex, NULL);
-    stopping = false;
+static time_t monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
 
-    thread_data.resize(num_threads);
+static uint64_t monotonic_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
-    for (size_t i = 0; i < num_threads; ++i) {
-      thread_data[i].pool = this;
-      thread_data[i].context = new ConnectionContext(i);
+static const std::string &connection_header(bool keep_alive) {
+  static const std::string close_header = "Connection: close\r\n";
+  static const std::string keep_alive_header =
+      "Connection: keep-alive\r\nKeep-Alive: timeout=" +
+      std::to_string(KEEPALIVE_TIMEOUT_SEC) + "\r\n";
+  return keep_alive ? keep_alive_header : close_header;
+}
+
+static std::string response_header(const std::string &status,
+                                   const std::string &content_type,
+                                   size_t content_length, bool keep_alive,
+                                   const std::string &extra_headers = "") {
+  std::string header = "HTTP/1.1 " + status + "\r\n";
+  header += "Content-Type: " + content_type + "\r\n";
+  header += extra_headers;
+  header += connection_header(keep_alive);
+  // Always framed, even when empty, so kept-alive clients find the end
+  header += "Content-Length: " + std::to_string(content_length) + "\r\n";
+  header += "\r\n";
+  return header;
+}
+
+static bool set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+#ifdef HAVE_IO_URING
+#define URING_FILE_CHUNK (64 * 1024) // File bytes per linked read + send
+
+// What a completion is for; stored in the low bits of user_data next to the
+// Connection pointer (heap objects are at least 8-byte aligned)
+enum ring_op : uint64_t {
+  RING_IGNORE = 0, // Cancellations
+  RING_ACCEPT,
+  RING_WAKE,
+  RING_RECV,
+  RING_SEND,
+  RING_FILE_READ,
+  RING_FILE_SEND,
+  RING_POLLOUT,
+};
+#define RING_OP_MASK 7
+#endif
+
+// Readiness reactor: owns the listen socket and every idle connection. It
+// reads requests without blocking and only hands a connection to the pool once
+// a full header block has arrived or a stalled response can make progress.
+// Workers return connections through complete(), never touching the poller.
+//
+// With io_uring the loop is completion-driven instead: a multishot accept and
+// per-connection multishot receives into provided buffers feed it, queued
+// output is finished by the loop itself with send and linked file read/send
+// operations, and every SQE of an iteration goes out in the same
+// io_uring_enter() that waits for completions.
+class EventLoop {
+public:
+  EventLoop(int listen_fd, ThreadPool &pool, bool use_io_uring = false)
+      : listen_fd(listen_fd), pool(pool), metrics(g_metrics.openShard()),
+        ring_enabled(false) {
+    pthread_mutex_init(&completed_mutex, NULL);
+    set_nonblocking(listen_fd);
+#ifdef __linux__
+    poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#ifdef HAVE_IO_URING
+    // The ring watches the listener and wake_fd in place of epoll
+    if (use_io_uring && startRing())
+      return;
+#else
+    (void)use_io_uring;
+#endif
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &this->listen_fd;
+    epoll_ctl(poll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &wake_fd;
+    epoll_ctl(poll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+#else
+    (void)use_io_uring;
+    poll_fd = kqueue();
+    wake_fd = -1;
+    struct kevent changes[2];
+    EV_SET(&changes[0], listen_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0,
+           &this->listen_fd);
+    EV_SET(&changes[1], 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, &wake_fd);
+    kevent(poll_fd, changes, 2, NULL, 0, NULL);
+#endif
+  }
 
-      pthread_t thread;
-      pthread_create(&thread, NULL, worker_thread, &thread_data[i]);
-      threads.push_back(thread);
+  ~EventLoop() {
+    for (Connection *conn : connections) {
+      close(conn->fd);
+      delete conn;
+    }
+    connections.clear();
+#ifdef HAVE_IO_URING
+    for (Connection *conn : ring_zombies) {
+      close(conn->fd);
+      delete conn;
     }
+#endif
+    if (wake_fd != -1)
+      close(wake_fd);
+    close(poll_fd);
+    pthread_mutex_destroy(&completed_mutex);
   }
 
-  void stop() {
-    pthread_mutex_lock(&tasks_mutex);
-    stopping = true;
-    pthread_mutex_unlock(&tasks_mutex);
-    pthread_cond_broadcast(&tasks_cond);
+  bool usingIoUring() const { return ring_enabled; }
 
-    for (pthread_t &thread : threads) {
-      pthread_join(thread, NULL);
+  // Reactor body; returns once shutdown has been requested
+  void run() {
+#ifdef HAVE_IO_URING
+    if (ring_enabled) {
+      runRing();
+      return;
     }
+#endif
+    const int max_events = 64;
+    time_t last_sweep = monotonic_seconds();
+    while (!g_shutdown_requested.load()) {
+#ifdef __linux__
+      struct epoll_event events[max_events];
+      int n = epoll_wait(poll_fd, events, max_events, 500);
+#else
+      struct kevent events[max_events];
+      struct timespec timeout = {0, 500 * 1000 * 1000};
+      int n = kevent(poll_fd, NULL, 0, events, max_events, &timeout);
+#endif
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("event wait");
+        break;
+      }
 
-    pthread_cond_destroy(&tasks_cond);
-    pthread_mutex_destroy(&tasks_mutex);
+      time_t now = monotonic_seconds();
+      if (now != last_sweep) {
+        closeIdleConnections(now);
+        last_sweep = now;
+      }
+
+      for (int i = 0; i < n; ++i) {
+#ifdef __linux__
+        void *tag = events[i].data.ptr;
+        bool writable = events[i].events & EPOLLOUT;
+#else
+        void *tag = events[i].udata;
+        bool writable = events[i].filter == EVFILT_WRITE;
+#endif
+        if (tag == &listen_fd) {
+          acceptConnections();
+        } else if (tag == &wake_fd) {
+          drainCompletions();
+        } else {
+          Connection *conn = static_cast<Connection *>(tag);
+          if (writable) {
+            pool.enqueue(conn);
+          } else {
+            onReadable(conn);
+          }
+        }
+      }
+    }
   }
 
-  static void *worker_thread(void *arg) {
-    ThreadData *data = static_cast<ThreadData *>(arg);
-    ThreadPool *pool = data->pool;
-    ConnectionContext *ctx = data->context;
-    int thread_id = ctx->getThreadId();
+  // Called by a worker when it is finished with a connection
+  void complete(Connection *conn) {
+    pthread_mutex_lock(&completed_mutex);
+    completed.push_back(conn);
+    pthread_mutex_unlock(&completed_mutex);
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      perror("eventfd write");
+    }
+#else
+    struct kevent trigger;
+    EV_SET(&trigger, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, &wake_fd);
+    kevent(poll_fd, &trigger, 1, NULL, 0, NULL);
+#endif
+  }
 
+private:
+  int listen_fd;
+  int poll_fd;
+  int wake_fd;
+  ThreadPool &pool;
+  MetricsShard *metrics; // Send and total stages, timed here
+  std::unordered_set<Connection *> connections; // Reactor thread only
+  pthread_mutex_t completed_mutex;
+  std::vector<Connection *> completed;
+  std::vector<Connection *> completed_swap; // Reactor thread only
+  bool ring_enabled;
+#ifdef HAVE_IO_URING
+  IoUring ring;
+  bool ring_multishot_accept; // Cleared if the kernel rejects the flag
+  bool ring_multishot_recv;
+  // Closed connections whose operations have not all completed yet
+  std::unordered_set<Connection *> ring_zombies;
+#endif
+
+  void acceptConnections() {
     while (true) {
-      int socket_fd;
+#ifdef __linux__
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0)
+        set_nonblocking(fd);
+#endif
+      if (fd < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+            !g_shutdown_requested.load()) {
+          std::cout << "Error accepting connection: " << strerror(errno)
+                    << std::endl;
+        }
+        return;
+      }
+      Connection *conn = new Connection(fd, this);
+      connections.insert(conn);
+      conn->idle_since = monotonic_seconds();
+      watch(conn, false, true);
+    }
+  }
+
+  // Drain the socket; dispatch once a whole header block is buffered.
+  // Reading stops past MAX_REQUEST_SIZE: the parser then has either a
+  // request or an oversized head to report, and the rest stays in the
+  // socket until the next one-shot rearm.
+  void onReadable(Connection *conn) {
+    char buffer[BUFFER_SIZE];
+    while (conn->in.size() <= MAX_REQUEST_SIZE) {
+      ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+      if (n > 0) {
+        conn->in.append(buffer, n);
+        conn->idle_since = monotonic_seconds();
+        continue;
+      }
+      if (n == 0) {
+        conn->peer_closed = true;
+        break;
+      }
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      closeConnection(conn);
+      return;
+    }
 
-      pthread_mutex_lock(&pool->tasks_mutex);
+    if (conn->hasCompleteRequest()) {
+      dispatch(conn);
+      return;
+    }
 
-      while (pool->tasks.empty() && !pool->stopping) {
-        pthread_cond_wait(&pool->tasks_cond, &pool->tasks_mutex);
+    // Oversized heads are reported by the parser and answered by a worker
+    if (conn->peer_closed || inputOverLimit(conn)) {
+      closeConnection(conn);
+      return;
+    }
+    watch(conn, false, false);
+  }
+
+  // A full buffer the parser still calls incomplete: only blank lines,
+  // which it skips without counting against its limits
+  bool inputOverLimit(Connection *conn) {
+    return conn->in.size() > MAX_REQUEST_SIZE && !conn->hasCompleteRequest();
+  }
+
+  void dispatch(Connection *conn) {
+    conn->state = conn_state::PROCESSING;
+    conn->idle_since = 0;
+    conn->ready_ns = monotonic_nanos();
+    pool.enqueue(conn);
+  }
+
+  void drainCompletions() {
+#ifdef __linux__
+    uint64_t count;
+    while (read(wake_fd, &count, sizeof(count)) > 0) {
+    }
+#endif
+    pthread_mutex_lock(&completed_mutex);
+    completed_swap.swap(completed);
+    pthread_mutex_unlock(&completed_mutex);
+
+    for (Connection *conn : completed_swap) {
+#ifdef HAVE_IO_URING
+      takeStash(conn);
+#endif
+      if (conn->state == conn_state::CLOSING) {
+        closeConnection(conn);
+      } else if (conn->hasPendingOutput()) {
+        conn->state = conn_state::WRITING;
+        watch(conn, true, false);
+      } else {
+        onResponseDone(conn);
       }
+    }
+    completed_swap.clear();
+  }
 
-      if (pool->stopping && pool->tasks.empty()) {
-        pthread_mutex_unlock(&pool->tasks_mutex);
+  // The response is fully handed to the socket: serve the next request,
+  // wait for one, or close
+  void onResponseDone(Connection *conn) {
+    if (conn->handled_ns != 0) {
+      uint64_t now_ns = monotonic_nanos();
+      size_t type = static_cast<size_t>(conn->handled_type);
+      metrics->record(type, metric_stage::SEND, now_ns - conn->handled_ns);
+      metrics->record(type, metric_stage::TOTAL, now_ns - conn->ready_ns);
+      conn->handled_ns = 0;
+    }
+    if (!conn->keep_alive || conn->peer_closed) {
+      if (!conn->peer_closed)
+        discardInput(conn);
+      closeConnection(conn);
+    } else if (conn->hasCompleteRequest()) {
+      // Pipelined request already buffered behind the one just answered
+      dispatch(conn);
+    } else {
+      conn->state = conn_state::READING;
+      conn->idle_since = monotonic_seconds();
+      watch(conn, false, false);
+    }
+  }
+
+  // Reads what the client has already sent before a close after a response
+  // (an oversized head above all), since closing with unread input resets
+  // the connection and may discard the response
+  void discardInput(Connection *conn) {
+#ifdef HAVE_IO_URING
+    if (ring_enabled)
+      return; // Receives are armed; the ring consumes the input itself
+#endif
+    char buffer[BUFFER_SIZE];
+    size_t total = 0;
+    while (total < MAX_REQUEST_SIZE) {
+      ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+      if (n <= 0)
         break;
+      total += n;
+    }
+  }
+
+  // Connections waiting on the client are owned by the loop, so they can be
+  // closed here without racing a worker
+  void closeIdleConnections(time_t now) {
+    std::vector<Connection *> expired;
+    for (Connection *conn : connections) {
+      if (conn->idle_since != 0 &&
+          now - conn->idle_since >= KEEPALIVE_TIMEOUT_SEC) {
+        expired.push_back(conn);
       }
+    }
+    for (Connection *conn : expired) {
+      closeConnection(conn);
+    }
+  }
+
+  // (Re)arm one-shot interest so events stop while a worker owns conn
+  void watch(Connection *conn, bool for_write, bool first_time) {
+#ifdef HAVE_IO_URING
+    if (ring_enabled) {
+      // The loop finishes queued output itself; receives stay armed
+      if (for_write)
+        ringContinueSend(conn);
+      else if (!conn->ring_receiving)
+        ringArmRecv(conn);
+      return;
+    }
+#endif
+#ifdef __linux__
+    struct epoll_event ev;
+    ev.events = (for_write ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(poll_fd, first_time ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  conn->fd, &ev) == -1) {
+      perror("epoll_ctl");
+      closeConnection(conn);
+    }
+#else
+    (void)first_time;
+    struct kevent ev;
+    EV_SET(&ev, conn->fd, for_write ? EVFILT_WRITE : EVFILT_READ,
+           EV_ADD | EV_ONESHOT, 0, 0, conn);
+    if (kevent(poll_fd, &ev, 1, NULL, 0, NULL) == -1) {
+      perror("kevent");
+      closeConnection(conn);
+    }
+#endif
+  }
 
-      socket_fd = pool->tasks.front();
-      pool->tasks.pop();
+  void closeConnection(Connection *conn) {
+    connections.erase(conn);
+#ifdef HAVE_IO_URING
+    if (conn->ring_ops > 0) {
+      // Completions still point at conn; free it once they have all arrived
+      conn->ring_closed = true;
+      ring_zombies.insert(conn);
+      struct io_uring_sqe *sqe = ring.getSqe();
+      if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = conn->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = RING_IGNORE;
+      }
+      return;
+    }
+#endif
+    close(conn->fd);
+    delete conn;
+  }
 
-      pthread_mutex_unlock(&pool->tasks_mutex);
+#ifdef HAVE_IO_URING
+  bool startRing() {
+    if (!ring.init(URING_ENTRIES) ||
+        !ring.setupBuffers(URING_BUFFER_COUNT, BUFFER_SIZE))
+      return false;
+    ring_enabled = true;
+    ring_multishot_accept = true;
+    ring_multishot_recv = true;
+    ringArmAccept();
+    ringArmWake();
+    return true;
+  }
 
-      // Use the pre-allocated context for this thread
-      ctx->reset(socket_fd);
-      ctx->handleRequest();
-      // Ensure connection is closed so clients know response is complete
-      ctx->cleanup();
+  void runRing() {
+    time_t last_sweep = monotonic_seconds();
+    while (!g_shutdown_requested.load()) {
+      int rc = ring.submitAndWait(500);
+      if (rc < 0 && rc != -ETIME && rc != -EINTR && rc != -EBUSY) {
+        std::cout << "io_uring_enter: " << strerror(-rc) << std::endl;
+        break;
+      }
+
+      time_t now = monotonic_seconds();
+      if (now != last_sweep) {
+        closeIdleConnections(now);
+        last_sweep = now;
+      }
+
+      struct io_uring_cqe *cqe;
+      while ((cqe = ring.peekCqe()) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        ring.seenCqe();
+        onRingCompletion(user_data, res, flags);
+      }
+    }
+  }
+
+  // A new SQE for conn's operation op, counted until its completion
+  struct io_uring_sqe *ringPrepare(Connection *conn, ring_op op) {
+    struct io_uring_sqe *sqe = ring.getSqe();
+    if (sqe == NULL)
+      return NULL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    if (conn != NULL)
+      conn->ring_ops++;
+    return sqe;
+  }
+
+  void ringArmAccept() {
+    struct io_uring_sqe *sqe = ringPrepare(NULL, RING_ACCEPT);
+    if (sqe == NULL)
+      return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (ring_multishot_accept)
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  }
+
+  void ringArmWake() {
+    struct io_uring_sqe *sqe = ringPrepare(NULL, RING_WAKE);
+    if (sqe == NULL)
+      return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+  }
+
+  void ringArmRecv(Connection *conn) {
+    struct io_uring_sqe *sqe = ringPrepare(conn, RING_RECV);
+    if (sqe == NULL) {
+      closeConnection(conn);
+      return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (ring_multishot_recv)
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+    else
+      sqe->len = BUFFER_SIZE;
+    conn->ring_receiving = true;
+  }
+
+  void ringArmPollOut(Connection *conn) {
+    struct io_uring_sqe *sqe = ringPrepare(conn, RING_POLLOUT);
+    if (sqe == NULL) {
+      closeConnection(conn);
+      return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+  }
+
+  // Push out whatever the worker could not: buffered bytes with a send, then
+  // the file body as linked read -> send pairs (a short read cancels the
+  // send, since the framing would be wrong anyway)
+  void ringContinueSend(Connection *conn) {
+    if (conn->out_offset < conn->out.size()) {
+      struct io_uring_sqe *sqe = ringPrepare(conn, RING_SEND);
+      if (sqe == NULL) {
+        closeConnection(conn);
+        return;
+      }
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = conn->fd;
+      sqe->addr = (uint64_t)(uintptr_t)(conn->out.data() + conn->out_offset);
+      sqe->len = conn->out.size() - conn->out_offset;
+      return;
+    }
+    conn->out.clear();
+    conn->out_offset = 0;
+
+    if (conn->file_remaining > 0) {
+      size_t chunk =
+          std::min(conn->file_remaining, (size_t)URING_FILE_CHUNK);
+      conn->ring_chunk.resize(chunk);
+      if (!ring.reserve(2)) {
+        closeConnection(conn);
+        return;
+      }
+      struct io_uring_sqe *read_sqe = ringPrepare(conn, RING_FILE_READ);
+      read_sqe->opcode = IORING_OP_READ;
+      read_sqe->fd = conn->file_fd;
+      read_sqe->addr = (uint64_t)(uintptr_t)conn->ring_chunk.data();
+      read_sqe->len = chunk;
+      read_sqe->off = conn->file_offset;
+      read_sqe->flags = IOSQE_IO_LINK;
+      struct io_uring_sqe *send_sqe = ringPrepare(conn, RING_FILE_SEND);
+      send_sqe->opcode = IORING_OP_SEND;
+      send_sqe->fd = conn->fd;
+      send_sqe->addr = (uint64_t)(uintptr_t)conn->ring_chunk.data();
+      send_sqe->len = chunk;
+      return;
+    }
+
+    if (conn->file_fd != -1) {
+      close(conn->file_fd);
+      conn->file_fd = -1;
+    }
+    takeStash(conn);
+    onResponseDone(conn);
+  }
+
+  // Bytes that arrived while the connection was busy become request input
+  void takeStash(Connection *conn) {
+    if (!ring_enabled)
+      return;
+    conn->in += conn->ring_stash;
+    conn->ring_stash.clear();
+    if (conn->ring_eof)
+      conn->peer_closed = true;
+  }
+
+  void onRingCompletion(uint64_t user_data, int res, uint32_t flags) {
+    ring_op op = (ring_op)(user_data & RING_OP_MASK);
+    Connection *conn = (Connection *)(uintptr_t)(user_data & ~(uint64_t)RING_OP_MASK);
+    bool more = flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+    case RING_IGNORE:
+      return;
+    case RING_ACCEPT:
+      onRingAccept(res, more);
+      return;
+    case RING_WAKE:
+      drainCompletions();
+      if (!more)
+        ringArmWake();
+      return;
+    default:
+      break;
+    }
+
+    // A multishot receive stays in flight until its final completion
+    if (op != RING_RECV || !more)
+      conn->ring_ops--;
+    const char *data = NULL;
+    int buffer_id = -1;
+    if (op == RING_RECV) {
+      if (!more)
+        conn->ring_receiving = false;
+      if (flags & IORING_CQE_F_BUFFER) {
+        buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        data = ring.buffer(buffer_id);
+      }
+    }
+
+    if (conn->ring_closed) {
+      if (buffer_id != -1)
+        ring.recycleBuffer(buffer_id);
+      if (conn->ring_ops == 0) {
+        ring_zombies.erase(conn);
+        close(conn->fd);
+        delete conn;
+      }
+      return;
+    }
+
+    switch (op) {
+    case RING_RECV:
+      onRingRecv(conn, res, data);
+      if (buffer_id != -1)
+        ring.recycleBuffer(buffer_id);
+      break;
+    case RING_SEND:
+      if (res == -EAGAIN) {
+        ringArmPollOut(conn);
+      } else if (res <= 0) {
+        closeConnection(conn);
+      } else {
+        conn->out_offset += res;
+        ringContinueSend(conn);
+      }
+      break;
+    case RING_FILE_READ:
+      // The linked send reports the outcome of the pair
+      break;
+    case RING_FILE_SEND:
+      onRingFileSend(conn, res);
+      break;
+    case RING_POLLOUT:
+      if (res < 0)
+        closeConnection(conn);
+      else
+        ringContinueSend(conn);
+      break;
+    default:
+      break;
+    }
+  }
+
+  void onRingAccept(int res, bool more) {
+    if (res >= 0) {
+      Connection *conn = new Connection(res, this);
+      connections.insert(conn);
+      conn->idle_since = monotonic_seconds();
+      ringArmRecv(conn);
+    } else if (res == -EINVAL && ring_multishot_accept) {
+      ring_multishot_accept = false; // Kernel predates multishot accept
+    } else if (!g_shutdown_requested.load()) {
+      std::cout << "Error accepting connection: " << strerror(-res)
+                << std::endl;
+    }
+    if (!more)
+      ringArmAccept();
+  }
+
+  void onRingRecv(Connection *conn, int res, const char *data) {
+    bool reading = conn->state == conn_state::READING;
+    if (res > 0 && data != NULL) {
+      if (reading) {
+        conn->in.append(data, res);
+        conn->idle_since = monotonic_seconds();
+      } else {
+        // A worker owns conn->in; hold pipelined bytes until it is done
+        conn->ring_stash.append(data, res);
+        if (conn->ring_stash.size() > MAX_REQUEST_SIZE)
+          conn->ring_eof = true;
+      }
+    } else if (res == -EINVAL && ring_multishot_recv) {
+      ring_multishot_recv = false; // Kernel predates multishot recv
+    } else if (res != -ENOBUFS && res != -EAGAIN) {
+      // End of stream or a socket error
+      if (reading)
+        conn->peer_closed = true;
+      else
+        conn->ring_eof = true;
     }
 
-    return NULL;
+    bool ended = reading ? conn->peer_closed : conn->ring_eof;
+    if (!conn->ring_receiving && !ended)
+      ringArmRecv(conn);
+    if (!reading)
+      return;
+
+    if (conn->hasCompleteRequest()) {
+      dispatch(conn);
+      return;
+    }
+    if (conn->peer_closed || inputOverLimit(conn))
+      closeConnection(conn);
   }
+
+  void onRingFileSend(Connection *conn, int res) {
+    size_t chunk = conn->ring_chunk.size();
+    if (res < 0 && res != -EAGAIN) {
+      // Includes -ECANCELED when the linked read came up short
+      closeConnection(conn);
+      return;
+    }
+    size_t sent = res < 0 ? 0 : res;
+    conn->file_offset += chunk;
+    conn->file_remaining -= chunk;
+    if (sent < chunk) {
+      // The rest of the chunk is already in memory; send it as plain output
+      conn->out.assign(conn->ring_chunk.data() + sent, chunk - sent);
+      conn->out_offset = 0;
+    }
+    if (res == -EAGAIN)
+      ringArmPollOut(conn);
+    else
+      ringContinueSend(conn);
+  }
+#endif
 };
 
 // ConnectionContext Implementation
-static uint64_t global_request_counter = 0;
-
 ConnectionContext::ConnectionContext(int thread_id)
-    : socket_fd(-1), socket_closed(true), thread_id(thread_id) {
+    : socket_fd(-1), connection(nullptr), socket_closed(true),
+      thread_id(thread_id), log_ring(g_logger.openRing()),
+      access_ring(g_access_log.enabled() ? g_access_log.openRing() : NULL),
+      metrics(g_metrics.openShard()) {
   memset(request_buffer, 0, BUFFER_SIZE);
   memset(response_buffer, 0, BUFFER_SIZE);
-  memset((void *)&request_info, 0, sizeof(request_info));
+  request_info = RequestInfo();
   request_id = 0;
+  request_seq = 0;
   suppress_logging_for_request = false;
   request_info.thread_id = thread_id;
-  reset(-1); // Initialize with invalid socket
+  reset(nullptr); // Initialize with no connection
 }
 
 ConnectionContext::~ConnectionContext() { cleanup(); }
 
-void ConnectionContext::reset(int fd) {
-  socket_fd = fd;
+// Levels under LOG_COMPILED_LEVEL fold to false, taking the call with them
+inline bool ConnectionContext::logging(log_level level) const {
+  return static_cast<int>(level) >= LOG_COMPILED_LEVEL && level >= LOG_LEVEL &&
+         !suppress_logging_for_request;
+}
+
+// Queues the line on this worker's ring; the logger thread writes it out
+inline void ConnectionContext::log(log_level level, StrView message,
+                                   req_type type) const {
+  if (!logging(level))
+    return;
+  log_ring->write(level, type == req_type::UNKNOWN ? NULL : type_string(type),
+                  request_id, thread_id, message);
+}
+
+// printf-style log(), formatted straight into the ring slot
+template <typename... Args>
+inline void ConnectionContext::logf(log_level level, req_type type,
+                                    const char *format, Args... args) const {
+  if (!logging(level))
+    return;
+  log_ring->writef(level, type == req_type::UNKNOWN ? NULL : type_string(type),
+                   request_id, thread_id, format, args...);
+}
+
+void ConnectionContext::reset(Connection *conn) {
+  connection = conn;
+  socket_fd = conn ? conn->fd : -1;
   socket_closed = false;
+  head_request = false;
   request_buffer[0] = '\0';
   response_buffer[0] = '\0';
   request_info.type = req_type::ERROR;
   request_info.path = "";
   request_info.command = "";
   request_info.args = "";
+  request_info.dir = "";
+  request_info.file = "";
+  request_info.has_dir = false;
+  request_info.has_file = false;
   request_info.method = "";
   request_info.version = "";
   request_info.raw_path = "";
-  request_id = global_request_counter++;
+  request_info.keep_alive = false;
+  request_info.raw_output = false;
+  stream_started = false;
+  stream_chunked = false;
+  stream_header.clear();
+  stream_buffer.clear();
+  cgi_headers.clear();
+  stream_compressible = false;
+  stream_offer = -1;
+  stream_coding = -1;
+  stream_capture.reset();
+  arena.reset();
+  response_status = 0;
+  response_bytes = 0;
+  parsed_ns = 0;
+  // Unique across workers without sharing a counter between them
+  if (conn != nullptr)
+    request_id = request_seq++ * g_total_workers + thread_id;
   suppress_logging_for_request = false;
 }
 
 void ConnectionContext::cleanup() {
-  if (!socket_closed && socket_fd >= 0) {
-    close(socket_fd);
+  if (connection != nullptr) {
+    if (connection->parser.done())
+      connection->consumeRequest();
+    if (socket_closed) {
+      connection->state = conn_state::CLOSING;
+    }
+    // The loop decides whether to keep writing or close; after this call the
+    // connection may already be gone
+    connection->loop->complete(connection);
+    connection = nullptr;
   }
   socket_fd = -1;
   socket_closed = true;
@@ -157,29 +963,28 @@ void ConnectionContext::cleanup() {
 }
 
 bool ConnectionContext::readRequest() {
-  std::string request;
-  ssize_t bytes_read;
-
-  do {
-    bytes_read = read(socket_fd, request_buffer, BUFFER_SIZE - 1);
-    if (bytes_read > 0) {
-      request_buffer[bytes_read] = '\0';
-      request.append(request_buffer);
-
-      if (request.find("\r\n\r\n") != npos) {
-        break;
-      }
-    }
-    request_buffer[0] = '\0';
-  } while (bytes_read > 0);
-
-  if (bytes_read == -1) {
+  // The event loop only dispatches once the parser has finished the head
+  const HttpParser &parser = connection->parser;
+  switch (parser.status()) {
+  case http_parse::COMPLETE:
+    break;
+  case http_parse::TOO_LARGE:
+    sendResponse("431 Request Header Fields Too Large", "text/html",
+                 "<html><body><h1>431 Request Header Fields Too Large</h1>"
+                 "</body></html>");
+    return false;
+  case http_parse::BAD_REQUEST:
+    sendResponse("400 Bad Request", "text/html",
+                 "<html><body><h1>400 Bad Request</h1></body></html>");
+    return false;
+  default:
     std::cerr << "Error reading request data." << std::endl;
     return false;
   }
 
-  // Store the raw request for parsing
-  request_info.raw_path = request;
+  // Kept for logging; the head itself stays in connection->in until cleanup()
+  StrView line = parser.requestLine();
+  request_info.raw_path.assign(line.data, line.size);
   return true;
 }
 
@@ -196,202 +1001,240 @@ inline bool isCodeFile(const std::string &path) {
          lower.rfind(".h") == lower.size() - 2;
 }
 
-bool ConnectionContext::parseRequest() {
-  std::istringstream request_stream(request_info.raw_path);
-  std::string request_line;
-
-  std::getline(request_stream, request_line);
-  std::istringstream request_line_stream(request_line);
-  request_line_stream >> request_info.method >> request_info.path >>
-      request_info.version;
-
-  // Remove dangerous path traversal attempts
-  std::regex dotdot_regex("\\.\\./");
-  request_info.path = std::regex_replace(request_info.path, dotdot_regex, "");
-
-  log(log_level::TRACE, "recv " + request_info.method + " " + request_info.path,
-      req_type::UNKNOWN);
-
-  // Remove leading slash
-  if (!request_info.path.empty() && request_info.path[0] == '/') {
-    request_info.path = request_info.path.substr(1);
-  }
-  // Index request, render index.php
-  if (request_info.path.empty() || request_info.path == "/") {
-    request_info.path = "./serving_files/index.php";
-    request_info.type = req_type::PHP;
-
-  } else if (request_info.path.find("?file=") != npos &&
-             request_info.path.find("&arguments=") != npos) {
-    // Command execution request from index.php
-    size_t file_index = request_info.path.find("=");
-    size_t file_end_index = request_info.path.find("&");
-    size_t arg_index = request_info.path.find_last_of('=');
-
-    request_info.command = request_info.path.substr(
-        file_index + 1, file_end_index - file_index - 1);
-    request_info.args = request_info.path.substr(arg_index + 1);
-    request_info.type = req_type::COMMAND;
-
-  } else if (request_info.path.find("?raw_file=") != npos) {
-    // Raw file viewing request from browse_files.php
-    size_t file_index = request_info.path.find("raw_file=");
-    std::string file_path =
-        request_info.path.substr(file_index + 9); // 9 = length of "raw_file="
-
-    // Remove any trailing parameters or HTTP version
-    size_t end_pos = file_path.find_first_of("& ");
-    if (end_pos != npos) {
-      file_path = file_path.substr(0, end_pos);
-    }
-
-    // For now, simple handling of %2F -> /
-    size_t pos = 0;
-    while ((pos = file_path.find("%2F", pos)) != npos) {
-      file_path.replace(pos, 3, "/");
-      pos += 1;
-    }
-
-    request_info.path = "./serving_files/" + file_path;
-    request_info.type = req_type::FILE;
-    request_info.args = "raw";
-
-  } else if (request_info.path.find("browse_files.php") != npos ||
-             request_info.path.find("code_view.php") != npos) {
-    // Preserve original path with potential query string to extract dir
-    // parameter
-    std::string original_path = request_info.path;
-    // Route both browse_files.php and code_view.php into serving_files
-    if (original_path.find("code_view.php") != npos) {
-      request_info.path = "./serving_files/code_view.php";
-    } else {
-      request_info.path = "./serving_files/browse_files.php";
-    }
-
-    // Extract dir query parameter if present
-    std::string dir_value;
-    size_t qpos = original_path.find("?dir=");
-    // Also support viewing specific file: ?file=
-    std::string file_value;
-    size_t fpos = original_path.find("?file=");
-    if (fpos == npos) {
-      // handle when file comes after &
-      fpos = original_path.find("&file=");
-    }
-    if (qpos != npos) {
-      dir_value = original_path.substr(qpos + 5);
-      size_t end_pos = dir_value.find_first_of("& ");
-      if (end_pos != npos) {
-        dir_value = dir_value.substr(0, end_pos);
-      }
+// Routing. A route fills in request_info from the request path and its
+// query parameters; handleRequest then dispatches on the resulting type. It
+// returns false if the request is malformed.
+typedef bool (*route_fn)(RequestInfo &info, StrView path,
+                         const QueryParams &query);
+
+// file=<program>&arguments=<args> from the index.php form, or raw_command
+// instead of file for the program's output as-is
+static bool route_command(RequestInfo &info, StrView, const QueryParams &query) {
+  info.raw_output = query.has("raw_command");
+  info.command =
+      (info.raw_output ? query.get("raw_command") : query.get("file")).str();
+  info.args = query.get("arguments").str();
+  // The index.php form submits these form-encoded (spaces as '+')
+  url_decode_in_place(info.command, true);
+  url_decode_in_place(info.args, true);
+  info.type = req_type::COMMAND;
+  return true;
+}
 
-      // Decode minimal encoding for forward slashes
-      size_t pos = 0;
-      while ((pos = dir_value.find("%2F", pos)) != npos) {
-        dir_value.replace(pos, 3, "/");
-        pos += 1;
-      }
+// raw_file=<path> links from browse_files.php
+static bool route_raw_file(RequestInfo &info, StrView,
+                           const QueryParams &query) {
+  std::string file_path = "/" + query.get("raw_file").str();
+  // urlencode() output from browse_files.php, kept inside the web root
+  url_decode_in_place(file_path, true);
+  size_t length = file_path.size();
+  if (!normalize_path(&file_path[0], length))
+    return false;
+  info.path = "./serving_files";
+  info.path.append(file_path, 0, length);
+  info.type = req_type::FILE;
+  info.args = "raw";
+  return true;
+}
 
-      // Pass as key=value so PHP CLI can parse into $_GET via argv
-      request_info.args = "dir=" + dir_value;
-      if (fpos != npos) {
-        file_value = original_path.substr(fpos + 6);
-        size_t fend = file_value.find_first_of("& ");
-        if (fend != npos)
-          file_value = file_value.substr(0, fend);
-        // Minimal decode
-        size_t p = 0;
-        while ((p = file_value.find("%2F", p)) != npos) {
-          file_value.replace(p, 3, "/");
-          p += 1;
-        }
-        // Only pass file to code_view for allowed extensions
-        std::string lower = file_value;
-        for (char &ch : lower)
-          ch = std::tolower(static_cast<unsigned char>(ch));
-        bool isCode = isCodeFile(file_value);
-        if (original_path.find("code_view.php") != npos && !isCode) {
-          // drop file arg if not a code file
-        } else {
-          request_info.args += " file=" + file_value;
-        }
-      }
-      request_info.type = req_type::DIRECTORY;
-    } else {
-      // No dir provided; still pass file if present
-      if (fpos != npos) {
-        file_value = original_path.substr(fpos + 6);
-        size_t fend = file_value.find_first_of("& ");
-        if (fend != npos)
-          file_value = file_value.substr(0, fend);
-        size_t p = 0;
-        while ((p = file_value.find("%2F", p)) != npos) {
-          file_value.replace(p, 3, "/");
-          p += 1;
-        }
-        // Only pass file to code_view for allowed extensions
-        bool isCode = isCodeFile(file_value);
-        if (original_path.find("code_view.php") != npos && !isCode) {
-          request_info.args = ""; // drop
-        } else {
-          request_info.args = "file=" + file_value;
-        }
-      } else {
-        request_info.args = "";
-      }
-      request_info.type = req_type::PHP;
-    }
-  } else { // Regular file request
-    // Check if it's a PHP file
-    if (request_info.path.find(".php") != npos) {
-      request_info.type = req_type::PHP;
-      // Extract query string if present and strip from path
-      size_t qmark_index = request_info.path.find("?");
-      if (qmark_index != npos) {
-        request_info.args = request_info.path.substr(qmark_index + 1);
-        size_t end_pos = request_info.args.find_first_of(" ");
-        if (end_pos != npos) {
-          request_info.args = request_info.args.substr(0, end_pos);
-        }
-        request_info.path = request_info.path.substr(0, qmark_index);
-      }
-      // Add serving_files path if not already present
-      if (request_info.path.find("serving_files") == npos) {
-        request_info.path = "./serving_files/" + request_info.path;
-      }
-    } else {
-      // Assume it's a regular file
-      request_info.type = req_type::FILE;
-      // Remove query string if present
-      size_t qmark_index = request_info.path.find("?");
-      if (qmark_index != npos) {
-        request_info.path = request_info.path.substr(0, qmark_index - 1);
-      }
-      request_info.path = "./serving_files/" + request_info.path;
+static bool route_index(RequestInfo &info, StrView, const QueryParams &) {
+  info.path = "./serving_files/index.php";
+  info.type = req_type::PHP;
+  return true;
+}
+
+// browse_files.php, the directory listing the server renders itself, and
+// code_view.php. dir and file are also kept as key=value args so the PHP
+// CLI can parse them into $_GET via argv; there they stay percent-encoded
+// since PHP decodes them itself. code_view only gets file for source files.
+static bool route_viewer(RequestInfo &info, StrView path,
+                         const QueryParams &query) {
+  bool code_view = path.equals("/code_view.php");
+  info.path = code_view ? "./serving_files/code_view.php"
+                        : "./serving_files/browse_files.php";
+  std::string file_arg;
+  if (query.has("file")) {
+    info.file = query.get("file").str();
+    url_decode_in_place(info.file, true);
+    info.has_file = true;
+    if (!code_view || isCodeFile(info.file))
+      file_arg = "file=" + query.get("file").str();
+  }
+  if (query.has("dir")) {
+    info.dir = query.get("dir").str();
+    url_decode_in_place(info.dir, true);
+    info.has_dir = true;
+    info.args = "dir=" + query.get("dir").str();
+    if (!file_arg.empty())
+      info.args += " " + file_arg;
+  } else {
+    info.args = file_arg;
+  }
+  info.type = code_view ? req_type::PHP : req_type::DIRECTORY;
+  return true;
+}
+
+// Anything else under the web root: scripts run with the query string as
+// their arguments, other files are served
+static bool route_static(RequestInfo &info, StrView path,
+                         const QueryParams &query) {
+  info.path = "./serving_files/";
+  info.path.append(path.data + 1, path.size - 1);
+  if (path.size >= 4 && memcmp(path.data + path.size - 4, ".php", 4) == 0) {
+    info.args = query.raw().str();
+    info.type = req_type::PHP;
+  } else {
+    info.type = req_type::FILE;
+  }
+  return true;
+}
+
+// Routes picked by a query parameter (plus a second one that must also be
+// present), whatever the path: the PHP pages link to them relatively. These
+// are checked, in order, before the path routes.
+struct ParamRoute {
+  const char *param;
+  const char *also;
+  route_fn route;
+};
+static const ParamRoute param_routes[] = {
+    {"raw_command", "arguments", route_command},
+    {"file", "arguments", route_command},
+    {"raw_file", NULL, route_raw_file},
+};
+
+// Counters and latency histograms, answered by the server itself
+static bool route_metrics(RequestInfo &info, StrView, const QueryParams &) {
+  info.type = req_type::METRICS;
+  return true;
+}
+
+static Router<route_fn> build_path_routes() {
+  Router<route_fn> routes;
+  routes.exact("/", route_index);
+  routes.exact("/metrics", route_metrics);
+  routes.exact("/browse_files.php", route_viewer);
+  routes.exact("/code_view.php", route_viewer);
+  routes.prefix("/", route_static);
+  return routes;
+}
+
+static const Router<route_fn> &path_routes() {
+  static const Router<route_fn> routes = build_path_routes();
+  return routes;
+}
+
+bool ConnectionContext::parseRequest() {
+  const HttpParser &parser = connection->parser;
+  StrView method = parser.method();
+  StrView target = parser.target();
+  StrView version = parser.version();
+  request_info.method.assign(method.data, method.size);
+  request_info.version.assign(version.data, version.size);
+  head_request = method.equals("HEAD");
+
+  // Only the headers that decide connection reuse matter here
+  bool close_requested = false;
+  bool keep_alive_requested = false;
+  bool has_body = false;
+  for (size_t i = 0; i < parser.headerCount(); ++i) {
+    StrView name = parser.headerName(i);
+    StrView value = parser.headerValue(i);
+    if (name.iequals("connection")) {
+      close_requested = value.icontains("close");
+      keep_alive_requested = value.icontains("keep-alive");
+    } else if (name.iequals("content-length")) {
+      // We never read request bodies, so the stream cannot be reused
+      for (size_t j = 0; j < value.size; ++j)
+        has_body = has_body || value.data[j] != '0';
+    } else if (name.iequals("transfer-encoding")) {
+      has_body = true;
     }
   }
+  if (request_info.version == "HTTP/1.1") {
+    request_info.keep_alive = !close_requested && !has_body;
+  } else {
+    request_info.keep_alive = keep_alive_requested && !has_body;
+  }
+
+  logf(log_level::TRACE, req_type::UNKNOWN, "recv %.*s %.*s",
+       static_cast<int>(method.size), method.data,
+       static_cast<int>(target.size), target.data);
+
+  // Split off the query and route on the path alone. The path is normalized
+  // in place in an arena copy of the target, so "..", "." and "//" are
+  // resolved before any route sees it and the query stays where it is.
+  char *full_target = static_cast<char *>(arena.allocate(target.size, 1));
+  memcpy(full_target, target.data, target.size);
+  const char *qmark =
+      static_cast<const char *>(memchr(full_target, '?', target.size));
+  size_t path_length = qmark == NULL ? target.size : qmark - full_target;
+  if (!normalize_path(full_target, path_length)) {
+    logf(log_level::ERROR, req_type::UNKNOWN, "rejected path %.*s",
+         static_cast<int>(target.size), target.data);
+    return false;
+  }
+  StrView path(full_target, path_length);
+  QueryParams query;
+  if (qmark != NULL)
+    query.parse(StrView(qmark + 1, full_target + target.size - qmark - 1));
+
+  route_fn route = NULL;
+  for (const ParamRoute &param_route : param_routes) {
+    if (query.has(param_route.param) &&
+        (param_route.also == NULL || query.has(param_route.also))) {
+      route = param_route.route;
+      break;
+    }
+  }
+  if (route == NULL && !path_routes().match(path, route)) {
+    request_info.path.assign(path.data, path.size);
+    request_info.type = req_type::ERROR;
+  } else if (!route(request_info, path, query)) {
+    logf(log_level::ERROR, req_type::UNKNOWN, "rejected request for %.*s",
+         static_cast<int>(target.size), target.data);
+    return false;
+  }
+
   // Early suppression: silence logs for static style assets
   if (request_info.path.find("./serving_files/style/") != npos) {
+    log(log_level::INFO, "static asset request.", req_type::UNKNOWN);
     suppress_logging_for_request = true;
-    std::cout << "[#" << request_id << "] " << "T" << thread_id
-              << ": static asset request." << std::endl;
   }
 
-  log(log_level::TRACE, request_info.print(), req_type::UNKNOWN);
+  if (logging(log_level::TRACE))
+    log(log_level::TRACE, request_info.print(arena), req_type::UNKNOWN);
   return true;
 }
 
 void ConnectionContext::handleRequest() {
-  log(log_level::TRACE,
-      "handleRequest:start thread " + std::to_string(thread_id),
-      req_type::UNKNOWN);
+  uint64_t started_ns = monotonic_nanos();
+  serveRequest();
+  recordMetrics(started_ns);
+  if (access_ring != NULL)
+    logAccess(started_ns);
+}
+
+void ConnectionContext::serveRequest() {
+  logf(log_level::TRACE, req_type::UNKNOWN, "handleRequest:start thread %d",
+       thread_id);
+  connection->keep_alive = false;
   if (!readRequest()) {
     log(log_level::ERROR, "readRequest failed", req_type::UNKNOWN);
     return;
   }
 
-  if (!parseRequest()) {
-    sendErrorResponse("Failed to parse request");
+  bool parsed = parseRequest();
+  parsed_ns = monotonic_nanos();
+  connection->requests_served++;
+  connection->keep_alive =
+      parsed && request_info.keep_alive && !connection->peer_closed &&
+      connection->requests_served < KEEPALIVE_MAX_REQUESTS &&
+      !g_shutdown_requested.load();
+
+  if (!parsed) {
+    sendResponse("400 Bad Request", "text/html",
+                 "<html><body><h1>400 Bad Request</h1></body></html>");
     log(log_level::ERROR, "parseRequest failed", req_type::UNKNOWN);
     return;
   }
@@ -413,10 +1256,17 @@ void ConnectionContext::handleRequest() {
     success = handleFileRequest();
     break;
   case req_type::DIRECTORY:
+    log(log_level::TRACE, "dispatch:DIRECTORY", req_type::DIRECTORY);
+    success = handleDirectoryRequest();
+    break;
   case req_type::PHP:
     log(log_level::TRACE, "dispatch:PHP", req_type::PHP);
     success = handlePhpRequest(request_info.path, request_info.args);
     break;
+  case req_type::METRICS:
+    log(log_level::TRACE, "dispatch:METRICS", req_type::METRICS);
+    success = handleMetricsRequest();
+    break;
   case req_type::ERROR:
   default:
     sendErrorResponse("Invalid request type");
@@ -431,63 +1281,300 @@ void ConnectionContext::handleRequest() {
   }
 }
 
-bool ConnectionContext::handleCommandRequest() {
-  log(log_level::TRACE, "handleCommandRequest:begin", req_type::COMMAND);
-  std::vector<std::string> filenames;
-  scan_directory("./Executables", filenames);
+// Stage timings and counters for the request just served. The loop adds
+// the send and total stages once the last byte is out.
+void ConnectionContext::recordMetrics(uint64_t started_ns) {
+  uint64_t now_ns = monotonic_nanos();
+  uint64_t ready_ns = connection->ready_ns != 0 ? connection->ready_ns
+                                                : started_ns;
+  size_t type = static_cast<size_t>(request_info.type);
+  metrics->record(type, metric_stage::QUEUE, started_ns - ready_ns);
+  if (parsed_ns != 0) {
+    metrics->record(type, metric_stage::PARSE, parsed_ns - started_ns);
+    metrics->record(type, metric_stage::HANDLE, now_ns - parsed_ns);
+  }
+  metrics->countRequest(type, response_status, response_bytes);
+  connection->ready_ns = ready_ns;
+  connection->handled_ns = now_ns;
+  connection->handled_type = request_info.type;
+}
 
-  bool found_executable = false;
-  std::string full_command = request_info.command;
+static_assert(static_cast<size_t>(req_type::UNKNOWN) < METRICS_TYPES,
+              "every req_type needs a metrics slot");
 
-  for (const std::string &file : filenames) {
-    if (request_info.command == file) {
-      full_command = "./Executables/" + request_info.command;
-      found_executable = true;
-      break;
+// Metric labels, indexed by req_type; UNKNOWN is never recorded
+static const char *const *metric_type_names() {
+  struct Names {
+    const char *names[METRICS_TYPES];
+    Names() : names() {
+      for (int type = 0; type < static_cast<int>(req_type::UNKNOWN); ++type)
+        names[type] = type_string(static_cast<req_type>(type));
     }
-  }
+  };
+  static const Names table;
+  return table.names;
+}
 
-  if (!found_executable) {
-    sendErrorResponse("Executable not found: " + request_info.command);
-    log(log_level::ERROR, "executable not found: " + request_info.command,
-        req_type::COMMAND);
-    return false;
-  }
+// Prometheus text format: request counters and stage histograms merged
+// from every thread, then gauges read at scrape time
+bool ConnectionContext::handleMetricsRequest() {
+  std::string body;
+  body.reserve(64 * 1024);
+  g_metrics.render(body, metric_type_names());
+
+  size_t queued = 0;
+  pthread_mutex_lock(&g_pools_mutex);
+  for (ThreadPool *pool : g_pools)
+    queued += pool->queued();
+  pthread_mutex_unlock(&g_pools_mutex);
+  size_t php_running = 0, php_busy = 0;
+  g_php_pool.counts(php_running, php_busy);
+  metrics_gauge(body, "capture_queued_tasks",
+                "Connections and background tasks waiting for a worker",
+                queued);
+  metrics_gauge(body, "capture_child_processes",
+                "Commands and CLI PHP runs in flight", g_active_children.load());
+  metrics_gauge(body, "capture_php_cgi_processes",
+                "php-cgi backends running", php_running);
+  metrics_gauge(body, "capture_php_cgi_busy",
+                "php-cgi backends serving a request", php_busy);
+  metrics_family(body, "capture_dropped_total", "counter",
+                 "Log records and access log entries lost to full rings");
+  body += "capture_dropped_total{log=\"server\"} " +
+          std::to_string(g_logger.droppedRecords()) + "\n";
+  body += "capture_dropped_total{log=\"access\"} " +
+          std::to_string(g_access_log.droppedEntries()) + "\n";
+  return sendResponse("200 OK", "text/plain; version=0.0.4; charset=utf-8",
+                      body);
+}
 
-  if (!suppress_logging_for_request) {
-    log(log_level::TRACE,
-        "exec: " + full_command + " args='" + request_info.args + "'",
-        req_type::COMMAND);
+// Queue the request just served on this worker's access log ring. Only
+// memory writes and clock reads; the writer thread does the formatting.
+void ConnectionContext::logAccess(uint64_t started_ns) {
+  AccessEntry *entry = access_ring->claim();
+  if (entry == NULL)
+    return;
+  uint64_t now_ns = monotonic_nanos();
+  uint64_t ready_ns = connection->ready_ns != 0 ? connection->ready_ns
+                                                : started_ns;
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  entry->status = response_status;
+  entry->thread_id = thread_id;
+  entry->request_id = request_id;
+  entry->time_us = static_cast<uint64_t>(wall.tv_sec) * 1000000 +
+                   wall.tv_nsec / 1000 - (now_ns - started_ns) / 1000;
+  entry->bytes = response_bytes;
+  entry->wait_us = static_cast<uint32_t>((started_ns - ready_ns) / 1000);
+  entry->parse_us = static_cast<uint32_t>(
+      parsed_ns != 0 ? (parsed_ns - started_ns) / 1000 : 0);
+  entry->handle_us =
+      static_cast<uint32_t>(parsed_ns != 0 ? (now_ns - parsed_ns) / 1000 : 0);
+  entry->total_us = static_cast<uint32_t>((now_ns - ready_ns) / 1000);
+
+  // One getpeername() per connection, not per request
+  if (!connection->peer_known) {
+    socklen_t length = sizeof(connection->peer);
+    if (getpeername(socket_fd, reinterpret_cast<struct sockaddr *>(
+                                   &connection->peer),
+                    &length) != 0)
+      connection->peer.ss_family = AF_UNSPEC;
+    connection->peer_known = true;
+  }
+  entry->family = 0;
+  if (connection->peer.ss_family == AF_INET) {
+    const struct sockaddr_in *peer =
+        reinterpret_cast<const struct sockaddr_in *>(&connection->peer);
+    entry->family = AF_INET;
+    memcpy(entry->address, &peer->sin_addr, sizeof(peer->sin_addr));
+  } else if (connection->peer.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *peer =
+        reinterpret_cast<const struct sockaddr_in6 *>(&connection->peer);
+    entry->family = AF_INET6;
+    memcpy(entry->address, &peer->sin6_addr, sizeof(peer->sin6_addr));
   }
 
-  // Prepare argv for spawn
-  std::vector<char *> argv;
-  argv.push_back(const_cast<char *>(full_command.c_str()));
-
-  // Parse arguments
-  std::istringstream args_stream(request_info.args);
-  std::string arg;
-  std::vector<std::string> arg_storage;
-
-  while (args_stream >> arg) {
-    arg_storage.push_back(arg);
+  const HttpParser &parser = connection->parser;
+  if (parser.status() == http_parse::COMPLETE) {
+    entry->setText(parser.method(), parser.target(), parser.version(),
+                   parser.header("referer"), parser.header("user-agent"));
+  } else {
+    entry->setText(StrView(), StrView(), StrView(), StrView(), StrView());
   }
+  access_ring->publish();
+}
 
-  for (auto &stored_arg : arg_storage) {
-    argv.push_back(const_cast<char *>(stored_arg.c_str()));
+bool ConnectionContext::handleCommandRequest() {
+  log(log_level::TRACE, "handleCommandRequest:begin", req_type::COMMAND);
+  if (!directory_has_file("./Executables", request_info.command)) {
+    sendErrorResponse(arena.format("Executable not found: %s",
+                                   request_info.command.c_str()));
+    logf(log_level::ERROR, req_type::COMMAND, "executable not found: %s",
+         request_info.command.c_str());
+    return false;
   }
+  StrView full_command =
+      arena.format("./Executables/%s", request_info.command.c_str());
+
+  logf(log_level::TRACE, req_type::COMMAND, "exec: %s args='%s'",
+       full_command.data, request_info.args.c_str());
+
+  // argv for spawn: the program, then the arguments split on whitespace in
+  // an arena copy
+  ArenaVector<char *> argv((ArenaAllocator<char *>(&arena)));
+  argv.reserve(request_info.args.size() / 2 + 3);
+  argv.push_back(const_cast<char *>(full_command.data));
+  char *args = const_cast<char *>(
+      arena.format("%s", request_info.args.c_str()).data);
+  char *save = NULL;
+  for (char *arg = strtok_r(args, " \t\r\n\v\f", &save); arg != NULL;
+       arg = strtok_r(NULL, " \t\r\n\v\f", &save))
+    argv.push_back(arg);
   argv.push_back(NULL);
 
-  // Capture command output
+  if (request_info.raw_output || g_php_pool.available()) {
+    pid_t pid;
+    int output_fd = spawn_with_pipe(argv.data(), pid);
+    if (output_fd == -1) {
+      sendErrorResponse("Failed to run: " + request_info.command);
+      return false;
+    }
+    // Raw mode relays stdout unchanged; otherwise it is streamed straight
+    // into index.php's FastCGI request body
+    bool ok = request_info.raw_output
+                  ? relayOutput(output_fd)
+                  : executeFastCgi("./serving_files/index.php", "", output_fd);
+    // If we bailed early the child sees EPIPE instead of blocking forever
+    close(output_fd);
+    reap_child(pid);
+    return ok;
+  }
+
+  // Capture command output and execute index.php with it
   std::stringstream output;
   spawn_and_capture(argv.data(), output);
-
-  // Execute index.php with the output
   std::string php_command =
       "php ./serving_files/index.php '" + output.str() + "'";
   return executePHP(php_command);
 }
 
+// Cache entry for a file or one of its sidecars (coding >= 0), without its
+// body: validators, and the 200 and 304 header blocks for both connection
+// modes. The file's own entry records which sidecars it can be sent as.
+static std::shared_ptr<CachedFile> describe_file(const std::string &path,
+                                                 const struct stat &file_stat,
+                                                 const std::string &content_type,
+                                                 bool force_plain, int coding) {
+  std::shared_ptr<CachedFile> entry = std::make_shared<CachedFile>();
+  entry->path = path;
+  entry->content_type = content_type;
+  entry->force_plain = force_plain;
+  entry->has_body = false;
+  entry->etag = file_etag(file_stat);
+  entry->mtime = file_stat.st_mtime;
+  entry->size = file_stat.st_size;
+  entry->checked_at = time(NULL);
+  entry->codings = 0;
+  if (coding >= 0) {
+    entry->encoding_header =
+        std::string("Content-Encoding: ") + content_codings[coding].token +
+        "\r\n";
+  } else if (!force_plain) {
+    // A sidecar older than the file would serve stale content
+    for (int c = 0; c < CONTENT_CODINGS; ++c) {
+      std::string sidecar = path + content_codings[c].suffix;
+      struct stat sidecar_stat;
+      if (stat(sidecar.c_str(), &sidecar_stat) == 0 &&
+          S_ISREG(sidecar_stat.st_mode) &&
+          sidecar_stat.st_mtime >= file_stat.st_mtime) {
+        entry->codings |= 1u << c;
+        entry->coded_paths[c] = sidecar;
+      }
+    }
+  }
+  // Hashed names never change content; everything else is revalidated.
+  // Caches must key on Accept-Encoding wherever a sidecar may be chosen.
+  entry->entity_headers =
+      "ETag: " + entry->etag + "\r\nLast-Modified: " +
+      http_date(file_stat.st_mtime) + "\r\nCache-Control: " +
+      (is_content_hashed(path)
+           ? "public, max-age=" + std::to_string(IMMUTABLE_MAX_AGE) +
+                 ", immutable"
+           : std::string("no-cache")) +
+      "\r\n" +
+      (coding >= 0 || entry->codings != 0 ? "Vary: Accept-Encoding\r\n"
+                                          : "");
+  const std::string &validators = entry->entity_headers;
+  std::string full_headers =
+      validators + entry->encoding_header + "Accept-Ranges: bytes\r\n";
+  entry->header_keep_alive = response_header("200 OK", content_type,
+                                             entry->size, true, full_headers);
+  entry->header_close = response_header("200 OK", content_type, entry->size,
+                                        false, full_headers);
+  // No body and no Content-Length
+  entry->not_modified_keep_alive = "HTTP/1.1 304 Not Modified\r\n" +
+                                   validators + connection_header(true) +
+                                   "\r\n";
+  entry->not_modified_close = "HTTP/1.1 304 Not Modified\r\n" + validators +
+                              connection_header(false) + "\r\n";
+  return entry;
+}
+
+// Cache entry for a file (coding -1) or its sidecar for a coding, read and
+// inserted on a miss; null if it cannot be opened. Large bodies are not
+// held, and the caller opens the file to send them. A sidecar takes the
+// content_type of its file; otherwise an empty one is derived from path.
+std::shared_ptr<const CachedFile>
+ConnectionContext::loadFile(const std::string &path,
+                            const std::string &content_type, bool force_plain,
+                            int coding) {
+  // A sidecar requested by its own name shares the key of its entry as a
+  // sidecar; whichever comes second is read but not cached
+  std::shared_ptr<const CachedFile> cached = g_file_cache.lookup(path);
+  if (cached && cached->force_plain == force_plain &&
+      cached->encoding_header.empty() == (coding < 0))
+    return cached;
+  uint64_t generation = g_file_cache.prepareFill(path);
+
+  int file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat file_stat;
+  if (file_fd == -1 || fstat(file_fd, &file_stat) == -1 ||
+      !S_ISREG(file_stat.st_mode)) {
+    if (file_fd != -1)
+      close(file_fd);
+    return nullptr;
+  }
+  std::shared_ptr<CachedFile> entry = describe_file(
+      path, file_stat,
+      !content_type.empty() ? content_type
+      : force_plain         ? std::string("text/plain")
+                            : determineContentType(path),
+      force_plain, coding);
+
+  // Small files are read once into the cache and served from memory
+  size_t file_size = file_stat.st_size;
+  if (file_size <= FILE_CACHE_MAX_FILE) {
+    entry->body.resize(file_size);
+    size_t filled = 0;
+    while (filled < file_size) {
+      ssize_t n = pread(file_fd, &entry->body[filled], file_size - filled,
+                        filled);
+      if (n <= 0 && !(n == -1 && errno == EINTR))
+        break;
+      if (n > 0)
+        filled += n;
+    }
+    if (filled == file_size)
+      entry->has_body = true;
+    else
+      entry->body.clear();
+  }
+  close(file_fd);
+  // Large (or short-read) files: only the headers are cached
+  g_file_cache.insert(entry, generation);
+  return entry;
+}
+
 bool ConnectionContext::handleFileRequest() {
   log(log_level::TRACE, "handleFileRequest:begin", req_type::FILE);
   // Check if this is a raw file request (from browse_files.php)
@@ -498,126 +1585,820 @@ bool ConnectionContext::handleFileRequest() {
     return handlePhpRequest(request_info.path);
   }
 
-  // Otherwise, serve the file content (including PHP files as raw text)
-  FILE *file = fopen(request_info.path.c_str(), "rb");
+  // Serve certain types as plain text when requested raw
+  bool force_plain = is_raw_request &&
+                     (request_info.path.find(".php") != npos ||
+                      request_info.path.find(".wasm") != npos);
+
+  // Headers (and the body, unless the file is large) are normally already
+  // in memory, so a revalidation or a cached body needs no filesystem
+  // calls. A large file that changed before the watcher noticed is looked
+  // up once more.
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    std::shared_ptr<const CachedFile> entry =
+        loadFile(request_info.path, "", force_plain, -1);
+    if (!entry)
+      break;
+    if (entry->codings != 0) {
+      int coding = negotiate_coding(
+          connection->parser.header("accept-encoding"), entry->codings);
+      std::shared_ptr<const CachedFile> encoded;
+      if (coding >= 0)
+        encoded = loadFile(entry->coded_paths[coding], entry->content_type,
+                           false, coding);
+      if (encoded)
+        entry = encoded;
+    }
+    if (notModified(*entry))
+      return sendNotModified(*entry);
+    if (entry->has_body)
+      return serveFile(*entry, -1);
+    int file_fd = open(entry->path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 &&
+        file_stat.st_size == entry->size &&
+        file_stat.st_mtime == entry->mtime)
+      return serveFile(*entry, file_fd);
+    if (file_fd != -1)
+      close(file_fd);
+    g_file_cache.invalidate(entry->path);
+  }
+
+  sendErrorResponse(
+      arena.format("File not found: %s", request_info.path.c_str()));
+  logf(log_level::ERROR, req_type::FILE, "file open failed: %s",
+       request_info.path.c_str());
+  return false;
+}
+
+// The listing page for browse_files.php?dir=, rendered the way the PHP
+// script did: entries from the listing cache, filled into the templates in
+// dir_listing.hpp. file= redirects to its code view, as the script did.
+bool ConnectionContext::handleDirectoryRequest() {
+  log(log_level::TRACE, "handleDirectoryRequest:begin", req_type::DIRECTORY);
+  if (request_info.has_file && request_info.file.find("..") == npos) {
+    ArenaString location((ArenaAllocator<char>(&arena)));
+    location.append("code_view.php?file=");
+    url_encode_append(location, request_info.file);
+    if (request_info.has_dir) {
+      location.append("&dir=");
+      url_encode_append(location, request_info.dir);
+    }
+    if (response_status == 0)
+      response_status = 302;
+    StrView header = arena.format(
+        "HTTP/1.1 302 Found\r\nLocation: %s\r\nContent-Type: text/html\r\n"
+        "%sContent-Length: 0\r\n\r\n",
+        location.c_str(), connectionHeader().c_str());
+    return sendData(header.data, header.size);
+  }
+
+  // Anything trying to climb out of the web root lists the root instead
+  StrView dir = request_info.has_dir && request_info.dir.find("..") == npos
+                    ? StrView(request_info.dir)
+                    : StrView(".");
+  std::shared_ptr<const CompressedResponse> compressed =
+      offerCompression(request_info.path, request_info.args);
+  if (compressed)
+    return sendCompressed(*compressed);
+
+  // A missing or unreadable directory lists as empty, as scandir() failing
+  // did
+  static const DirListing empty_listing = DirListing();
+  std::shared_ptr<const DirListing> listing =
+      g_dir_listings.get(arena.format("./serving_files/%.*s",
+                                      static_cast<int>(dir.size), dir.data)
+                             .str());
+  ArenaString page((ArenaAllocator<char>(&arena)));
+  page.reserve(4096);
+  render_listing(page, dir, listing ? *listing : empty_listing);
+  if (!stream_compressible)
+    return sendResponse("200 OK", "text/html", page);
+  // Compressed (or not, by size and budget) and marked Vary as PHP output
+  return beginStream("200 OK", "text/html") &&
+         streamData(page.data(), page.size()) && endStream();
+}
+
+// The whole file or the requested ranges of it. file_fd is -1 when the
+// body is cached; otherwise the file is sent from it and it is closed.
+bool ConnectionContext::serveFile(const CachedFile &entry, int file_fd) {
+  ByteRange ranges[RANGE_MAX_PARTS];
+  int count = requestedRanges(entry, ranges);
+  if (count != 0)
+    return sendRanges(entry, file_fd, ranges, count);
+  if (entry.has_body)
+    return sendCached(entry);
+  return sendLargeFile(entry, file_fd);
+}
+
+// Ranges of a GET to honor: 0 to send the whole file (no Range, a Range
+// we ignore, or an If-Range naming another version), -1 if unsatisfiable
+int ConnectionContext::requestedRanges(const CachedFile &entry,
+                                       ByteRange *ranges) const {
+  StrView range = connection->parser.header("range");
+  if (range.empty() || request_info.method != "GET")
+    return 0;
+  StrView if_range = connection->parser.header("if-range");
+  if (!if_range.empty()) {
+    // An entity tag must match exactly (weak tags never do), a date must
+    // be the file's Last-Modified
+    time_t since;
+    bool current = if_range.data[0] == '"'
+                       ? if_range.equals(entry.etag.c_str())
+                       : parse_http_date(if_range, since) &&
+                             since == entry.mtime;
+    if (!current)
+      return 0;
+  }
+  int count = parse_byte_ranges(range, entry.size, ranges, RANGE_MAX_PARTS);
+  // The parts of a multipart body cannot carry a Content-Encoding, so a
+  // sidecar is sent whole instead
+  if (count > 1 && !entry.encoding_header.empty())
+    return 0;
+  return count;
+}
+
+// 206 with one range as the body, several as multipart/byteranges, or 416.
+// Cached bodies are sliced from memory; otherwise a single range goes out
+// with sendfile() from its offset, and multipart bodies are sent one part
+// at a time, since the connection queues only one file segment.
+bool ConnectionContext::sendRanges(const CachedFile &entry, int file_fd,
+                                   const ByteRange *ranges, int count) {
+  unsigned long long size = entry.size;
+  if (count < 0) {
+    if (file_fd != -1)
+      close(file_fd);
+    if (response_status == 0)
+      response_status = 416;
+    StrView header = arena.format(
+        "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%llu"
+        "\r\n%sContent-Length: 0\r\n\r\n",
+        size, connectionHeader().c_str());
+    return sendData(header.data, header.size);
+  }
+  if (response_status == 0)
+    response_status = 206;
+
+  if (count == 1) {
+    unsigned long long first = ranges[0].first, last = ranges[0].last;
+    StrView header = arena.format(
+        "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n%s%s"
+        "Content-Range: bytes %llu-%llu/%llu\r\n%sContent-Length: %llu"
+        "\r\n\r\n",
+        entry.content_type.c_str(), entry.entity_headers.c_str(),
+        entry.encoding_header.c_str(), first, last, size,
+        connectionHeader().c_str(), last - first + 1);
+    if (!sendData(header.data, header.size)) {
+      if (file_fd != -1)
+        close(file_fd);
+      return false;
+    }
+    if (file_fd == -1)
+      return sendData(entry.body.data() + first, last - first + 1);
+    return sendFile(file_fd, first, last - first + 1);
+  }
+
+  // Part headers first, to know the Content-Length
+  unsigned long long boundary = request_id * 0x9e3779b97f4a7c15ULL ^
+                                monotonic_nanos();
+  StrView part_headers[RANGE_MAX_PARTS];
+  unsigned long long length = 0;
+  for (int i = 0; i < count; ++i) {
+    part_headers[i] = arena.format(
+        "\r\n--%016llx\r\nContent-Type: %s\r\nContent-Range: bytes "
+        "%llu-%llu/%llu\r\n\r\n",
+        boundary, entry.content_type.c_str(),
+        static_cast<unsigned long long>(ranges[i].first),
+        static_cast<unsigned long long>(ranges[i].last), size);
+    length += part_headers[i].size + ranges[i].last - ranges[i].first + 1;
+  }
+  StrView closing = arena.format("\r\n--%016llx--\r\n", boundary);
+  length += closing.size;
+  StrView header = arena.format(
+      "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; "
+      "boundary=%016llx\r\n%s%sContent-Length: %llu\r\n\r\n",
+      boundary, entry.entity_headers.c_str(), connectionHeader().c_str(),
+      length);
+  bool ok = sendData(header.data, header.size);
+  for (int i = 0; ok && i < count; ++i) {
+    size_t part_length = ranges[i].last - ranges[i].first + 1;
+    ok = sendData(part_headers[i].data, part_headers[i].size);
+    if (ok && file_fd == -1) {
+      ok = sendData(entry.body.data() + ranges[i].first, part_length);
+    } else if (ok) {
+      int part_fd = dup(file_fd);
+      ok = part_fd != -1 && sendFile(part_fd, ranges[i].first, part_length) &&
+           waitSent();
+    }
+  }
+  if (file_fd != -1)
+    close(file_fd);
+  if (!ok) {
+    // The framing is broken; the client cannot use what it got
+    socket_closed = true;
+    return false;
+  }
+  return sendData(closing.data, closing.size);
+}
+
+// Streams a file whose headers are cached; the connection owns file_fd
+bool ConnectionContext::sendLargeFile(const CachedFile &entry, int file_fd) {
+  const std::string &header =
+      connection->keep_alive ? entry.header_keep_alive : entry.header_close;
+  if (response_status == 0)
+    response_status = 200;
+  if (!sendData(header.data(), header.size())) {
+    close(file_fd);
+    return false;
+  }
+  if (!sendFile(file_fd, 0, entry.size)) {
+    log(log_level::ERROR, "sendFile failed during file send", req_type::FILE);
+    return false;
+  }
+  return true;
+}
+
+// GET or HEAD whose If-None-Match (or, without one, If-Modified-Since)
+// says the client's copy is current
+bool ConnectionContext::notModified(const CachedFile &entry) const {
+  if (request_info.method != "GET" && request_info.method != "HEAD")
+    return false;
+  StrView if_none_match = connection->parser.header("if-none-match");
+  if (!if_none_match.empty())
+    return etag_matches(if_none_match, entry.etag);
+  StrView if_modified_since = connection->parser.header("if-modified-since");
+  time_t since;
+  return !if_modified_since.empty() &&
+         parse_http_date(if_modified_since, since) && entry.mtime <= since;
+}
+
+bool ConnectionContext::sendNotModified(const CachedFile &entry) {
+  const std::string &header = connection->keep_alive
+                                  ? entry.not_modified_keep_alive
+                                  : entry.not_modified_close;
+  if (response_status == 0)
+    response_status = 304;
+  return sendData(header.data(), header.size());
+}
+
+bool ConnectionContext::handlePhpRequest(const std::string &php_path,
+                                         const std::string &args) {
+  log(log_level::TRACE, "handlePhpRequest:begin", req_type::PHP);
+  std::shared_ptr<const CompressedResponse> compressed =
+      offerCompression(php_path, args);
+  if (compressed)
+    return sendCompressed(*compressed);
+  if (g_php_pool.available()) {
+    return executeFastCgi(php_path, args);
+  }
+  // Build PHP command; executePHP streams the response as output arrives
+  std::string php_command = "php " + php_path;
+  if (!args.empty()) {
+    php_command += " '" + args + "'";
+  }
+  return executePHP(php_command);
+}
+
+bool ConnectionContext::executePHP(const std::string &php_command) {
+  // Output is streamed chunked as PHP produces it
+  logf(log_level::TRACE, req_type::PHP, "php: %s", php_command.c_str());
+
+  FILE *fp = popen(php_command.c_str(), "r");
+  if (fp == NULL) {
+    log(log_level::ERROR, "popen failed for php command", req_type::PHP);
+    return false;
+  }
+  g_active_children.fetch_add(1, std::memory_order_relaxed);
+
+  bool ok = beginStream("200 OK", "text/html") && streamFromFd(fileno(fp));
+
+  int rc = pclose(fp);
+  g_active_children.fetch_sub(1, std::memory_order_relaxed);
+  if (rc == -1) {
+    log(log_level::ERROR, "pclose failed for php process", req_type::PHP);
+  }
+  if (!ok) {
+    log(log_level::ERROR, "write failed streaming PHP output", req_type::PHP);
+    socket_closed = true;
+    return false;
+  }
+  return endStream();
+}
+
+// Files a viewer page's output is made from, besides its arguments: the
+// script (code_view.php) or the web root (the native directory listing),
+// and the file or directory named by dir= or file=. Other scripts,
+// index.php running commands above all, may depend on anything, so their
+// output is compressed but not cached.
+static bool viewer_inputs(
+    const std::string &php_path, const std::string &args,
+    std::vector<std::pair<std::string, int64_t>> &inputs) {
+  bool browse = php_path == "./serving_files/browse_files.php";
+  if (!browse && php_path != "./serving_files/code_view.php")
+    return false;
+  const std::string &first = browse ? std::string("./serving_files") : php_path;
+  inputs.push_back(std::make_pair(first, input_version(first)));
+  // key=value pairs as route_viewer builds them, still percent-encoded
+  size_t start = 0;
+  while (start < args.size()) {
+    size_t end = args.find(' ', start);
+    if (end == npos)
+      end = args.size();
+    size_t equals = args.find('=', start);
+    if (equals != npos && equals < end) {
+      std::string value = args.substr(equals + 1, end - equals - 1);
+      url_decode_in_place(value, true);
+      if (value.find("..") != npos)
+        return false;
+      std::string path = "./serving_files/" + value;
+      inputs.push_back(std::make_pair(path, input_version(path)));
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// Lets the PHP response about to be streamed be compressed with the best
+// coding the client accepts. Returns the finished response instead if a
+// viewer already produced it for the same arguments and unchanged inputs.
+std::shared_ptr<const CompressedResponse>
+ConnectionContext::offerCompression(const std::string &php_path,
+                                    const std::string &args) {
+  if (!g_compress || compress_codings() == 0)
+    return nullptr;
+  stream_compressible = true;
+  stream_offer = negotiate_coding(connection->parser.header("accept-encoding"),
+                                  compress_codings());
+  if (stream_offer < 0)
+    return nullptr;
+  std::string key = php_path + "?" + args + "#" +
+                    content_codings[stream_offer].token;
+  std::shared_ptr<const CompressedResponse> cached =
+      g_compressed_cache.lookup(key);
+  if (cached)
+    return cached;
+  // Input versions are taken before the script runs, so a change while it
+  // does makes the cached copy miss next time
+  std::shared_ptr<CompressedResponse> capture =
+      std::make_shared<CompressedResponse>();
+  if (viewer_inputs(php_path, args, capture->inputs)) {
+    capture->key = key;
+    stream_capture = capture;
+  }
+  return nullptr;
+}
+
+// At the first flush of an offered response: compress only if it is big
+// enough and the CPU budget allows, and announce it in the held-back header
+void ConnectionContext::startCompression() {
+  int coding = stream_offer;
+  stream_offer = -1;
+  int level = g_compress_level != 0 ? g_compress_level
+              : coding == 2         ? COMPRESS_GZIP_LEVEL
+                                    : COMPRESS_ZSTD_LEVEL;
+  if (stream_buffer.size() < g_compress_min || !g_compress_budget.available() ||
+      !compressor.begin(coding, level)) {
+    stream_capture.reset();
+    return;
+  }
+  stream_coding = coding;
+  std::string encoding = std::string("Content-Encoding: ") +
+                         content_codings[coding].token + "\r\n";
+  // Ahead of the blank line that ends the header block
+  stream_header.insert(stream_header.size() - 2, encoding);
+  if (stream_capture)
+    stream_capture->headers += encoding;
+}
+
+// Whether a block of "Name: value\r\n" lines has the named header
+static bool has_header(const std::string &headers, const char *name) {
+  size_t length = strlen(name);
+  size_t line = 0;
+  while (line < headers.size()) {
+    if (headers.size() - line > length && headers[line + length] == ':' &&
+        StrView(headers.data() + line, length).iequals(name))
+      return true;
+    line = headers.find('\n', line);
+    if (line == npos)
+      break;
+    line++;
+  }
+  return false;
+}
+
+// Start a response whose length is not known yet. HTTP/1.1 clients get
+// chunked encoding; older ones get a body terminated by closing the socket.
+// The header is held back so it can go out with the first chunk.
+bool ConnectionContext::beginStream(const std::string &status,
+                                    const std::string &content_type,
+                                    const std::string &extra_headers) {
+  stream_chunked = request_info.version == "HTTP/1.1";
+  if (!stream_chunked)
+    connection->keep_alive = false;
+  noteStatus(status);
+
+  stream_compressible = stream_compressible &&
+                        status.compare(0, 3, "200") == 0 &&
+                        compressible_type(content_type) &&
+                        !has_header(extra_headers, "content-encoding");
+  if (!stream_compressible) {
+    stream_offer = -1;
+    stream_capture.reset();
+  }
+
+  stream_header = "HTTP/1.1 " + status + "\r\n";
+  stream_header += "Content-Type: " + content_type + "\r\n";
+  stream_header += extra_headers;
+  if (stream_compressible)
+    stream_header += "Vary: Accept-Encoding\r\n";
+  if (stream_capture)
+    stream_capture->headers =
+        stream_header.substr(stream_header.find('\n') + 1);
+  stream_header += connectionHeader();
+  if (stream_chunked)
+    stream_header += "Transfer-Encoding: chunked\r\n";
+  stream_header += "\r\n";
+  stream_buffer.clear();
+  stream_started = true;
+  return true;
+}
 
-  if (file == NULL) {
-    sendErrorResponse("File not found: " + request_info.path);
-    log(log_level::ERROR, "file open failed: " + request_info.path,
-        req_type::FILE);
-    return false;
+bool ConnectionContext::streamData(const char *data, size_t length) {
+  stream_buffer.append(data, length);
+  if (stream_buffer.size() >= STREAM_FLUSH_THRESHOLD)
+    return flushStream();
+  return true;
+}
+
+// Emit buffered output as one chunk (plus the terminator when final)
+bool ConnectionContext::flushStream(bool final) {
+  // Whether to compress is decided once there is enough to be worth it
+  if (stream_offer >= 0) {
+    if (!final && stream_buffer.size() < g_compress_min)
+      return true;
+    startCompression();
+  }
+  if (stream_coding >= 0 && (final || !stream_buffer.empty())) {
+    uint64_t started_ns = thread_cpu_nanos();
+    stream_compressed.clear();
+    bool ok = compressor.write(stream_buffer.data(), stream_buffer.size(),
+                               final, stream_compressed);
+    g_compress_budget.charge(thread_cpu_nanos() - started_ns);
+    if (!ok) {
+      log(log_level::ERROR, "compression failed", req_type::PHP);
+      return false;
+    }
+    stream_buffer.swap(stream_compressed);
+    if (stream_capture) {
+      if (stream_capture->body.size() + stream_buffer.size() >
+          COMPRESS_CACHE_MAX_ENTRY)
+        stream_capture.reset();
+      else
+        stream_capture->body += stream_buffer;
+    }
+    if (final && stream_capture) {
+      g_compressed_cache.insert(stream_capture);
+      stream_capture.reset();
+    }
   }
 
-  // Determine content type
-  std::string content_type;
-  if (is_raw_request) {
-    // Serve certain types as plain text when requested raw
-    if (request_info.path.find(".php") != npos ||
-        request_info.path.find(".wasm") != npos) {
-      content_type = "text/plain";
+  std::string frame;
+  frame.swap(stream_header);
+  if (head_request) {
+    // Produced (and cached) as for GET, but only the header goes out
+    stream_buffer.clear();
+  } else if (!stream_buffer.empty()) {
+    if (stream_chunked) {
+      char size_line[32];
+      snprintf(size_line, sizeof(size_line), "%zx\r\n", stream_buffer.size());
+      frame += size_line;
+      frame += stream_buffer;
+      frame += "\r\n";
     } else {
-      content_type = determineContentType(request_info.path);
+      frame += stream_buffer;
     }
-  } else {
-    content_type = determineContentType(request_info.path);
+    stream_buffer.clear();
   }
+  if (final && stream_chunked && !head_request)
+    frame += "0\r\n\r\n";
+  if (frame.empty())
+    return true;
+  if (!sendData(frame.data(), frame.size()))
+    return false;
+  return waitWritable();
+}
 
-  // Get file size
-  fseek(file, 0, SEEK_END);
-  size_t file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  // Send header
-  sendResponseHeader("200 OK", content_type, file_size);
-
-  // Send file content
-  while (!feof(file) && !ferror(file)) {
-    size_t bytes_read = fread(response_buffer, 1, BUFFER_SIZE, file);
+bool ConnectionContext::endStream() { return flushStream(true); }
 
+// Stream everything read from fd until EOF, flushing whenever the producer
+// pauses so the client sees output promptly
+bool ConnectionContext::streamFromFd(int fd) {
+  while (true) {
+    ssize_t bytes_read = read(fd, response_buffer, BUFFER_SIZE);
     if (bytes_read > 0) {
-      if (!sendData(response_buffer, bytes_read)) {
-        log(log_level::ERROR, "sendData failed during file send",
-            req_type::FILE);
+      if (!streamData(response_buffer, bytes_read))
         return false;
-      }
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 0) == 0 && !flushStream())
+        return false;
+      continue;
     }
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+    return true;
   }
-
-  return !ferror(file);
 }
 
-bool ConnectionContext::handlePhpRequest(const std::string &php_path,
-                                         const std::string &args) {
-  log(log_level::TRACE, "handlePhpRequest:begin", req_type::PHP);
-  // Build PHP command, do not pre-send header; executePHP will send with
-  // content-length
-  std::string php_command = "php " + php_path;
-  if (!args.empty()) {
-    php_command += " '" + args + "'";
+// Send a child's stdout to the client unchanged. On Linux each batch the
+// pipe holds is spliced into the socket without passing through userspace;
+// FIONREAD sizes the chunk up front so only the framing is written by hand.
+bool ConnectionContext::relayOutput(int pipe_fd) {
+  beginStream("200 OK", "text/plain; charset=utf-8");
+  if (head_request)
+    return streamFromFd(pipe_fd) && endStream(); // Output read and dropped
+#ifdef __linux__
+  std::string framing;
+  framing.swap(stream_header);
+  while (true) {
+    struct pollfd pfd = {pipe_fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+      continue;
+    int available = 0;
+    if (ioctl(pipe_fd, FIONREAD, &available) == -1)
+      break;
+    if (available == 0) {
+      // Writer closed the pipe
+      if (stream_chunked)
+        framing += "0\r\n\r\n";
+      return sendData(framing.data(), framing.size());
+    }
+    if (stream_chunked) {
+      char size_line[32];
+      snprintf(size_line, sizeof(size_line), "%x\r\n", available);
+      framing += size_line;
+    }
+    // Spliced bytes bypass connection->out, so everything queued before
+    // them has to reach the socket first
+    if (!sendData(framing.data(), framing.size()) || !waitWritable(0))
+      return false;
+    framing = stream_chunked ? "\r\n" : "";
+
+    size_t remaining = available;
+    while (remaining > 0) {
+      ssize_t moved = splice(pipe_fd, NULL, socket_fd, NULL, remaining,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved > 0) {
+        remaining -= moved;
+        response_bytes += moved;
+      } else if (moved == -1 && errno == EINTR) {
+        continue;
+      } else if (moved == -1 && errno == EAGAIN) {
+        struct pollfd out = {socket_fd, POLLOUT, 0};
+        if (poll(&out, 1, SEND_TIMEOUT_SEC * 1000) == 0) {
+          socket_closed = true;
+          log(log_level::ERROR, "client stalled during raw output",
+              req_type::COMMAND);
+          return false;
+        }
+      } else if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        // No splice for this socket; copy the announced bytes instead
+        while (remaining > 0) {
+          ssize_t bytes_read = read(pipe_fd, response_buffer,
+                                    std::min(remaining, (size_t)BUFFER_SIZE));
+          if (bytes_read == -1 && errno == EINTR)
+            continue;
+          if (bytes_read <= 0 || !sendData(response_buffer, bytes_read)) {
+            socket_closed = true;
+            return false;
+          }
+          remaining -= bytes_read;
+        }
+        // The chunk's closing CRLF goes out ahead of the next chunk
+        stream_header = framing;
+        return streamFromFd(pipe_fd) && endStream();
+      } else {
+        socket_closed = true;
+        log(log_level::ERROR, "splice failed during raw output",
+            req_type::COMMAND);
+        return false;
+      }
+    }
   }
-  return executePHP(php_command);
+  stream_header = framing;
+#endif
+  return streamFromFd(pipe_fd) && endStream();
 }
 
-bool ConnectionContext::executePHP(const std::string &php_command) {
-  // Buffer full PHP output so we can set Content-Length for a clean finish
-  std::string final_command = php_command;
-
-  if (!suppress_logging_for_request) {
-    log(log_level::TRACE, "php: " + final_command, req_type::PHP);
+// Backpressure for streamed responses: block this worker until the client
+// drains the queued output to at most max_backlog bytes
+bool ConnectionContext::waitWritable(size_t max_backlog) {
+  while (connection->out.size() - connection->out_offset > max_backlog) {
+    struct pollfd pfd = {socket_fd, POLLOUT, 0};
+    int rc = poll(&pfd, 1, SEND_TIMEOUT_SEC * 1000);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc <= 0) {
+      socket_closed = true;
+      log(log_level::ERROR, "client stalled during streamed response",
+          req_type::UNKNOWN);
+      return false;
+    }
+    if (!flushPending())
+      return false;
   }
+  return true;
+}
 
-  FILE *fp = popen(final_command.c_str(), "r");
-  if (fp == NULL) {
-    log(log_level::ERROR, "popen failed for php command", req_type::PHP);
-    return false;
+// Blocks until all queued output, file data included, is on the socket
+bool ConnectionContext::waitSent() {
+  while (connection->hasPendingOutput()) {
+    struct pollfd pfd = {socket_fd, POLLOUT, 0};
+    int rc = poll(&pfd, 1, SEND_TIMEOUT_SEC * 1000);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc <= 0) {
+      socket_closed = true;
+      log(log_level::ERROR, "client stalled during ranged response",
+          req_type::FILE);
+      return false;
+    }
+    if (!flushPending())
+      return false;
   }
+  return true;
+}
 
-  std::string php_output;
-  while (fgets(response_buffer, BUFFER_SIZE, fp) != NULL) {
-    php_output.append(response_buffer);
-    response_buffer[0] = '\0';
+// Split a CGI header block into the HTTP status, content type and the
+// headers worth passing on
+static void translate_cgi_headers(const std::string &cgi, std::string &status,
+                                  std::string &content_type,
+                                  std::string &extra_headers) {
+  status = "200 OK";
+  content_type = "text/html";
+  extra_headers.clear();
+  bool has_status = false;
+  bool has_location = false;
+  std::istringstream header_stream(cgi);
+  std::string line;
+  while (std::getline(header_stream, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    size_t colon = line.find(':');
+    if (colon == npos)
+      continue;
+    std::string name = line.substr(0, colon);
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    std::string lower = name;
+    for (char &ch : lower)
+      ch = std::tolower(static_cast<unsigned char>(ch));
+
+    if (lower == "status") {
+      status = value;
+      has_status = true;
+    } else if (lower == "content-type") {
+      content_type = value;
+    } else if (lower == "content-length" || lower == "connection" ||
+               lower == "transfer-encoding" || lower == "keep-alive") {
+      // We frame the response ourselves
+    } else {
+      has_location = has_location || lower == "location";
+      extra_headers += name + ": " + value + "\r\n";
+    }
   }
+  if (has_location && !has_status)
+    status = "302 Found";
+}
 
-  int rc = pclose(fp);
-  if (rc == -1) {
-    log(log_level::ERROR, "pclose failed for php process", req_type::PHP);
-    return false;
+// Feeds a spawned command's stdout to FastCGI as the request body
+static ssize_t read_fd_source(void *arg, char *buffer, size_t length) {
+  int fd = *static_cast<int *>(arg);
+  while (true) {
+    ssize_t n = read(fd, buffer, length);
+    if (n >= 0 || errno != EINTR)
+      return n;
   }
+}
 
-  // Now send a complete response with Content-Length
-  std::string header = "HTTP/1.1 200 OK\r\n";
-  header += "Content-Type: text/html\r\n";
-  header += "Connection: close\r\n";
-  header += "Content-Length: " + std::to_string(php_output.size()) + "\r\n\r\n";
+bool ConnectionContext::fastCgiSink(void *arg, const char *data,
+                                    size_t length) {
+  ConnectionContext *ctx = static_cast<ConnectionContext *>(arg);
+  if (length == 0)
+    return !ctx->stream_started || ctx->flushStream();
+  return ctx->streamCgiOutput(data, length);
+}
 
-  if (write(socket_fd, header.c_str(), header.length()) == -1) {
-    socket_closed = true;
-    log(log_level::ERROR, "write failed sending PHP header", req_type::PHP);
+// Hold output until the CGI header block ends, then stream the body
+bool ConnectionContext::streamCgiOutput(const char *data, size_t length,
+                                        bool at_end) {
+  if (stream_started)
+    return streamData(data, length);
+
+  cgi_headers.append(data, length);
+  const char *begin = cgi_headers.data();
+  const char *end = begin + cgi_headers.size();
+  const char *terminator = scan_find_header_end(begin, end);
+  size_t header_end = terminator == end ? npos : terminator - begin;
+  size_t body_start = header_end + 4;
+  if (header_end == npos) {
+    header_end = cgi_headers.find("\n\n");
+    body_start = header_end + 2;
+  }
+  if (header_end == npos) {
+    if (!at_end && cgi_headers.size() < MAX_REQUEST_SIZE)
+      return true;
+    // No header block at all; treat everything as body
+    header_end = 0;
+    body_start = 0;
+  }
+
+  std::string status, content_type, extra_headers;
+  translate_cgi_headers(cgi_headers.substr(0, header_end), status,
+                        content_type, extra_headers);
+  if (!beginStream(status, content_type, extra_headers))
     return false;
+  bool ok = streamData(cgi_headers.data() + body_start,
+                       cgi_headers.size() - body_start);
+  cgi_headers.clear();
+  return ok;
+}
+
+// Run a script on the persistent php-cgi pool. args use the same key=value
+// form as the CLI path and become the query string; body_fd, if given, is
+// read to the end and fed to the script as php://input. Output is streamed
+// to the client as it arrives.
+bool ConnectionContext::executeFastCgi(const std::string &php_path,
+                                       const std::string &args, int body_fd) {
+  std::string script = php_path;
+  if (script.compare(0, 2, "./") == 0)
+    script = script.substr(2);
+  std::string query = args;
+  std::replace(query.begin(), query.end(), ' ', '&');
+
+  logf(log_level::TRACE, req_type::PHP, "fastcgi: %s?%s", script.c_str(),
+       query.c_str());
+
+  const std::string &root = g_php_pool.documentRoot();
+  FastCgiParams params;
+  params.push_back({"GATEWAY_INTERFACE", "CGI/1.1"});
+  params.push_back({"SERVER_SOFTWARE", "capture_server"});
+  params.push_back({"SERVER_PROTOCOL", request_info.version});
+  params.push_back({"REQUEST_METHOD", body_fd == -1 ? "GET" : "POST"});
+  params.push_back({"REQUEST_URI", "/" + script + (query.empty() ? "" : "?" +
+                                                   query)});
+  params.push_back({"SCRIPT_NAME", "/" + script});
+  params.push_back({"SCRIPT_FILENAME", root + "/" + script});
+  params.push_back({"DOCUMENT_ROOT", root});
+  params.push_back({"QUERY_STRING", query});
+  if (body_fd != -1) {
+    // Length is unknown up front; PHP reads php://input to the end
+    params.push_back({"CONTENT_TYPE", "text/plain"});
+  }
+  // php-cgi refuses to run without this when cgi.force_redirect is on
+  params.push_back({"REDIRECT_STATUS", "200"});
+
+  FastCgiResponse response;
+  bool ok = g_php_pool.execute(params, body_fd == -1 ? NULL : read_fd_source,
+                               &body_fd, fastCgiSink, this, response);
+  if (!response.stderr_data.empty()) {
+    logf(log_level::ERROR, req_type::PHP, "php stderr: %s",
+         response.stderr_data.c_str());
   }
-  if (!php_output.empty()) {
-    if (write(socket_fd, php_output.c_str(), php_output.size()) == -1) {
+  if (ok && !stream_started) {
+    // Output ended inside (or without) the header block
+    ok = streamCgiOutput("", 0, true);
+  }
+
+  if (!ok) {
+    log(log_level::ERROR, "fastcgi request failed", req_type::PHP);
+    if (!stream_started) {
+      sendResponse("502 Bad Gateway", "text/html",
+                   "<html><body><h1>502 Bad Gateway</h1></body></html>");
+    } else {
+      // Headers are out; the only way to signal failure is to cut it short
       socket_closed = true;
-      log(log_level::ERROR, "write failed sending PHP body", req_type::PHP);
-      return false;
     }
+    return false;
   }
-  return true;
+  return endStream();
 }
 
 bool ConnectionContext::sendResponse(const std::string &status,
                                      const std::string &content_type,
-                                     const std::string &body) {
-  std::string response = "HTTP/1.1 " + status + "\r\n";
-  response += "Content-Type: " + content_type + "\r\n";
-  response += "Connection: close\r\n";
-  response += "Content-Length: " + std::to_string(body.length()) + "\r\n";
-  response += "\r\n";
-  response += body;
-
-  ssize_t w = write(socket_fd, response.c_str(), response.length());
-  if (w == -1) {
-    socket_closed = true;
+                                     StrView body) {
+  noteStatus(status);
+  StrView header = arena.format(
+      "HTTP/1.1 %s\r\nContent-Type: %s\r\n%sContent-Length: %zu\r\n\r\n",
+      status.c_str(), content_type.c_str(), connectionHeader().c_str(),
+      body.size);
+  // One write for header and body
+  ArenaString response((ArenaAllocator<char>(&arena)));
+  response.reserve(header.size + body.size);
+  response.append(header.data, header.size);
+  if (!head_request)
+    response.append(body.data, body.size);
+
+  if (!sendData(response.data(), response.size())) {
     log(log_level::ERROR, "write failed in sendResponse", req_type::PHP);
     return false;
   }
@@ -627,44 +2408,248 @@ bool ConnectionContext::sendResponse(const std::string &status,
 bool ConnectionContext::sendResponseHeader(const std::string &status,
                                            const std::string &content_type,
                                            size_t content_length) {
-  std::string header = "HTTP/1.1 " + status + "\r\n";
-  header += "Content-Type: " + content_type + "\r\n";
-  header += "Connection: close\r\n";
+  noteStatus(status);
+  StrView header = arena.format(
+      "HTTP/1.1 %s\r\nContent-Type: %s\r\n%sContent-Length: %zu\r\n\r\n",
+      status.c_str(), content_type.c_str(),
+      connection_header(connection != nullptr && connection->keep_alive)
+          .c_str(),
+      content_length);
+
+  if (!sendData(header.data, header.size)) {
+    log(log_level::ERROR, "write failed in sendResponseHeader", req_type::PHP);
+    return false;
+  }
+  return true;
+}
+
+// The first status line of the response, for the access log
+void ConnectionContext::noteStatus(const std::string &status) {
+  if (response_status == 0)
+    response_status = static_cast<uint16_t>(atoi(status.c_str()));
+}
+
+bool ConnectionContext::sendData(const char *data, size_t length) {
+  if (socket_closed)
+    return false;
+  response_bytes += length;
 
-  if (content_length > 0) {
-    header += "Content-Length: " + std::to_string(content_length) + "\r\n";
+  // Keep ordering: once anything is queued, everything after it queues too
+  if (connection->hasPendingOutput()) {
+    connection->out.append(data, length);
+    return true;
   }
 
-  header += "\r\n";
+  while (length > 0) {
+    ssize_t written = write(socket_fd, data, length);
+    if (written > 0) {
+      data += written;
+      length -= written;
+      continue;
+    }
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Socket buffer is full; the event loop finishes this once writable
+      connection->out.assign(data, length);
+      connection->out_offset = 0;
+      return true;
+    }
+    socket_closed = true;
+    log(log_level::ERROR, "write failed in sendData", req_type::PHP);
+    return false;
+  }
+
+  return true;
+}
+
+// Queue a file range behind any buffered output and start pushing it out.
+// Must be the last part of the response. Takes ownership of file_fd.
+bool ConnectionContext::sendFile(int file_fd, off_t offset, size_t length) {
+  if (socket_closed) {
+    close(file_fd);
+    return false;
+  }
+  if (length == 0 || head_request) {
+    close(file_fd);
+    return true;
+  }
+  response_bytes += length;
+  connection->file_fd = file_fd;
+  connection->file_offset = offset;
+  connection->file_remaining = length;
+  return flushPending();
+}
+
+// Push the pending file range with sendfile(), letting the kernel copy from
+// the page cache straight into the socket. Falls back to pread()/write()
+// through response_buffer where sendfile() is unsupported for the file.
+// Returns false if the response can no longer be completed.
+bool ConnectionContext::transferFile() {
+  static const size_t max_chunk = 1 << 30;
+  bool use_sendfile = true;
+
+  while (connection->file_remaining > 0) {
+    size_t chunk = std::min(connection->file_remaining, max_chunk);
+    ssize_t sent;
+    if (use_sendfile) {
+#ifdef __linux__
+      off_t offset = connection->file_offset;
+      sent = sendfile(socket_fd, connection->file_fd, &offset, chunk);
+#elif defined(__APPLE__)
+      off_t len = chunk;
+      sent = sendfile(connection->file_fd, socket_fd,
+                      connection->file_offset, &len, NULL, 0);
+      // Partial sends report EAGAIN but still move len bytes
+      if (sent == -1 && errno == EAGAIN && len > 0)
+        sent = len;
+      else if (sent == 0)
+        sent = len;
+#else
+      sent = -1;
+      errno = ENOSYS;
+#endif
+      if (sent == -1 && (errno == EINVAL || errno == ENOSYS ||
+                         errno == ENOTSUP || errno == EOPNOTSUPP)) {
+        use_sendfile = false;
+        continue;
+      }
+    } else {
+      ssize_t bytes_read =
+          pread(connection->file_fd, response_buffer,
+                std::min(chunk, (size_t)BUFFER_SIZE), connection->file_offset);
+      if (bytes_read <= 0) {
+        sent = bytes_read;
+      } else {
+        // Only what the socket accepted counts; the rest is re-read later
+        sent = write(socket_fd, response_buffer, bytes_read);
+      }
+    }
 
-  ssize_t w = write(socket_fd, header.c_str(), header.length());
-  if (w == -1) {
+    if (sent > 0) {
+      connection->file_offset += sent;
+      connection->file_remaining -= sent;
+      continue;
+    }
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    // Error, or the file shrank under us; the framing is now broken
     socket_closed = true;
-    log(log_level::ERROR, "write failed in sendResponseHeader", req_type::PHP);
+    log(log_level::ERROR, "file transfer failed", req_type::FILE);
     return false;
   }
+
+  close(connection->file_fd);
+  connection->file_fd = -1;
   return true;
 }
 
-bool ConnectionContext::sendData(const char *data, size_t length) {
+// Header and body from the cache go out in a single writev()
+bool ConnectionContext::sendCached(const CachedFile &entry) {
+  const std::string &header =
+      connection->keep_alive ? entry.header_keep_alive : entry.header_close;
+  if (response_status == 0)
+    response_status = 200;
+  return sendHeaderAndBody(StrView(header.data(), header.size()), entry.body);
+}
+
+// A cached compressed PHP response, framed by its known length
+bool ConnectionContext::sendCompressed(const CompressedResponse &entry) {
+  if (response_status == 0)
+    response_status = 200;
+  StrView header = arena.format(
+      "HTTP/1.1 200 OK\r\n%s%sContent-Length: %zu\r\n\r\n",
+      entry.headers.c_str(), connectionHeader().c_str(), entry.body.size());
+  return sendHeaderAndBody(header, entry.body);
+}
+
+// Header and body in one writev() where the socket takes them
+bool ConnectionContext::sendHeaderAndBody(StrView header,
+                                          const std::string &body) {
   if (socket_closed)
     return false;
+  if (head_request)
+    return sendData(header.data, header.size);
+  if (connection->hasPendingOutput()) {
+    return sendData(header.data, header.size) &&
+           sendData(body.data(), body.size());
+  }
+
+  size_t total = header.size + body.size();
+  response_bytes += total;
+  size_t sent = 0;
+  while (sent < total) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    size_t body_offset = sent > header.size ? sent - header.size : 0;
+    if (sent < header.size) {
+      iov[iovcnt].iov_base = const_cast<char *>(header.data) + sent;
+      iov[iovcnt].iov_len = header.size - sent;
+      iovcnt++;
+    }
+    if (body_offset < body.size()) {
+      iov[iovcnt].iov_base = const_cast<char *>(body.data()) + body_offset;
+      iov[iovcnt].iov_len = body.size() - body_offset;
+      iovcnt++;
+    }
 
-  ssize_t written = write(socket_fd, data, length);
-  if (written == -1) {
+    ssize_t written = writev(socket_fd, iov, iovcnt);
+    if (written > 0) {
+      sent += written;
+      continue;
+    }
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Keep the unsent tail; the event loop finishes it once writable
+      connection->out.clear();
+      connection->out_offset = 0;
+      if (sent < header.size)
+        connection->out.append(header.data + sent, header.size - sent);
+      connection->out.append(body, body_offset, npos);
+      return true;
+    }
     socket_closed = true;
-    log(log_level::ERROR, "write failed in sendData", req_type::PHP);
+    log(log_level::ERROR, "writev failed in sendHeaderAndBody",
+        req_type::UNKNOWN);
     return false;
   }
-
   return true;
 }
 
-void ConnectionContext::sendErrorResponse(const std::string &message) {
-  std::string html = "<html><body><h1>404 Not Found</h1>";
-  html += "<p>" + message + "</p>";
-  html += "<a href='/'>Back to home</a></body></html>";
+bool ConnectionContext::flushPending() {
+  std::string &out = connection->out;
+  while (connection->out_offset < out.size()) {
+    size_t offset = connection->out_offset;
+    ssize_t written =
+        write(socket_fd, out.data() + offset, out.size() - offset);
+    if (written > 0) {
+      connection->out_offset += written;
+      continue;
+    }
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    socket_closed = true;
+    log(log_level::ERROR, "write failed in flushPending", req_type::UNKNOWN);
+    return false;
+  }
+  out.clear();
+  connection->out_offset = 0;
+  return transferFile();
+}
+
+const std::string &ConnectionContext::connectionHeader() const {
+  return connection_header(connection != nullptr && connection->keep_alive);
+}
 
+void ConnectionContext::sendErrorResponse(StrView message) {
+  StrView html = arena.format("<html><body><h1>404 Not Found</h1><p>%.*s</p>"
+                              "<a href='/'>Back to home</a></body></html>",
+                              static_cast<int>(message.size), message.data);
   sendResponse("404 Not Found", "text/html", html);
 }
 
@@ -696,30 +2681,21 @@ ConnectionContext::determineContentType(const std::string &filepath) {
   return "text/plain";
 }
 
-void ConnectionContext::log(log_level level, const std::string &message,
-                            req_type type) const {
-  if (suppress_logging_for_request)
-    return;
-  if (level < LOG_LEVEL)
-    return;
-  if (type == req_type::UNKNOWN)
-    std::cout << "[#" << request_id << "] " << " T:" << thread_id << " "
-              << log_string(level) << ": " << message << std::endl;
-  else
-    std::cout << "[#" << request_id << "] " << " T:" << thread_id << " "
-              << log_string(level) << ": TYPE=" << type_string(type) << ": " << message
-              << std::endl;
-}
 
-void spawn_and_capture(char *argv[], std::stringstream &output) {
+// Spawn argv with its stdout on a pipe; returns the read end, or -1
+int spawn_with_pipe(char *argv[], pid_t &pid) {
   int pipefd[2];
-  pid_t pid;
-  char buffer[BUFFER_SIZE];
 
-  if (pipe(pipefd) == -1) {
+  // Close-on-exec so concurrently spawned children (other commands, php-cgi)
+  // never inherit the write end and hold the pipe open
+#ifdef __linux__
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+#else
+  if (pipe(pipefd) == -1 || fcntl(pipefd[0], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(pipefd[1], F_SETFD, FD_CLOEXEC) == -1) {
+#endif
     perror("pipe");
-    output << "Error creating pipe\n";
-    return;
+    return -1;
   }
 
   posix_spawn_file_actions_t actions;
@@ -732,12 +2708,12 @@ void spawn_and_capture(char *argv[], std::stringstream &output) {
 
   if (posix_spawn(&pid, program, &actions, NULL, argv, environ) != 0) {
     perror("posix_spawn");
-    output << "Error spawning process\n";
     posix_spawn_file_actions_destroy(&actions);
     close(pipefd[0]);
     close(pipefd[1]);
-    return;
+    return -1;
   }
+  g_active_children.fetch_add(1, std::memory_order_relaxed);
 
   posix_spawn_file_actions_destroy(&actions);
 
@@ -745,108 +2721,328 @@ void spawn_and_capture(char *argv[], std::stringstream &output) {
   // printf("exec %s pid=%d child=%d\n", program, getpid(), pid);
 
   close(pipefd[1]);
+  return pipefd[0];
+}
+
+void spawn_and_capture(char *argv[], std::stringstream &output) {
+  pid_t pid;
+  char buffer[BUFFER_SIZE];
+
+  int output_fd = spawn_with_pipe(argv, pid);
+  if (output_fd == -1) {
+    output << "Error spawning process\n";
+    return;
+  }
 
   ssize_t bytes_read;
-  while ((bytes_read = read(pipefd[0], buffer, BUFFER_SIZE - 1)) > 0) {
+  while ((bytes_read = read(output_fd, buffer, BUFFER_SIZE - 1)) > 0) {
     buffer[bytes_read] = '\0';
     output << buffer;
   }
 
-  close(pipefd[0]);
+  close(output_fd);
+  reap_child(pid);
+}
 
+// Waits for a child from spawn_with_pipe
+void reap_child(pid_t pid) {
   int status;
   waitpid(pid, &status, 0);
+  g_active_children.fetch_sub(1, std::memory_order_relaxed);
 }
 
-void scan_directory(const std::string &directory,
-                    std::vector<std::string> &filenames) {
-  DIR *dir = opendir(directory.c_str());
+// True if name is a regular file directly inside directory
+bool directory_has_file(const char *directory, StrView name) {
+  DIR *dir = opendir(directory);
   if (dir == nullptr) {
     std::cerr << "Failed to open directory: " << directory << std::endl;
-    return;
+    return false;
   }
 
+  bool found = false;
   struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    if (entry->d_type == DT_REG) {
-      filenames.push_back(entry->d_name);
-    }
+  while (!found && (entry = readdir(dir)) != nullptr) {
+    found = entry->d_type == DT_REG && name.equals(entry->d_name);
   }
   closedir(dir);
+  return found;
 }
 
 // Main function
-int main() {
+struct ServerOptions {
+  int port;
+  size_t shards;  // Independent listener + event loop + worker pool sets
+  size_t threads; // Workers per shard
+  int backlog;
+  bool pin;       // Pin each shard's threads to one CPU
+  bool io_uring;  // Completion-based I/O instead of epoll (Linux)
+  std::string access_log; // Access log file, empty for none
+  access_format access_log_format;
+  uint64_t access_log_rotate; // Bytes before the access log is rotated
+  bool compress;          // Compress PHP output for clients that accept it
+  int compress_level;     // 0 for each codec's default
+  size_t compress_min;    // Smallest response worth compressing
+  unsigned compress_cpu;  // Percent of one core compression may use
+  size_t compress_cache;  // Bytes of compressed viewer output kept
+};
+
+static void print_usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--port N] [--shards N] [--threads N] [--backlog N] [--pin]"
+               " [--io-uring]\n"
+            << "  --shards N   SO_REUSEPORT listeners, each with its own event "
+               "loop and workers (default 1)\n"
+            << "  --threads N  worker threads per shard (default "
+            << NUM_THREADS << ")\n"
+            << "  --backlog N  listen() backlog per listener (default "
+            << LISTEN_BACKLOG << ")\n"
+            << "  --pin        pin shard i's threads to CPU i\n"
+            << "  --io-uring   use io_uring for accept, receive and queued "
+               "sends (falls back to epoll if unavailable)\n"
+            << "  --access-log PATH         append an access log to PATH\n"
+            << "  --access-log-format F     common, combined (default) or "
+               "binary (read with tools/access_log_decode)\n"
+            << "  --access-log-rotate-mb N  rotate the access log at N MB "
+               "(default "
+            << (ACCESS_ROTATE_BYTES >> 20) << ")\n"
+            << "  --no-compress             send PHP output uncompressed\n"
+            << "  --compress-level N        gzip (1-9) or zstd (1-19) level "
+               "(default "
+            << COMPRESS_GZIP_LEVEL << " or " << COMPRESS_ZSTD_LEVEL << ")\n"
+            << "  --compress-min-bytes N    smallest response to compress "
+               "(default "
+            << COMPRESS_MIN_BYTES << ")\n"
+            << "  --compress-cpu-percent N  compression time per second, in "
+               "percent of one core (default "
+            << COMPRESS_CPU_PERCENT << ")\n"
+            << "  --compress-cache-mb N     compressed viewer pages kept "
+               "(default "
+            << (COMPRESS_CACHE_MAX_BYTES >> 20) << ")\n";
+}
+
+static bool parse_options(int argc, char *argv[], ServerOptions &options) {
+  options.port = SERVER_PORT;
+  options.shards = 1;
+  options.threads = NUM_THREADS;
+  options.backlog = LISTEN_BACKLOG;
+  options.pin = false;
+  options.io_uring = false;
+  options.access_log_format = access_format::COMBINED;
+  options.access_log_rotate = ACCESS_ROTATE_BYTES;
+  options.compress = true;
+  options.compress_level = 0;
+  options.compress_min = COMPRESS_MIN_BYTES;
+  options.compress_cpu = COMPRESS_CPU_PERCENT;
+  options.compress_cache = COMPRESS_CACHE_MAX_BYTES;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--pin") {
+      options.pin = true;
+      continue;
+    }
+    if (arg == "--io-uring") {
+      options.io_uring = true;
+      continue;
+    }
+    if (arg == "--no-compress") {
+      options.compress = false;
+      continue;
+    }
+    if (i + 1 >= argc)
+      return false;
+    if (arg == "--access-log") {
+      options.access_log = argv[++i];
+      continue;
+    }
+    if (arg == "--access-log-format") {
+      std::string format = argv[++i];
+      if (format == "common") {
+        options.access_log_format = access_format::COMMON;
+      } else if (format == "combined") {
+        options.access_log_format = access_format::COMBINED;
+      } else if (format == "binary") {
+        options.access_log_format = access_format::BINARY;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    int value = atoi(argv[++i]);
+    if (value <= 0)
+      return false;
+    if (arg == "--port") {
+      options.port = value;
+    } else if (arg == "--shards") {
+      options.shards = value;
+    } else if (arg == "--threads") {
+      options.threads = value;
+    } else if (arg == "--backlog") {
+      options.backlog = value;
+    } else if (arg == "--access-log-rotate-mb") {
+      options.access_log_rotate = static_cast<uint64_t>(value) << 20;
+    } else if (arg == "--compress-level") {
+      options.compress_level = value;
+    } else if (arg == "--compress-min-bytes") {
+      options.compress_min = value;
+    } else if (arg == "--compress-cpu-percent") {
+      options.compress_cpu = value;
+    } else if (arg == "--compress-cache-mb") {
+      options.compress_cache = static_cast<size_t>(value) << 20;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int open_listener(const ServerOptions &options) {
   int server_fd;
   struct sockaddr_in address;
   int opt = 1;
-  int addrlen = sizeof(address);
-
-  // Install signal handlers
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = handle_termination_signal;
-  sigemptyset(&sa.sa_mask);
-  sigaction(SIGINT, &sa, NULL);
-  sigaction(SIGTERM, &sa, NULL);
-  sigaction(SIGHUP, &sa, NULL);
-  sigaction(SIGQUIT, &sa, NULL);
-  signal(SIGPIPE, SIG_IGN);
 
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     perror("socket failed");
-    exit(EXIT_FAILURE);
+    return -1;
   }
-  g_listen_fd = server_fd;
-
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
     perror("setsockopt");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
+  }
+  // Lets every shard bind the same port; Linux spreads connections across
+  // the listeners by flow hash
+  if (options.shards > 1 &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    perror("setsockopt SO_REUSEPORT");
+    close(server_fd);
+    return -1;
   }
 
+  memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(8080);
+  address.sin_port = htons(options.port);
 
   if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
     perror("bind failed");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
   }
-
-  if (listen(server_fd, 10) < 0) {
+  if (listen(server_fd, options.backlog) < 0) {
     perror("listen");
-    exit(EXIT_FAILURE);
+    close(server_fd);
+    return -1;
+  }
+  return server_fd;
+}
+
+// A listener with its own event loop and worker pool; shards share nothing
+// but the file cache and the php-cgi pool
+struct Shard {
+  size_t index;
+  int listen_fd;
+  const ServerOptions *options;
+  pthread_t thread;
+};
+
+static void pin_to_cpu(size_t cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % CPU_SETSIZE, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    std::cerr << "Could not pin shard to CPU " << cpu << "\n";
   }
+#else
+  (void)cpu; // No thread affinity API on this platform
+#endif
+}
 
-  std::cout << "Listening on port 8080...\n";
+static void *shard_thread(void *arg) {
+  Shard *shard = static_cast<Shard *>(arg);
+  const ServerOptions &options = *shard->options;
+  if (options.pin) {
+    // Workers created below inherit the affinity
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pin_to_cpu(shard->index % (cpus > 0 ? cpus : 1));
+  }
 
-  ThreadPool pool(NUM_THREADS);
+  ThreadPool pool(options.threads, shard->index * options.threads);
+  EventLoop loop(shard->listen_fd, pool, options.io_uring);
+  if (shard->index == 0 && options.io_uring) {
+    std::cout << (loop.usingIoUring() ? "I/O via io_uring\n"
+                                      : "io_uring unavailable, using epoll\n");
+  }
+  loop.run();
+  // Workers may still hand connections back, so stop them before the loop
+  pool.stop();
+  return NULL;
+}
 
-  while (!g_shutdown_requested.load()) {
+int main(int argc, char *argv[]) {
+  ServerOptions options;
+  if (!parse_options(argc, argv, options)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  g_total_workers = options.shards * options.threads;
+  g_compress = options.compress;
+  g_compress_level = options.compress_level;
+  g_compress_min = options.compress_min;
+  g_compress_budget.setPercent(options.compress_cpu);
+  g_compressed_cache.setMaxBytes(options.compress_cache);
 
-    int new_socket =
-        accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-    if (new_socket < 0) {
-      if (g_shutdown_requested.load()) {
-        break;
-      }
-      if (errno == EINTR) {
-        std::cout << "Interrupted\n";
-        continue;
-      }
-      perror("accept");
-      std::cout << "Error accepting connection: " << strerror(errno)
-                << std::endl;
-      continue;
-    }
+  // Install signal handlers
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_termination_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGQUIT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
-    pool.enqueue(new_socket);
+  std::vector<Shard> shards(options.shards);
+  for (size_t i = 0; i < shards.size(); ++i) {
+    shards[i].index = i;
+    shards[i].options = &options;
+    shards[i].listen_fd = open_listener(options);
+    if (shards[i].listen_fd == -1)
+      exit(EXIT_FAILURE);
   }
-  std::cout << "Shutting down...\n";
-  if (server_fd != -1) {
-    close(server_fd);
-    g_listen_fd = -1;
+
+  g_logger.start();
+  // Before any worker exists, so every ConnectionContext gets a ring
+  if (!options.access_log.empty() &&
+      !g_access_log.start(options.access_log, options.access_log_format,
+                          options.access_log_rotate))
+    exit(EXIT_FAILURE);
+  std::cout << "Listening on port " << options.port << "...\n";
+  if (options.shards > 1) {
+    std::cout << options.shards << " shards x " << options.threads
+              << " workers" << (options.pin ? ", pinned" : "") << "\n";
+  }
+
+  g_file_cache.startWatcher();
+  if (g_php_pool.start(PHP_FCGI_WORKERS)) {
+    std::cout << "PHP via FastCGI (" << PHP_FCGI_WORKERS << " php-cgi)\n";
+  } else {
+    std::cout << "php-cgi unavailable, running PHP through the CLI\n";
   }
 
+  for (Shard &shard : shards)
+    pthread_create(&shard.thread, NULL, shard_thread, &shard);
+  for (Shard &shard : shards)
+    pthread_join(shard.thread, NULL);
+
+  std::cout << "Shutting down...\n";
+  g_php_pool.stop();
+  for (Shard &shard : shards)
+    close(shard.listen_fd);
+  g_access_log.stop();
+  g_logger.stop();
+
   return 0;
 }
@@ -1,25 +1,36 @@
 #ifndef CAPTURE_SERVER_HPP
 #define CAPTURE_SERVER_HPP
 
+#include "access_log.hpp"
+#include "arena.hpp"
+#include "compress.hpp"
+#include "http_parser.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
+#include <memory>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <spawn.h>
 #include <sstream>
 #include <string.h>
+#include <string>
+#ifdef __APPLE__
 #include <sys/_pthread/_pthread_types.h>
+#endif
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 
-enum class req_type { FILE, DIRECTORY, COMMAND, PHP, ERROR, UNKNOWN };
+enum class req_type { FILE, DIRECTORY, COMMAND, PHP, METRICS, ERROR, UNKNOWN };
 
-inline std::string type_string(req_type type) {
+inline const char *type_string(req_type type) {
   switch (type) {
   case req_type::FILE:
     return "FILE";
@@ -29,6 +40,8 @@ inline std::string type_string(req_type type) {
     return "COMMAND";
   case req_type::PHP:
     return "PHP";
+  case req_type::METRICS:
+    return "METRICS";
   case req_type::ERROR:
     return "ERROR";
   case req_type::UNKNOWN:
@@ -38,9 +51,85 @@ inline std::string type_string(req_type type) {
   }
 }
 
-#define NUM_THREADS 4
+#define SERVER_PORT 8080
+#define LISTEN_BACKLOG 1024 // Per listener; --backlog overrides
+#define NUM_THREADS 4       // Workers per shard; --threads overrides
 #define BUFFER_SIZE 4096
-#define npos std::string::npos
+#define MAX_REQUEST_SIZE (64 * 1024)
+#define KEEPALIVE_TIMEOUT_SEC 5   // Idle time before a kept-alive socket closes
+#define KEEPALIVE_MAX_REQUESTS 100 // Requests served before forcing a close
+#define STREAM_FLUSH_THRESHOLD (16 * 1024) // Buffered output per chunk
+#define STREAM_MAX_BACKLOG (256 * 1024)    // Unsent bytes before we wait
+#define SEND_TIMEOUT_SEC 30                // Max wait for a stalled client
+static constexpr size_t npos = std::string::npos;
+
+class EventLoop;
+struct CachedFile;
+struct ByteRange;
+
+// Where a connection is in its lifecycle. Only one party (the event loop or a
+// single worker) owns a connection at any time.
+enum class conn_state { READING, PROCESSING, WRITING, CLOSING };
+
+// Per-socket state owned by the event loop and lent to workers
+struct Connection {
+  int fd;
+  EventLoop *loop;
+  conn_state state;
+  std::string in;      // Bytes read from the socket, not yet consumed
+  HttpParser parser;   // Head of the request at the front of in
+  std::string out;     // Response bytes the socket would not take yet
+  size_t out_offset;   // First unwritten byte in out
+  int file_fd;         // File body sent after out, -1 if none
+  off_t file_offset;   // Next file byte to send
+  size_t file_remaining;
+  bool peer_closed;    // Client half-closed after sending its request
+  bool keep_alive;     // Read the next request once the response is out
+  unsigned requests_served;
+  time_t idle_since;   // Event loop only: last read activity, 0 while busy
+  uint64_t ready_ns;   // Monotonic time the current head was complete
+  uint64_t handled_ns; // Worker finished with it; 0 once the loop has timed
+                       // the rest of the response
+  req_type handled_type;
+  struct sockaddr_storage peer; // Looked up once, for the access log
+  bool peer_known;
+  // io_uring backend only; touched by the event loop thread alone
+  unsigned ring_ops;        // Submitted operations not yet completed
+  bool ring_receiving;      // A (multishot) receive is armed
+  bool ring_closed;         // Closed; freed once ring_ops reaches 0
+  bool ring_eof;            // Peer closed or flooded us while a worker owned it
+  std::string ring_stash;   // Received while a worker owned the connection
+  std::vector<char> ring_chunk; // File bytes for a linked read + send
+
+  Connection(int fd, EventLoop *loop)
+      : fd(fd), loop(loop), state(conn_state::READING), out_offset(0),
+        file_fd(-1), file_offset(0), file_remaining(0), peer_closed(false),
+        keep_alive(false), requests_served(0), idle_since(0), ready_ns(0),
+        handled_ns(0), handled_type(req_type::UNKNOWN), peer_known(false),
+        ring_ops(0), ring_receiving(false), ring_closed(false),
+        ring_eof(false) {}
+
+  ~Connection() {
+    if (file_fd != -1)
+      close(file_fd);
+  }
+
+  bool hasPendingOutput() const {
+    return out_offset < out.size() || file_remaining > 0;
+  }
+
+  // True once the head of the next request is fully buffered, or is known
+  // to be malformed; parsing resumes where the previous call stopped
+  bool hasCompleteRequest() {
+    return parser.parse(in.data(), in.size()) != http_parse::INCOMPLETE;
+  }
+
+  // Drops the request just served so the next one starts at in[0]
+  void consumeRequest() {
+    in.erase(0, parser.length());
+    parser.reset();
+  }
+};
 
 struct RequestInfo {
   // HTTP request info
@@ -54,59 +143,82 @@ struct RequestInfo {
   std::string path;
   std::string command;
   std::string args;
+  // Directory listing: dir= and file=, decoded, and whether they were given
+  std::string dir;
+  std::string file;
+  bool has_dir;
+  bool has_file;
+  // Client asked to (or HTTP/1.1 defaults to) keep the connection open
+  bool keep_alive;
+  // Command output goes back as-is rather than through index.php
+  bool raw_output;
 
-  std::string print() const {
-    std::string type_str = type_string(type);
-    return "Method: " + method + " | Ver: " + version +
-           " | Raw: " + raw_path.substr(0, raw_path.find("HTTP")) +
-           " | Type: " + type_str + " | Path: " + path + " | Cmd: " + command +
-           " | Args: '" + args + "'\n";
+  // Summary for the trace log, built in the request's arena
+  StrView print(RequestArena &arena) const {
+    size_t raw_length = std::min(raw_path.find("HTTP"), raw_path.size());
+    return arena.format(
+        "Method: %s | Ver: %s | Raw: %.*s | Type: %s | Path: %s | Cmd: %s | "
+        "Args: '%s'\n",
+        method.c_str(), version.c_str(), static_cast<int>(raw_length),
+        raw_path.data(), type_string(type), path.c_str(),
+        command.c_str(), args.c_str());
   }
 };
 
-enum class log_level { TRACE, INFO, ERROR };
-
-inline std::string log_string(log_level level) {
-
-  switch (level) {
-  case log_level::INFO:
-    return "INFO";
-  case log_level::TRACE:
-    return "TRACE";
-  case log_level::ERROR:
-    return "ERROR";
-  default:
-    return "UNKNOWN";
-  }
-}
-
 class ConnectionContext {
 private:
   char request_buffer[BUFFER_SIZE];
   char response_buffer[BUFFER_SIZE];
   int socket_fd;
+  Connection *connection;
   RequestInfo request_info;
   bool socket_closed;
+  bool head_request; // HEAD: headers with their real lengths, no body
+  // Streaming response state (chunked for HTTP/1.1, close-delimited before)
+  bool stream_started;
+  bool stream_chunked;
+  std::string stream_header; // Held back to share a write with the body
+  std::string stream_buffer;
+  std::string cgi_headers; // FastCGI output until its header block ends
+  // Compression of the streamed response: offered (the client accepts a
+  // coding), then decided at the first flush once enough is buffered
+  bool stream_compressible; // Vary by Accept-Encoding, compress if offered
+  int stream_offer;         // Coding to apply, -1 if none or decided
+  int stream_coding;        // Coding being applied, -1 for none
+  std::string stream_compressed;
+  std::shared_ptr<CompressedResponse> stream_capture; // For the cache
+  StreamCompressor compressor;
+  // Scratch memory for the current request, rewound by reset()
+  RequestArena arena;
   uint64_t request_id;
+  uint64_t request_seq; // Requests this context has served
   bool suppress_logging_for_request;
   int thread_id;
+  LogRing *log_ring; // This worker's queue to the async logger
+  AccessLog::Ring *access_ring; // NULL when there is no access log
+  MetricsShard *metrics;        // This worker's counters for /metrics
+  // For the access log and metrics: what went out and when parsing finished
+  uint16_t response_status;
+  uint64_t response_bytes;
+  uint64_t parsed_ns;
 
 public:
   ConnectionContext(int thread_id); // Default constructor for pre-allocation
   ~ConnectionContext();
 
-  void reset(int fd); // Reset context for new connection
-  void cleanup();     // Clean up after request
+  void reset(Connection *conn); // Borrow a connection from the event loop
+  void cleanup();               // Hand the connection back after the request
 
   bool readRequest();
   bool parseRequest();
   bool sendResponse(const std::string &status, const std::string &content_type,
-                    const std::string &body);
+                    StrView body);
   bool sendResponseHeader(const std::string &status,
                           const std::string &content_type,
                           size_t content_length = 0);
   bool sendData(const char *data, size_t length);
-  bool sendFile(const std::string &filepath);
+  bool flushPending();
+  bool sendFile(int file_fd, off_t offset, size_t length);
 
   void handleRequest();
 
@@ -114,21 +226,62 @@ public:
   int getSocketFd() const { return socket_fd; }
   char *getResponseBuffer() { return response_buffer; }
   int getThreadId() const { return thread_id; }
-  void log(log_level level, const std::string &message,
+  bool logging(log_level level) const;
+  void log(log_level level, StrView message,
            req_type type = req_type::UNKNOWN) const;
+  template <typename... Args>
+  void logf(log_level level, req_type type, const char *format,
+            Args... args) const;
 
 private:
+  void serveRequest();
+  void noteStatus(const std::string &status);
+  void logAccess(uint64_t started_ns);
+  void recordMetrics(uint64_t started_ns);
   bool handleCommandRequest();
   bool handleFileRequest();
+  bool handleDirectoryRequest();
+  bool handleMetricsRequest();
   bool handlePhpRequest(const std::string &php_path,
                         const std::string &args = "");
   bool executePHP(const std::string &php_command);
-  void sendErrorResponse(const std::string &message);
+  bool executeFastCgi(const std::string &php_path, const std::string &args,
+                      int body_fd = -1);
+  bool beginStream(const std::string &status, const std::string &content_type,
+                   const std::string &extra_headers = "");
+  bool streamData(const char *data, size_t length);
+  bool flushStream(bool final = false);
+  bool endStream();
+  bool waitWritable(size_t max_backlog = STREAM_MAX_BACKLOG);
+  bool waitSent();
+  bool streamFromFd(int fd);
+  bool relayOutput(int pipe_fd);
+  bool streamCgiOutput(const char *data, size_t length, bool at_end = false);
+  static bool fastCgiSink(void *arg, const char *data, size_t length);
+  bool transferFile();
+  bool sendCached(const CachedFile &entry);
+  bool sendHeaderAndBody(StrView header, const std::string &body);
+  std::shared_ptr<const CompressedResponse>
+  offerCompression(const std::string &php_path, const std::string &args);
+  void startCompression();
+  bool sendCompressed(const CompressedResponse &entry);
+  bool sendLargeFile(const CachedFile &entry, int file_fd);
+  bool notModified(const CachedFile &entry) const;
+  bool sendNotModified(const CachedFile &entry);
+  std::shared_ptr<const CachedFile> loadFile(const std::string &path,
+                                             const std::string &content_type,
+                                             bool force_plain, int coding);
+  bool serveFile(const CachedFile &entry, int file_fd);
+  int requestedRanges(const CachedFile &entry, ByteRange *ranges) const;
+  bool sendRanges(const CachedFile &entry, int file_fd,
+                  const ByteRange *ranges, int count);
+  void sendErrorResponse(StrView message);
+  const std::string &connectionHeader() const;
   inline std::string determineContentType(const std::string &filepath);
 };
 
+int spawn_with_pipe(char *argv[], pid_t &pid);
 void spawn_and_capture(char *argv[], std::stringstream &output);
-void scan_directory(const std::string &directory,
-                    std::vector<std::string> &filenames);
-inline std::string log_level_to_string(log_level level);
+void reap_child(pid_t pid);
+bool directory_has_file(const char *directory, StrView name);
 #endif
@@ -0,0 +1,350 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+// Streaming compression of dynamic responses, and a cache of finished
+// compressed responses. Each codec is built in only when asked for, since
+// it needs a library: -DHAVE_ZLIB ... -lz for gzip, -DHAVE_ZSTD ... -lzstd
+// for zstd. Without either, nothing is ever compressed.
+
+#include "file_cache.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_MIN_BYTES 1024 // Smaller responses are not worth it
+#define COMPRESS_GZIP_LEVEL 6   // Defaults when no level is configured
+#define COMPRESS_ZSTD_LEVEL 3
+#define COMPRESS_CPU_PERCENT 50 // Compressor time per second, of one core
+#define COMPRESS_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define COMPRESS_CACHE_MAX_ENTRY (1024 * 1024) // Larger results are not kept
+#define COMPRESS_CHUNK 16384                   // Output grown per step
+
+// Codings a dynamic response can be compressed with, as a mask over
+// content_codings (see file_cache.hpp)
+inline unsigned compress_codings() {
+  unsigned codings = 0;
+#ifdef HAVE_ZSTD
+  codings |= 1u << 1;
+#endif
+#ifdef HAVE_ZLIB
+  codings |= 1u << 2;
+#endif
+  return codings;
+}
+
+// Only text compresses well; images and archives already are compressed
+inline bool compressible_type(const std::string &content_type) {
+  return content_type.compare(0, 5, "text/") == 0 ||
+         content_type.find("json") != std::string::npos ||
+         content_type.find("javascript") != std::string::npos ||
+         content_type.find("xml") != std::string::npos;
+}
+
+inline uint64_t thread_cpu_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// One response at a time through gzip or zstd. The codec state is kept
+// between responses and reset, so a worker allocates it once.
+class StreamCompressor {
+public:
+  StreamCompressor() : active(-1) {
+#ifdef HAVE_ZLIB
+    zlib_ready = false;
+    zlib_level = 0;
+#endif
+#ifdef HAVE_ZSTD
+    zstd = NULL;
+#endif
+  }
+
+  ~StreamCompressor() {
+#ifdef HAVE_ZLIB
+    if (zlib_ready)
+      deflateEnd(&zlib);
+#endif
+#ifdef HAVE_ZSTD
+    if (zstd != NULL)
+      ZSTD_freeCCtx(zstd);
+#endif
+  }
+
+  // coding indexes content_codings; false if it is not built in
+  bool begin(int coding, int level) {
+    active = -1;
+#ifdef HAVE_ZLIB
+    if (coding == 2) {
+      if (zlib_ready && zlib_level != level) {
+        deflateEnd(&zlib);
+        zlib_ready = false;
+      }
+      if (zlib_ready) {
+        if (deflateReset(&zlib) != Z_OK)
+          return false;
+      } else {
+        memset(&zlib, 0, sizeof(zlib));
+        // 15 window bits plus 16: a gzip wrapper rather than zlib's
+        if (deflateInit2(&zlib, level, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+          return false;
+        zlib_ready = true;
+        zlib_level = level;
+      }
+      active = coding;
+      return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (coding == 1) {
+      if (zstd == NULL && (zstd = ZSTD_createCCtx()) == NULL)
+        return false;
+      ZSTD_CCtx_reset(zstd, ZSTD_reset_session_only);
+      if (ZSTD_isError(
+              ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, level)))
+        return false;
+      active = coding;
+      return true;
+    }
+#endif
+    (void)coding;
+    (void)level;
+    return false;
+  }
+
+  // Appends the compressed form of data to out. Every call flushes, so the
+  // client can decode everything sent so far; final ends the stream.
+  bool write(const char *data, size_t length, bool final, std::string &out) {
+#ifdef HAVE_ZLIB
+    if (active == 2) {
+      zlib.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      zlib.avail_in = static_cast<uInt>(length);
+      int flush = final ? Z_FINISH : Z_SYNC_FLUSH;
+      while (true) {
+        size_t used = out.size();
+        out.resize(used + COMPRESS_CHUNK);
+        zlib.next_out = reinterpret_cast<Bytef *>(&out[used]);
+        zlib.avail_out = COMPRESS_CHUNK;
+        int rc = deflate(&zlib, flush);
+        out.resize(used + COMPRESS_CHUNK - zlib.avail_out);
+        if (rc == Z_STREAM_END)
+          break;
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+          return false;
+        // Done once the input is consumed and the output did not fill up
+        if (zlib.avail_in == 0 && zlib.avail_out != 0 && !final)
+          break;
+      }
+      return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (active == 1) {
+      ZSTD_inBuffer input = {data, length, 0};
+      ZSTD_EndDirective mode = final ? ZSTD_e_end : ZSTD_e_flush;
+      while (true) {
+        size_t used = out.size();
+        out.resize(used + COMPRESS_CHUNK);
+        ZSTD_outBuffer output = {&out[used], COMPRESS_CHUNK, 0};
+        size_t remaining = ZSTD_compressStream2(zstd, &output, &input, mode);
+        out.resize(used + output.pos);
+        if (ZSTD_isError(remaining))
+          return false;
+        if (remaining == 0)
+          break;
+      }
+      return true;
+    }
+#endif
+    (void)data;
+    (void)length;
+    (void)final;
+    (void)out;
+    return false;
+  }
+
+private:
+  int active; // Coding of the response in progress, -1 if none
+#ifdef HAVE_ZLIB
+  z_stream zlib;
+  bool zlib_ready;
+  int zlib_level;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd;
+#endif
+};
+
+// Compressor CPU time allowed per wall-clock second, shared by every
+// worker. Once a second's budget is spent, responses starting in it go out
+// uncompressed; one already being compressed is finished. The second and
+// the time spent in it share one atomic word, so a charge can never land
+// in a second that is then reset under it.
+class CompressBudget {
+public:
+  CompressBudget() : state(0), budget_ns(0) {}
+
+  void setPercent(unsigned percent) {
+    budget_ns = static_cast<uint64_t>(percent) * 10000000;
+  }
+
+  bool available() const {
+    uint64_t current = state.load(std::memory_order_relaxed);
+    return second_of(current) != now_second() || spent_of(current) < budget_ns;
+  }
+
+  void charge(uint64_t ns) {
+    uint64_t now = now_second();
+    uint64_t current = state.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+      // The first charge in a new second starts its account afresh
+      uint64_t spent = second_of(current) == now ? spent_of(current) : 0;
+      spent = spent + ns < SPENT_MASK ? spent + ns : SPENT_MASK;
+      next = now << SPENT_BITS | spent;
+    } while (!state.compare_exchange_weak(current, next,
+                                          std::memory_order_relaxed));
+  }
+
+private:
+  // Low 40 bits: ns spent (over 18 minutes); the rest: the second, wrapped
+  static const unsigned SPENT_BITS = 40;
+  static const uint64_t SPENT_MASK = (1ULL << SPENT_BITS) - 1;
+  std::atomic<uint64_t> state;
+  uint64_t budget_ns;
+
+  static uint64_t second_of(uint64_t word) { return word >> SPENT_BITS; }
+  static uint64_t spent_of(uint64_t word) { return word & SPENT_MASK; }
+
+  static uint64_t now_second() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) & (~0ULL >> SPENT_BITS);
+  }
+};
+
+// Modification time of a response's input in ns, or -1 if it is missing
+inline int64_t input_version(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1)
+    return -1;
+#ifdef __APPLE__
+  const struct timespec &mtime = st.st_mtimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+#endif
+  return static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+}
+
+// A finished compressed 200 response. Inputs are the files its output was
+// made from (script included), with their versions from before it ran.
+struct CompressedResponse {
+  std::string key;     // Script, arguments and coding
+  std::string headers; // Content-Type and the rest, Connection excepted
+  std::string body;
+  std::vector<std::pair<std::string, int64_t>> inputs;
+};
+
+// Compressed output of scripts whose result depends only on their
+// arguments and input files, so a repeat view is sent without running or
+// compressing anything. A hit re-stats the inputs; any change drops it.
+// Output made within a second of an input's last change is not kept, since
+// a second change in the same timestamp tick would go unnoticed. Least
+// recently used entries go first once over the byte budget.
+class CompressedCache {
+public:
+  CompressedCache() : bytes(0), max_bytes(COMPRESS_CACHE_MAX_BYTES) {
+    pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~CompressedCache() { pthread_mutex_destroy(&mutex); }
+
+  void setMaxBytes(size_t limit) { max_bytes = limit; }
+
+  std::shared_ptr<const CompressedResponse> lookup(const std::string &key) {
+    pthread_mutex_lock(&mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      pthread_mutex_unlock(&mutex);
+      return nullptr;
+    }
+    order.splice(order.begin(), order, it->second);
+    std::shared_ptr<const CompressedResponse> entry = *it->second;
+    pthread_mutex_unlock(&mutex);
+
+    for (const auto &input : entry->inputs) {
+      if (input_version(input.first) != input.second) {
+        erase(entry);
+        return nullptr;
+      }
+    }
+    return entry;
+  }
+
+  void insert(const std::shared_ptr<const CompressedResponse> &entry) {
+    size_t size = cost(*entry);
+    if (entry->body.size() > COMPRESS_CACHE_MAX_ENTRY || size > max_bytes)
+      return;
+    time_t now = time(NULL);
+    for (const auto &input : entry->inputs) {
+      if (input.second >= 0 && input.second / 1000000000 + 1 >= now)
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    auto it = index.find(entry->key);
+    if (it != index.end())
+      remove(it);
+    while (bytes + size > max_bytes && !order.empty())
+      remove(index.find(order.back()->key));
+    order.push_front(entry);
+    index[entry->key] = order.begin();
+    bytes += size;
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  typedef std::list<std::shared_ptr<const CompressedResponse>> Order;
+  pthread_mutex_t mutex;
+  Order order; // Most recently used first
+  std::unordered_map<std::string, Order::iterator> index;
+  size_t bytes;
+  size_t max_bytes;
+
+  static size_t cost(const CompressedResponse &entry) {
+    return entry.body.size() + entry.headers.size() + entry.key.size() +
+           FILE_CACHE_ENTRY_COST;
+  }
+
+  // Only if it is still this entry; a fresher one may have replaced it
+  void erase(const std::shared_ptr<const CompressedResponse> &entry) {
+    pthread_mutex_lock(&mutex);
+    auto it = index.find(entry->key);
+    if (it != index.end() && *it->second == entry)
+      remove(it);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void remove(std::unordered_map<std::string, Order::iterator>::iterator it) {
+    bytes -= cost(**it->second);
+    order.erase(it->second);
+    index.erase(it);
+  }
+};
+
+#endif
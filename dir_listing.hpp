@@ -0,0 +1,443 @@
+#ifndef DIR_LISTING_HPP
+#define DIR_LISTING_HPP
+
+// Directory pages for /browse_files.php, rendered by the server itself in
+// the markup the PHP script used to produce. Entries are read in large
+// batches (getdents64 on Linux) relative to a directory descriptor, sorted
+// once and cached per directory until its mtime changes; the page is
+// filled in from templates split into literal runs and slots at startup.
+
+#include "http_parser.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define DIR_CACHE_MAX_ENTRIES 1024 // Directories whose listing is kept
+#define DIR_READ_BUFFER (32 * 1024) // Bytes of entries per getdents64()
+
+// PHP's sort() order for names: two numeric strings ("9", "10", "1e3")
+// compare as numbers, anything else byte by byte
+inline bool php_numeric(const std::string &text, double &value) {
+  const char *begin = text.c_str();
+  while (*begin == ' ' || (*begin >= '\t' && *begin <= '\r'))
+    ++begin;
+  const char *digits = begin + (*begin == '+' || *begin == '-');
+  if (!(*digits >= '0' && *digits <= '9') &&
+      !(*digits == '.' && digits[1] >= '0' && digits[1] <= '9'))
+    return false;
+  char *end;
+  value = strtod(begin, &end);
+  // strtod also takes hex, inf and nan, which PHP does not
+  for (const char *p = digits; p < end; ++p) {
+    if (!((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' ||
+          *p == '+' || *p == '-'))
+      return false;
+  }
+  while (*end == ' ' || (*end >= '\t' && *end <= '\r'))
+    ++end;
+  return *end == '\0';
+}
+
+inline bool php_less(const std::string &a, const std::string &b) {
+  double x, y;
+  if (php_numeric(a, x) && php_numeric(b, y) && x != y)
+    return x < y;
+  return a < b;
+}
+
+// One directory's entries, without "." and "..", each list in PHP order
+struct DirListing {
+  int64_t mtime_ns;
+  std::vector<std::string> directories;
+  std::vector<std::string> files;
+};
+
+inline int64_t stat_mtime_ns(const struct stat &st) {
+#ifdef __APPLE__
+  const struct timespec &mtime = st.st_mtimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+#endif
+  return static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+}
+
+// Sorts one entry of dir_fd into the listing. Like PHP's is_dir(),
+// symbolic links count as what they point to.
+inline void add_dir_entry(int dir_fd, const char *name, unsigned char type,
+                          DirListing &listing) {
+  if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && !name[2])))
+    return;
+  bool is_dir = type == DT_DIR;
+  if (type == DT_UNKNOWN || type == DT_LNK) {
+    struct stat st;
+    is_dir = fstatat(dir_fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+  }
+  (is_dir ? listing.directories : listing.files).push_back(name);
+}
+
+// Reads every entry of an open directory
+inline bool read_dir_entries(int dir_fd, DirListing &listing) {
+#ifdef __linux__
+  struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+  };
+  alignas(8) char buffer[DIR_READ_BUFFER];
+  while (true) {
+    long n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    for (long offset = 0; offset < n;) {
+      struct linux_dirent64 *entry =
+          reinterpret_cast<struct linux_dirent64 *>(buffer + offset);
+      add_dir_entry(dir_fd, entry->d_name, entry->d_type, listing);
+      offset += entry->d_reclen;
+    }
+  }
+#else
+  int copy = dup(dir_fd);
+  DIR *dir = copy == -1 ? NULL : fdopendir(copy);
+  if (dir == NULL) {
+    if (copy != -1)
+      close(copy);
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+    add_dir_entry(dir_fd, entry->d_name, entry->d_type, listing);
+  closedir(dir);
+  return true;
+#endif
+}
+
+// Sorted listings by directory path. A hit costs one stat() to compare the
+// directory's mtime; a listing read within a second of its directory's
+// last change is not kept, since a second change in the same timestamp
+// tick would go unnoticed.
+class DirListingCache {
+public:
+  DirListingCache() { pthread_mutex_init(&mutex, NULL); }
+  ~DirListingCache() { pthread_mutex_destroy(&mutex); }
+
+  // Null if path is not a readable directory
+  std::shared_ptr<const DirListing> get(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+      return nullptr;
+    pthread_mutex_lock(&mutex);
+    auto it = listings.find(path);
+    std::shared_ptr<const DirListing> cached =
+        it == listings.end() ? nullptr : it->second;
+    pthread_mutex_unlock(&mutex);
+    if (cached && cached->mtime_ns == stat_mtime_ns(st))
+      return cached;
+
+    int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+      return nullptr;
+    std::shared_ptr<DirListing> listing = std::make_shared<DirListing>();
+    // The version read is the one from before the entries were
+    bool ok = fstat(dir_fd, &st) == 0 && read_dir_entries(dir_fd, *listing);
+    close(dir_fd);
+    if (!ok)
+      return nullptr;
+    listing->mtime_ns = stat_mtime_ns(st);
+    std::stable_sort(listing->directories.begin(), listing->directories.end(),
+                     php_less);
+    std::stable_sort(listing->files.begin(), listing->files.end(), php_less);
+
+    if (st.st_mtime + 1 < time(NULL)) {
+      pthread_mutex_lock(&mutex);
+      if (listings.size() >= DIR_CACHE_MAX_ENTRIES &&
+          listings.count(path) == 0)
+        listings.erase(listings.begin());
+      listings[path] = listing;
+      pthread_mutex_unlock(&mutex);
+    }
+    return listing;
+  }
+
+private:
+  pthread_mutex_t mutex;
+  std::unordered_map<std::string, std::shared_ptr<const DirListing>>
+      listings;
+};
+
+// Slots a listing template can refer to as {{name}}
+enum class listing_slot {
+  DIR,             // Listed directory, HTML-escaped
+  DIR_URL,         // Listed directory, urlencoded
+  PARENT,          // Parent link, or nothing at the top
+  DIRECTORIES,     // Directory rows
+  FILES,           // File rows
+  TOTAL,           // Entry counts
+  DIRECTORY_COUNT,
+  FILE_COUNT,
+  NAME, // Row: entry name, HTML-escaped
+  URL,  // Row: entry (or parent) path, urlencoded
+  COUNT
+};
+
+static const char *const listing_slot_names[] = {
+    "dir",   "dir_url",         "parent",     "directories", "files",
+    "total", "directory_count", "file_count", "name",        "url"};
+
+// Template text split at its {{slot}} markers once, so rendering is a run
+// of appends with no parsing
+class ListingTemplate {
+public:
+  explicit ListingTemplate(const char *text) {
+    const char *p = text;
+    while (*p != '\0') {
+      const char *open = strstr(p, "{{");
+      const char *close = open == NULL ? NULL : strstr(open, "}}");
+      if (close == NULL) {
+        segments.push_back(Segment{StrView(p, strlen(p)), -1});
+        break;
+      }
+      if (open > p)
+        segments.push_back(Segment{StrView(p, open - p), -1});
+      StrView name(open + 2, close - open - 2);
+      int slot = -1;
+      for (int i = 0; i < static_cast<int>(listing_slot::COUNT); ++i) {
+        if (name.equals(listing_slot_names[i]))
+          slot = i;
+      }
+      if (slot == -1) // Unknown names stay as text
+        segments.push_back(Segment{StrView(open, close + 2 - open), -1});
+      else
+        segments.push_back(Segment{StrView(), slot});
+      p = close + 2;
+    }
+  }
+
+  // fill(out, slot) appends what a slot stands for
+  template <typename String, typename Fill>
+  void render(String &out, Fill fill) const {
+    for (const Segment &segment : segments) {
+      if (segment.slot == -1)
+        out.append(segment.text.data, segment.text.size);
+      else
+        fill(out, static_cast<listing_slot>(segment.slot));
+    }
+  }
+
+private:
+  struct Segment {
+    StrView text;
+    int slot; // -1 for literal text
+  };
+  std::vector<Segment> segments;
+};
+
+// PHP's htmlspecialchars() with its default ENT_QUOTES
+template <typename String>
+inline void html_escape_append(String &out, StrView text) {
+  for (size_t i = 0; i < text.size; ++i) {
+    switch (text.data[i]) {
+    case '&':
+      out.append("&amp;", 5);
+      break;
+    case '"':
+      out.append("&quot;", 6);
+      break;
+    case '\'':
+      out.append("&#039;", 6);
+      break;
+    case '<':
+      out.append("&lt;", 4);
+      break;
+    case '>':
+      out.append("&gt;", 4);
+      break;
+    default:
+      out.push_back(text.data[i]);
+    }
+  }
+}
+
+// PHP's urlencode(): letters, digits and -_. kept, space as +
+template <typename String>
+inline void url_encode_append(String &out, StrView text) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < text.size; ++i) {
+    unsigned char ch = static_cast<unsigned char>(text.data[i]);
+    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+        (ch >= '0' && ch <= '9') || ch == '-' || ch == '_' || ch == '.') {
+      out.push_back(ch);
+    } else if (ch == ' ') {
+      out.push_back('+');
+    } else {
+      out.push_back('%');
+      out.push_back(hex[ch >> 4]);
+      out.push_back(hex[ch & 15]);
+    }
+  }
+}
+
+// PHP's dirname() for the relative paths the listing links use
+inline StrView php_dirname(StrView path) {
+  size_t end = path.size;
+  while (end > 1 && path.data[end - 1] == '/')
+    --end;
+  while (end > 0 && path.data[end - 1] != '/')
+    --end;
+  if (end == 0)
+    return path.size == 0 ? path : StrView(".", 1);
+  while (end > 1 && path.data[end - 1] == '/')
+    --end;
+  return StrView(path.data, end);
+}
+
+// Entries whose name ends in one of these link to code_view.php
+inline bool listing_code_file(const std::string &name) {
+  size_t dot = name.find_last_of('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string extension = name.substr(dot + 1);
+  for (char &ch : extension)
+    ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+  return extension == "php" || extension == "cpp" || extension == "c" ||
+         extension == "hpp" || extension == "h";
+}
+
+// The page and its pieces, as browse_files.php printed them
+struct ListingTemplates {
+  ListingTemplate page;
+  ListingTemplate parent;
+  ListingTemplate directory;
+  ListingTemplate no_directories;
+  ListingTemplate code_file;
+  ListingTemplate file;
+  ListingTemplate no_files;
+};
+
+inline const ListingTemplates &listing_templates() {
+  static const ListingTemplates templates = {
+      ListingTemplate(
+          "<!DOCTYPE html><html lang='en'><head>"
+          "<link rel=\"stylesheet\" href=\"style/web/hack.css\">"
+          "<link rel=\"stylesheet\" href=\"style/main.css\">"
+          "<meta charset='UTF-8'><title>Browse Files</title></head><body>"
+          "<h2>Files in {{dir}}</h2>{{parent}}"
+          "<h3>Directories:</h3><ul>{{directories}}</ul>"
+          "<h3>Files:</h3><ul>{{files}}</ul>"
+          "<hr><h3>Directory Info:</h3><p>Total items: {{total}} "
+          "({{directory_count}} directories, {{file_count}} files)</p>"
+          "<div class='section-divider'></div>"
+          "<a href='index.php' class='nav-link'>Back to Command Executor</a>"
+          "</body></html>"),
+      ListingTemplate("<a href='browse_files.php?dir={{url}}' "
+                      "class='nav-link'>[..] Parent Directory</a><br><br>"),
+      ListingTemplate(
+          "<li>[DIR] <a href='browse_files.php?dir={{url}}'>{{name}}/</a></li>"),
+      ListingTemplate("<li><em>No subdirectories</em></li>"),
+      ListingTemplate("<li><a href='code_view.php?file={{url}}&dir={{dir_url}}'>"
+                      "{{name}}</a></li>"),
+      ListingTemplate("<li><a href='?raw_file={{url}}'>{{name}}</a></li>"),
+      ListingTemplate("<li><em>No files</em></li>"),
+  };
+  return templates;
+}
+
+// The page for dir (as given, "." for the web root) listing its entries
+template <typename String>
+inline void render_listing(String &out, StrView dir,
+                           const DirListing &listing) {
+  const ListingTemplates &templates = listing_templates();
+  bool top = dir.equals(".");
+  const std::string *name = NULL;
+  // An entry's path is dir/name below the top; urlencode turns / into %2F
+  auto fill = [&](String &o, listing_slot slot) {
+    switch (slot) {
+    case listing_slot::DIR:
+      html_escape_append(o, dir);
+      break;
+    case listing_slot::DIR_URL:
+      url_encode_append(o, dir);
+      break;
+    case listing_slot::NAME:
+      html_escape_append(o, StrView(*name));
+      break;
+    case listing_slot::URL:
+      if (name == NULL) {
+        url_encode_append(o, php_dirname(dir));
+        break;
+      }
+      if (!top) {
+        url_encode_append(o, dir);
+        o.append("%2F", 3);
+      }
+      url_encode_append(o, StrView(*name));
+      break;
+    default:
+      break;
+    }
+  };
+  char number[24];
+  templates.page.render(out, [&](String &o, listing_slot slot) {
+    switch (slot) {
+    case listing_slot::PARENT:
+      if (!top)
+        templates.parent.render(o, fill);
+      break;
+    case listing_slot::DIRECTORIES:
+      if (listing.directories.empty())
+        templates.no_directories.render(o, fill);
+      for (const std::string &entry : listing.directories) {
+        name = &entry;
+        templates.directory.render(o, fill);
+      }
+      name = NULL;
+      break;
+    case listing_slot::FILES:
+      if (listing.files.empty())
+        templates.no_files.render(o, fill);
+      for (const std::string &entry : listing.files) {
+        name = &entry;
+        (listing_code_file(entry) ? templates.code_file : templates.file)
+            .render(o, fill);
+      }
+      name = NULL;
+      break;
+    case listing_slot::TOTAL:
+    case listing_slot::DIRECTORY_COUNT:
+    case listing_slot::FILE_COUNT: {
+      size_t count = slot == listing_slot::FILE_COUNT ? listing.files.size()
+                     : slot == listing_slot::DIRECTORY_COUNT
+                         ? listing.directories.size()
+                         : listing.directories.size() + listing.files.size();
+      o.append(number, snprintf(number, sizeof(number), "%zu", count));
+      break;
+    }
+    default:
+      fill(o, slot);
+    }
+  });
+}
+
+#endif
@@ -0,0 +1,501 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+extern char **environ;
+
+#define PHP_CGI_BINARY "php-cgi"
+#define PHP_FCGI_WORKERS 4          // Long-lived php-cgi processes
+#define PHP_FCGI_SOCKET_DIR "/tmp"  // Where the backends' Unix sockets live
+#define PHP_FCGI_TIMEOUT_SEC 30     // Give up on a script after this long
+
+// FastCGI record types and constants (FastCGI 1.0 specification)
+enum fcgi_record : uint8_t {
+  FCGI_BEGIN_REQUEST = 1,
+  FCGI_END_REQUEST = 3,
+  FCGI_PARAMS = 4,
+  FCGI_STDIN = 5,
+  FCGI_STDOUT = 6,
+  FCGI_STDERR = 7,
+};
+#define FCGI_VERSION_1 1
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_STDIN_CHUNK 16384
+
+typedef std::vector<std::pair<std::string, std::string>> FastCgiParams;
+
+// Receives stdout (CGI headers, then body) as records arrive. A call with
+// length 0 means the backend has nothing more buffered for now, a good time
+// to flush. Return false to abandon the request.
+typedef bool (*fcgi_sink)(void *arg, const char *data, size_t length);
+// Fills buffer with the next piece of the request body: 0 at the end, -1 on
+// error
+typedef ssize_t (*fcgi_source)(void *arg, char *buffer, size_t length);
+
+struct FastCgiResponse {
+  std::string stderr_data;
+  uint32_t app_status;
+  bool sent_any; // Sink saw output, so the request cannot be retried
+};
+
+// Client for a pool of locally spawned `php-cgi -b <socket>` processes.
+// Each backend serves one request at a time (php-cgi and php-fpm both
+// advertise FCGI_MPXS_CONNS=0), so requests are spread over the backends and
+// each keeps one connection open across requests with FCGI_KEEP_CONN. A
+// supervisor thread restarts backends that exit, e.g. after
+// PHP_FCGI_MAX_REQUESTS.
+class FastCgiPool {
+public:
+  FastCgiPool() : running(false), stopping(false) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&idle_cond, NULL);
+  }
+
+  ~FastCgiPool() {
+    stop();
+    pthread_cond_destroy(&idle_cond);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  // Spawns the backends; returns false (and callers fall back to the PHP
+  // CLI) when none of them comes up, e.g. php-cgi is not installed
+  bool start(size_t workers) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+      return false;
+    document_root = cwd;
+
+    pthread_mutex_lock(&mutex);
+    backends.resize(workers);
+    for (size_t i = 0; i < workers; ++i) {
+      backends[i].socket_path = std::string(PHP_FCGI_SOCKET_DIR) +
+                                "/capture_server_php." +
+                                std::to_string(getpid()) + "." +
+                                std::to_string(i) + ".sock";
+      spawnBackend(backends[i]);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    // php-cgi needs a moment to bind its socket
+    bool any_up = false;
+    for (int attempt = 0; attempt < 50 && !any_up; ++attempt) {
+      usleep(20 * 1000);
+      pthread_mutex_lock(&mutex);
+      connectIdle();
+      for (Backend &backend : backends)
+        any_up = any_up || backend.conn_fd != -1;
+      pthread_mutex_unlock(&mutex);
+    }
+    if (!any_up) {
+      stop();
+      return false;
+    }
+
+    running = true;
+    pthread_create(&supervisor, NULL, supervisor_thread, this);
+    return true;
+  }
+
+  void stop() {
+    pthread_mutex_lock(&mutex);
+    bool was_running = running;
+    stopping = true;
+    running = false;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&mutex);
+    if (was_running)
+      pthread_join(supervisor, NULL);
+
+    for (Backend &backend : backends) {
+      if (backend.conn_fd != -1)
+        close(backend.conn_fd);
+      backend.conn_fd = -1;
+      if (backend.pid > 0) {
+        kill(backend.pid, SIGTERM);
+        waitpid(backend.pid, NULL, 0);
+        backend.pid = -1;
+      }
+      unlink(backend.socket_path.c_str());
+    }
+  }
+
+  bool available() const { return running; }
+  const std::string &documentRoot() const { return document_root; }
+
+  // Backends with a live process, and those serving a request, for /metrics
+  void counts(size_t &processes, size_t &busy) {
+    processes = 0;
+    busy = 0;
+    pthread_mutex_lock(&mutex);
+    for (const Backend &backend : backends) {
+      processes += backend.pid > 0;
+      busy += backend.busy;
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Runs one request on an idle backend, streaming the body from source
+  // (may be NULL for none) and the output into sink. Returns false if the
+  // request did not complete.
+  bool execute(const FastCgiParams &params, fcgi_source source,
+               void *source_arg, fcgi_sink sink, void *sink_arg,
+               FastCgiResponse &response) {
+    std::string request = encodeBegin(params);
+    response.stderr_data.clear();
+    response.app_status = 0;
+    response.sent_any = false;
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      Backend *backend = acquire();
+      if (backend == nullptr)
+        return false;
+
+      bool body_started = false;
+      bool ok = writeAll(backend->conn_fd, request.data(), request.size()) &&
+                writeBody(backend->conn_fd, source, source_arg, body_started) &&
+                readResponse(backend->conn_fd, sink, sink_arg, response);
+      if (!ok) {
+        close(backend->conn_fd);
+        backend->conn_fd = -1;
+      }
+      release(backend);
+      // Only a request that consumed nothing can be replayed elsewhere
+      if (ok || response.sent_any || body_started)
+        return ok;
+    }
+    return false;
+  }
+
+private:
+  struct Backend {
+    pid_t pid;
+    std::string socket_path;
+    int conn_fd; // Persistent connection; only connected backends are used
+    bool busy;
+    time_t restart_at; // Backoff before respawning a crashing backend
+    unsigned failures;
+
+    Backend() : pid(-1), conn_fd(-1), busy(false), restart_at(0), failures(0) {}
+  };
+
+  std::vector<Backend> backends;
+  std::string document_root;
+  pthread_mutex_t mutex;
+  pthread_cond_t idle_cond;
+  pthread_t supervisor;
+  bool running;
+  bool stopping;
+
+  // Waits for an idle, connected backend; nullptr if none turns up in time
+  Backend *acquire() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PHP_FCGI_TIMEOUT_SEC;
+
+    pthread_mutex_lock(&mutex);
+    while (!stopping) {
+      for (Backend &backend : backends) {
+        if (!backend.busy && backend.pid > 0 && backend.conn_fd != -1) {
+          if (readable(backend.conn_fd)) {
+            // The backend recycled itself since the last request
+            close(backend.conn_fd);
+            backend.conn_fd = connectTo(backend.socket_path);
+            if (backend.conn_fd == -1)
+              continue;
+          }
+          backend.busy = true;
+          pthread_mutex_unlock(&mutex);
+          return &backend;
+        }
+      }
+      if (pthread_cond_timedwait(&idle_cond, &mutex, &deadline) == ETIMEDOUT)
+        break;
+    }
+    pthread_mutex_unlock(&mutex);
+    return nullptr;
+  }
+
+  // Caller holds mutex. (Re)connects live backends nobody is using.
+  void connectIdle() {
+    bool connected = false;
+    for (Backend &backend : backends) {
+      if (backend.pid > 0 && !backend.busy && backend.conn_fd == -1) {
+        backend.conn_fd = connectTo(backend.socket_path);
+        connected = connected || backend.conn_fd != -1;
+      }
+    }
+    if (connected)
+      pthread_cond_broadcast(&idle_cond);
+  }
+
+  void release(Backend *backend) {
+    pthread_mutex_lock(&mutex);
+    backend->busy = false;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // Caller holds mutex
+  void spawnBackend(Backend &backend) {
+    unlink(backend.socket_path.c_str());
+
+    std::vector<std::string> env_storage;
+    for (char **env = environ; *env != NULL; ++env) {
+      if (strncmp(*env, "PHP_FCGI_CHILDREN=", 18) != 0)
+        env_storage.push_back(*env);
+    }
+    // One process per backend; we do the pooling
+    env_storage.push_back("PHP_FCGI_CHILDREN=0");
+    std::vector<char *> envp;
+    for (std::string &entry : env_storage)
+      envp.push_back(const_cast<char *>(entry.c_str()));
+    envp.push_back(NULL);
+
+    // -C keeps the server's working directory, which the scripts rely on
+    const char *argv[] = {PHP_CGI_BINARY, "-C", "-b",
+                          backend.socket_path.c_str(), NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, PHP_CGI_BINARY, NULL, NULL,
+                     const_cast<char *const *>(argv), envp.data()) != 0) {
+      backend.pid = -1;
+      backend.failures++;
+      backend.restart_at = time(NULL) + std::min(backend.failures, 30u);
+      return;
+    }
+    backend.pid = pid;
+  }
+
+  // Data (or EOF) is waiting. An idle FastCGI connection is only readable
+  // once the backend has closed it.
+  static bool readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+  }
+
+  static int connectTo(const std::string &path) {
+#ifdef SOCK_CLOEXEC
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+#endif
+    if (fd == -1)
+      return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      close(fd);
+      return -1;
+    }
+    struct timeval timeout = {PHP_FCGI_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    return fd;
+  }
+
+  static void appendRecord(std::string &out, uint8_t type, const char *data,
+                           size_t length) {
+    char header[FCGI_HEADER_LEN] = {FCGI_VERSION_1,
+                                    (char)type,
+                                    0,
+                                    1, // Request id 1; one request per conn
+                                    (char)((length >> 8) & 0xff),
+                                    (char)(length & 0xff),
+                                    0,
+                                    0};
+    out.append(header, FCGI_HEADER_LEN);
+    out.append(data, length);
+  }
+
+  // A stream (PARAMS, STDIN) is split into records and closed by an empty one
+  static void appendStream(std::string &out, uint8_t type,
+                           const std::string &data) {
+    for (size_t offset = 0; offset < data.size(); offset += FCGI_MAX_CONTENT) {
+      size_t length = std::min(data.size() - offset, (size_t)FCGI_MAX_CONTENT);
+      appendRecord(out, type, data.data() + offset, length);
+    }
+    appendRecord(out, type, "", 0);
+  }
+
+  static void appendLength(std::string &out, size_t length) {
+    if (length < 128) {
+      out.push_back((char)length);
+    } else {
+      out.push_back((char)(((length >> 24) & 0x7f) | 0x80));
+      out.push_back((char)((length >> 16) & 0xff));
+      out.push_back((char)((length >> 8) & 0xff));
+      out.push_back((char)(length & 0xff));
+    }
+  }
+
+  // BEGIN_REQUEST and the full PARAMS stream; STDIN follows separately
+  static std::string encodeBegin(const FastCgiParams &params) {
+    std::string out;
+    const char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    appendRecord(out, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+
+    std::string encoded;
+    for (const auto &param : params) {
+      appendLength(encoded, param.first.size());
+      appendLength(encoded, param.second.size());
+      encoded += param.first;
+      encoded += param.second;
+    }
+    appendStream(out, FCGI_PARAMS, encoded);
+    return out;
+  }
+
+  // Forward the source as STDIN records as it produces data
+  static bool writeBody(int fd, fcgi_source source, void *source_arg,
+                        bool &body_started) {
+    char buffer[FCGI_STDIN_CHUNK];
+    while (source != NULL) {
+      ssize_t n = source(source_arg, buffer, sizeof(buffer));
+      if (n < 0)
+        return false;
+      if (n == 0)
+        break;
+      body_started = true;
+      std::string record;
+      appendRecord(record, FCGI_STDIN, buffer, n);
+      if (!writeAll(fd, record.data(), record.size()))
+        return false;
+    }
+    std::string end;
+    appendRecord(end, FCGI_STDIN, "", 0);
+    return writeAll(fd, end.data(), end.size());
+  }
+
+  static bool writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+      ssize_t written = write(fd, data, length);
+      if (written > 0) {
+        data += written;
+        length -= written;
+      } else if (written == -1 && errno == EINTR) {
+        continue;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool readAll(int fd, char *data, size_t length) {
+    while (length > 0) {
+      ssize_t n = read(fd, data, length);
+      if (n > 0) {
+        data += n;
+        length -= n;
+      } else if (n == -1 && errno == EINTR) {
+        continue;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool readResponse(int fd, fcgi_sink sink, void *sink_arg,
+                           FastCgiResponse &response) {
+    char header[FCGI_HEADER_LEN];
+    std::vector<char> content(FCGI_MAX_CONTENT + 255);
+    while (readAll(fd, header, FCGI_HEADER_LEN)) {
+      size_t length = ((uint8_t)header[4] << 8) | (uint8_t)header[5];
+      size_t padding = (uint8_t)header[6];
+      if (!readAll(fd, content.data(), length + padding))
+        return false;
+
+      switch ((uint8_t)header[1]) {
+      case FCGI_STDOUT:
+        if (length == 0)
+          break;
+        response.sent_any = true;
+        if (!sink(sink_arg, content.data(), length))
+          return false;
+        if (!readable(fd) && !sink(sink_arg, NULL, 0))
+          return false;
+        break;
+      case FCGI_STDERR:
+        response.stderr_data.append(content.data(), length);
+        break;
+      case FCGI_END_REQUEST:
+        if (length >= 5) {
+          response.app_status = ((uint32_t)(uint8_t)content[0] << 24) |
+                                ((uint32_t)(uint8_t)content[1] << 16) |
+                                ((uint32_t)(uint8_t)content[2] << 8) |
+                                (uint8_t)content[3];
+          // Non-zero protocol status means the backend refused the request
+          return content[4] == 0;
+        }
+        return false;
+      default:
+        break;
+      }
+    }
+    return false;
+  }
+
+  static void *supervisor_thread(void *arg) {
+    FastCgiPool *pool = static_cast<FastCgiPool *>(arg);
+    while (true) {
+      usleep(500 * 1000);
+      pthread_mutex_lock(&pool->mutex);
+      if (pool->stopping) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+      }
+      time_t now = time(NULL);
+      for (Backend &backend : pool->backends) {
+        if (backend.pid > 0) {
+          int status;
+          if (waitpid(backend.pid, &status, WNOHANG) != backend.pid)
+            continue;
+          // Exited; an idle connection to it is now dead too
+          backend.pid = -1;
+          if (!backend.busy && backend.conn_fd != -1) {
+            close(backend.conn_fd);
+            backend.conn_fd = -1;
+          }
+          bool clean = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+          backend.failures = clean ? 0 : backend.failures + 1;
+          backend.restart_at = now + std::min(backend.failures, 30u);
+        }
+        if (backend.pid <= 0 && now >= backend.restart_at) {
+          pool->spawnBackend(backend);
+        }
+      }
+      // A respawned backend is picked up once its socket accepts
+      pool->connectIdle();
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,573 @@
+#ifndef FILE_CACHE_HPP
+#define FILE_CACHE_HPP
+
+#include "http_parser.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_MAX_BYTES (32 * 1024 * 1024) // Total body bytes held
+#define FILE_CACHE_MAX_FILE (1024 * 1024)       // Larger files use sendfile
+#define FILE_CACHE_ENTRY_COST 256 // Bytes charged per entry on top of its body
+#define IMMUTABLE_MAX_AGE 31536000 // Content-hashed assets: one year
+#define RANGE_MAX_PARTS 16 // More ranges than this and the whole file is sent
+#define CONTENT_CODINGS 3  // br, zstd, gzip sidecars
+
+// Strong validator from the file's identity and version:
+// "<inode>-<size>-<mtime in ns>", in hex
+inline std::string file_etag(const struct stat &st) {
+#ifdef __APPLE__
+  const struct timespec &mtime = st.st_mtimespec;
+#else
+  const struct timespec &mtime = st.st_mtim;
+#endif
+  char etag[64];
+  snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+           static_cast<unsigned long long>(st.st_ino),
+           static_cast<unsigned long long>(st.st_size),
+           static_cast<unsigned long long>(mtime.tv_sec) * 1000000000ULL +
+               mtime.tv_nsec);
+  return etag;
+}
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+inline std::string http_date(time_t when) {
+  struct tm utc;
+  gmtime_r(&when, &utc);
+  char date[40];
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+  return date;
+}
+
+// Parses an IMF-fixdate; the obsolete RFC 850 and asctime forms are not
+// accepted (the condition is then ignored, which is always safe)
+inline bool parse_http_date(StrView text, time_t &when) {
+  char date[40];
+  if (text.size >= sizeof(date))
+    return false;
+  memcpy(date, text.data, text.size);
+  date[text.size] = '\0';
+  struct tm utc;
+  memset(&utc, 0, sizeof(utc));
+  const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &utc);
+  if (end == NULL || *end != '\0')
+    return false;
+  when = timegm(&utc);
+  return true;
+}
+
+// If-None-Match against our ETag: "*" or any listed tag, compared weakly
+// (a W/ prefix is ignored) as the header requires
+inline bool etag_matches(StrView header, const std::string &etag) {
+  size_t i = 0;
+  while (i < header.size) {
+    while (i < header.size && (header.data[i] == ' ' || header.data[i] == ','))
+      ++i;
+    size_t start = i;
+    while (i < header.size && header.data[i] != ',')
+      ++i;
+    size_t end = i;
+    while (end > start && header.data[end - 1] == ' ')
+      --end;
+    StrView tag(header.data + start, end - start);
+    if (tag.size >= 2 && tag.data[0] == 'W' && tag.data[1] == '/')
+      tag = StrView(tag.data + 2, tag.size - 2);
+    if (tag.equals("*") || tag.equals(etag.c_str()))
+      return true;
+  }
+  return false;
+}
+
+// Inclusive byte offsets of one requested range
+struct ByteRange {
+  uint64_t first;
+  uint64_t last;
+};
+
+// Parses a Range header ("bytes=0-99, 200-, -50") against a file size.
+// Returns how many ranges are satisfiable, sorted with overlapping and
+// adjacent ones merged; 0 if the header is to be ignored (malformed, not
+// bytes, more than max ranges) and the whole file sent; -1 if it is valid
+// but no range overlaps the file (416).
+inline int parse_byte_ranges(StrView header, uint64_t size, ByteRange *ranges,
+                             int max) {
+  if (header.size < 6 || !StrView(header.data, 6).iequals("bytes="))
+    return 0;
+  int count = 0;
+  int specs = 0;
+  size_t i = 6;
+  while (i < header.size) {
+    while (i < header.size && (header.data[i] == ' ' || header.data[i] == ','))
+      ++i;
+    if (i == header.size)
+      break;
+    if (++specs > max)
+      return 0;
+    // first-last, first- or -suffix_length
+    bool suffix = header.data[i] == '-';
+    uint64_t first = 0, last = 0;
+    bool has_first = false, has_last = false;
+    for (; i < header.size && header.data[i] >= '0' && header.data[i] <= '9';
+         ++i) {
+      first = first * 10 + (header.data[i] - '0');
+      has_first = true;
+    }
+    if (i == header.size || header.data[i] != '-' || (!has_first && !suffix))
+      return 0;
+    ++i;
+    for (; i < header.size && header.data[i] >= '0' && header.data[i] <= '9';
+         ++i) {
+      last = last * 10 + (header.data[i] - '0');
+      has_last = true;
+    }
+    while (i < header.size && header.data[i] == ' ')
+      ++i;
+    if ((i < header.size && header.data[i] != ',') || (suffix && !has_last) ||
+        (has_last && !suffix && last < first))
+      return 0;
+    if (suffix) {
+      if (last == 0 || size == 0)
+        continue;
+      first = last < size ? size - last : 0;
+      last = size - 1;
+    } else {
+      if (first >= size)
+        continue;
+      if (!has_last || last >= size)
+        last = size - 1;
+    }
+    ranges[count].first = first;
+    ranges[count].last = last;
+    count++;
+  }
+  if (specs == 0)
+    return 0;
+  if (count == 0)
+    return -1;
+  std::sort(ranges, ranges + count,
+            [](const ByteRange &a, const ByteRange &b) {
+              return a.first < b.first;
+            });
+  int merged = 0;
+  for (int r = 1; r < count; ++r) {
+    if (ranges[r].first <= ranges[merged].last + 1)
+      ranges[merged].last = std::max(ranges[merged].last, ranges[r].last);
+    else
+      ranges[++merged] = ranges[r];
+  }
+  return merged + 1;
+}
+
+// Names like main.3f2a9c1b.css or app-5d41402abc.js carry a hash of their
+// content, so the URL changes whenever the file does and clients may keep
+// them forever: 8 or more hex digits (at least one a digit) just before the
+// extension
+inline bool is_content_hashed(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  size_t name = slash == std::string::npos ? 0 : slash + 1;
+  size_t extension = path.find_last_of('.');
+  if (extension == std::string::npos || extension <= name)
+    return false;
+  size_t separator = path.find_last_of(".-", extension - 1);
+  if (separator == std::string::npos || separator < name)
+    return false;
+  size_t digits = 0;
+  for (size_t i = separator + 1; i < extension; ++i) {
+    char ch = path[i];
+    if (ch >= '0' && ch <= '9')
+      digits++;
+    else if (!(ch >= 'a' && ch <= 'f') && !(ch >= 'A' && ch <= 'F'))
+      return false;
+  }
+  return extension - separator - 1 >= 8 && digits > 0;
+}
+
+// Precompressed sidecars looked for next to a static file, in order of
+// preference when the client accepts several equally (smallest first)
+struct ContentCoding {
+  const char *token;  // Accept-Encoding / Content-Encoding name
+  const char *suffix; // Sidecar file: path + suffix
+};
+static const ContentCoding content_codings[CONTENT_CODINGS] = {
+    {"br", ".br"}, {"zstd", ".zst"}, {"gzip", ".gz"}};
+
+// Length of path without a sidecar suffix, or 0 if it has none
+inline size_t sidecar_base_length(const std::string &path) {
+  for (const ContentCoding &coding : content_codings) {
+    size_t length = strlen(coding.suffix);
+    if (path.size() > length &&
+        path.compare(path.size() - length, length, coding.suffix) == 0)
+      return path.size() - length;
+  }
+  return 0;
+}
+
+// q-value of an Accept-Encoding element in thousandths ("q=0.5" -> 500);
+// params is what follows the coding name
+inline int accept_quality(StrView params) {
+  for (size_t i = 0; i + 2 < params.size; ++i) {
+    if ((params.data[i] != 'q' && params.data[i] != 'Q') ||
+        params.data[i + 1] != '=' || params.data[i + 2] < '0' ||
+        params.data[i + 2] > '9')
+      continue;
+    size_t j = i + 2;
+    int quality = (params.data[j++] - '0') * 1000;
+    if (j < params.size && params.data[j] == '.') {
+      int scale = 100;
+      for (++j; j < params.size && scale > 0 && params.data[j] >= '0' &&
+                params.data[j] <= '9';
+           ++j, scale /= 10)
+        quality += (params.data[j] - '0') * scale;
+    }
+    return std::max(0, std::min(quality, 1000));
+  }
+  return 1000;
+}
+
+// The sidecar to send: of the available codings (bit i set for
+// content_codings[i]), the one Accept-Encoding rates highest, ties going
+// to the earlier one. -1 for the file itself (no header, nothing
+// acceptable, or everything refused with q=0).
+inline int negotiate_coding(StrView header, unsigned available) {
+  int quality[CONTENT_CODINGS] = {-1, -1, -1};
+  int any = -1; // "*"
+  size_t i = 0;
+  while (i < header.size) {
+    while (i < header.size && (header.data[i] == ' ' || header.data[i] == ','))
+      ++i;
+    size_t start = i;
+    while (i < header.size && header.data[i] != ',' && header.data[i] != ';' &&
+           header.data[i] != ' ')
+      ++i;
+    StrView name(header.data + start, i - start);
+    size_t params = i;
+    while (i < header.size && header.data[i] != ',')
+      ++i;
+    if (name.empty())
+      continue;
+    int q = accept_quality(StrView(header.data + params, i - params));
+    if (name.equals("*")) {
+      any = q;
+      continue;
+    }
+    for (int c = 0; c < CONTENT_CODINGS; ++c) {
+      if (name.iequals(content_codings[c].token) ||
+          (c == 2 && name.iequals("x-gzip")))
+        quality[c] = q;
+    }
+  }
+  int best = -1;
+  int best_quality = 0;
+  for (int c = 0; c < CONTENT_CODINGS; ++c) {
+    int q = quality[c] >= 0 ? quality[c] : any;
+    if ((available & (1u << c)) && q > best_quality) {
+      best = c;
+      best_quality = q;
+    }
+  }
+  return best;
+}
+
+// A static file held in memory together with its ready-to-send headers.
+// Files over FILE_CACHE_MAX_FILE are kept without their body, so that
+// revalidations are answered without opening them.
+struct CachedFile {
+  std::string path;
+  std::string content_type;
+  bool force_plain;              // Served as text/plain for a raw view
+  bool has_body;                 // False: body is sent from the file
+  std::string body;
+  std::string header_keep_alive; // Complete header block, keep-alive variant
+  std::string header_close;      // Complete header block, close variant
+  std::string not_modified_keep_alive; // 304 header blocks
+  std::string not_modified_close;
+  std::string entity_headers; // ETag, Last-Modified, Cache-Control, Vary
+  std::string etag;
+  // A sidecar's "Content-Encoding: ...\r\n"; empty for the file itself
+  std::string encoding_header;
+  // The file itself: sidecars at least as new as it (bit i for
+  // content_codings[i]) and their paths
+  unsigned codings;
+  std::string coded_paths[CONTENT_CODINGS];
+  time_t mtime;
+  off_t size;
+  // Last stat() revalidation when inotify is unavailable
+  mutable std::atomic<time_t> checked_at;
+};
+
+// Bounded, sharded cache of small static files (and the headers and
+// validators of large ones) keyed by request path. Each shard evicts with
+// CLOCK (second chance) once over its byte budget. On Linux entries are
+// dropped by an inotify watcher as soon as the file changes, so hits never
+// touch the filesystem; elsewhere a hit re-stats the file at most once a
+// second.
+class FileCache {
+public:
+  FileCache() : inotify_fd(-1) {
+    pthread_mutex_init(&watch_mutex, NULL);
+    for (Shard &shard : shards) {
+      pthread_mutex_init(&shard.mutex, NULL);
+      shard.hand = 0;
+      shard.bytes = 0;
+      shard.generation = 0;
+    }
+  }
+
+  ~FileCache() {
+    for (Shard &shard : shards)
+      pthread_mutex_destroy(&shard.mutex);
+    pthread_mutex_destroy(&watch_mutex);
+  }
+
+  // Starts the invalidation thread; without it entries fall back to stat()
+  void startWatcher() {
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+      perror("inotify_init1");
+      return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watcher_thread, this) != 0) {
+      close(inotify_fd);
+      inotify_fd = -1;
+      return;
+    }
+    pthread_detach(thread);
+#endif
+  }
+
+  std::shared_ptr<const CachedFile> lookup(const std::string &path) {
+    Shard &shard = shardFor(path);
+    pthread_mutex_lock(&shard.mutex);
+    auto it = shard.index.find(path);
+    if (it == shard.index.end()) {
+      pthread_mutex_unlock(&shard.mutex);
+      return nullptr;
+    }
+    Slot &slot = shard.slots[it->second];
+    slot.referenced = true;
+    std::shared_ptr<const CachedFile> entry = slot.entry;
+    pthread_mutex_unlock(&shard.mutex);
+
+    if (inotify_fd == -1 && !stillFresh(*entry)) {
+      invalidate(path);
+      return nullptr;
+    }
+    return entry;
+  }
+
+  // Call before reading a file to cache; pass the result to insert() so a
+  // change noticed while reading keeps the stale copy out
+  uint64_t prepareFill(const std::string &path) {
+    watchDirectoryOf(path);
+    Shard &shard = shardFor(path);
+    pthread_mutex_lock(&shard.mutex);
+    uint64_t generation = shard.generation;
+    pthread_mutex_unlock(&shard.mutex);
+    return generation;
+  }
+
+  void insert(const std::shared_ptr<CachedFile> &entry, uint64_t generation) {
+    if (entry->body.size() > FILE_CACHE_MAX_FILE)
+      return;
+    Shard &shard = shardFor(entry->path);
+    pthread_mutex_lock(&shard.mutex);
+    if (shard.generation != generation ||
+        shard.index.count(entry->path) != 0) {
+      pthread_mutex_unlock(&shard.mutex);
+      return;
+    }
+    size_t budget = FILE_CACHE_MAX_BYTES / FILE_CACHE_SHARDS;
+    while (shard.bytes + cost(*entry) > budget && evictOne(shard)) {
+    }
+    if (shard.bytes + cost(*entry) <= budget) {
+      Slot slot;
+      slot.entry = entry;
+      slot.referenced = false;
+      shard.index[entry->path] = shard.slots.size();
+      shard.slots.push_back(slot);
+      shard.bytes += cost(*entry);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+  }
+
+  void invalidate(const std::string &path) {
+    Shard &shard = shardFor(path);
+    pthread_mutex_lock(&shard.mutex);
+    shard.generation++;
+    auto it = shard.index.find(path);
+    if (it != shard.index.end()) {
+      removeSlot(shard, it->second);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+  }
+
+  // Drop every entry under a directory (it was moved or deleted)
+  void invalidatePrefix(const std::string &prefix) {
+    for (Shard &shard : shards) {
+      pthread_mutex_lock(&shard.mutex);
+      shard.generation++;
+      for (size_t i = 0; i < shard.slots.size();) {
+        if (shard.slots[i].entry->path.compare(0, prefix.size(), prefix) ==
+            0) {
+          removeSlot(shard, i);
+        } else {
+          ++i;
+        }
+      }
+      pthread_mutex_unlock(&shard.mutex);
+    }
+  }
+
+private:
+  struct Slot {
+    std::shared_ptr<const CachedFile> entry;
+    bool referenced; // CLOCK bit, set on every hit
+  };
+
+  struct Shard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, size_t> index; // path -> slot
+    std::vector<Slot> slots;
+    size_t hand;
+    size_t bytes;
+    uint64_t generation; // Bumped by every invalidation
+  };
+
+  Shard shards[FILE_CACHE_SHARDS];
+  int inotify_fd;
+  pthread_mutex_t watch_mutex;
+  std::unordered_map<int, std::string> watched_dirs; // wd -> directory
+
+  static size_t cost(const CachedFile &entry) {
+    return entry.body.size() + FILE_CACHE_ENTRY_COST;
+  }
+
+  Shard &shardFor(const std::string &path) {
+    return shards[std::hash<std::string>()(path) % FILE_CACHE_SHARDS];
+  }
+
+  // Second-chance sweep; returns false when there is nothing to evict
+  bool evictOne(Shard &shard) {
+    if (shard.slots.empty())
+      return false;
+    while (true) {
+      if (shard.hand >= shard.slots.size())
+        shard.hand = 0;
+      Slot &slot = shard.slots[shard.hand];
+      if (slot.referenced) {
+        slot.referenced = false;
+        shard.hand++;
+      } else {
+        removeSlot(shard, shard.hand);
+        return true;
+      }
+    }
+  }
+
+  // Swap-remove; in-flight senders keep their shared_ptr alive
+  void removeSlot(Shard &shard, size_t index) {
+    shard.bytes -= cost(*shard.slots[index].entry);
+    shard.index.erase(shard.slots[index].entry->path);
+    if (index != shard.slots.size() - 1) {
+      shard.slots[index] = shard.slots.back();
+      shard.index[shard.slots[index].entry->path] = index;
+    }
+    shard.slots.pop_back();
+  }
+
+  bool stillFresh(const CachedFile &entry) {
+    time_t now = time(NULL);
+    if (now == entry.checked_at.load(std::memory_order_relaxed))
+      return true;
+    struct stat st;
+    if (stat(entry.path.c_str(), &st) == -1 || st.st_mtime != entry.mtime ||
+        st.st_size != entry.size)
+      return false;
+    // Worst case two threads both re-stat in the same second
+    entry.checked_at.store(now, std::memory_order_relaxed);
+    return true;
+  }
+
+  void watchDirectoryOf(const std::string &path) {
+#ifdef __linux__
+    if (inotify_fd == -1)
+      return;
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    pthread_mutex_lock(&watch_mutex);
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+                                   IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_CREATE | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd != -1)
+      watched_dirs[wd] = dir;
+    pthread_mutex_unlock(&watch_mutex);
+#else
+    (void)path;
+#endif
+  }
+
+#ifdef __linux__
+  static void *watcher_thread(void *arg) {
+    FileCache *cache = static_cast<FileCache *>(arg);
+    alignas(struct inotify_event) char buffer[4096];
+    while (true) {
+      ssize_t n = read(cache->inotify_fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        if (n == -1 && errno == EINTR)
+          continue;
+        return NULL;
+      }
+      for (char *p = buffer; p < buffer + n;) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+
+        pthread_mutex_lock(&cache->watch_mutex);
+        auto it = cache->watched_dirs.find(event->wd);
+        std::string dir = it == cache->watched_dirs.end() ? "" : it->second;
+        if (event->mask & IN_IGNORED)
+          cache->watched_dirs.erase(event->wd);
+        pthread_mutex_unlock(&cache->watch_mutex);
+
+        if (event->mask & IN_Q_OVERFLOW) {
+          cache->invalidatePrefix("");
+        } else if (dir.empty()) {
+          continue;
+        } else if (event->len > 0) {
+          std::string changed = dir + "/" + event->name;
+          cache->invalidate(changed);
+          // A sidecar coming or going changes what its file offers
+          size_t base = sidecar_base_length(changed);
+          if (base != 0)
+            cache->invalidate(changed.substr(0, base));
+          // A renamed or removed subdirectory takes its files with it
+          if (event->mask & IN_ISDIR)
+            cache->invalidatePrefix(changed + "/");
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+          cache->invalidatePrefix(dir + "/");
+        }
+      }
+    }
+  }
+#endif
+};
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef HTTP_PARSER_HPP
+#define HTTP_PARSER_HPP
+
+#include "simd_scan.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#define HTTP_MAX_HEADER_BLOCK (64 * 1024) // Request line plus all headers
+#define HTTP_MAX_LINE (8 * 1024)          // Any single line
+#define HTTP_MAX_HEADERS 64
+
+// Non-owning view of bytes in a buffer someone else keeps alive (C++11
+// stand-in for std::string_view)
+struct StrView {
+  const char *data;
+  size_t size;
+
+  StrView() : data(""), size(0) {}
+  StrView(const char *data, size_t size) : data(data), size(size) {}
+  StrView(const char *text) : data(text), size(strlen(text)) {}
+  template <typename Alloc>
+  StrView(const std::basic_string<char, std::char_traits<char>, Alloc> &text)
+      : data(text.data()), size(text.size()) {}
+
+  bool empty() const { return size == 0; }
+  std::string str() const { return std::string(data, size); }
+
+  bool equals(const char *literal) const {
+    return strlen(literal) == size && memcmp(data, literal, size) == 0;
+  }
+
+  // ASCII case-insensitive comparison, as header names need
+  bool iequals(const char *literal) const {
+    size_t length = strlen(literal);
+    if (length != size)
+      return false;
+    for (size_t i = 0; i < size; ++i) {
+      if (lower(data[i]) != lower(literal[i]))
+        return false;
+    }
+    return true;
+  }
+
+  // ASCII case-insensitive substring search
+  bool icontains(const char *needle) const {
+    size_t length = strlen(needle);
+    for (size_t start = 0; start + length <= size; ++start) {
+      size_t i = 0;
+      while (i < length && lower(data[start + i]) == lower(needle[i]))
+        ++i;
+      if (i == length)
+        return true;
+    }
+    return false;
+  }
+
+  static char lower(char ch) {
+    return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+  }
+};
+
+enum class http_parse { INCOMPLETE, COMPLETE, BAD_REQUEST, TOO_LARGE };
+
+// Incremental HTTP/1.x request head parser. It works in place over the
+// connection's input buffer: each call picks up at the first byte it has not
+// examined yet, so a header block trickling in over many reads is scanned
+// once in total. Fields are kept as offsets, since the buffer may move as it
+// grows, and handed out as views once the block is complete. Nothing is
+// allocated; a head over HTTP_MAX_HEADER_BLOCK bytes, a line over
+// HTTP_MAX_LINE or more than HTTP_MAX_HEADERS headers is rejected.
+class HttpParser {
+public:
+  HttpParser() { reset(); }
+
+  // Ready for the request starting at offset 0 of the buffer
+  void reset() {
+    state = http_parse::INCOMPLETE;
+    base = "";
+    start = 0;
+    line_start = 0;
+    scan = 0;
+    end = 0;
+    seen_request_line = false;
+    header_count = 0;
+  }
+
+  // buffer holds everything received so far, starting with this request.
+  // Repeated calls with more data resume where the last one stopped.
+  http_parse parse(const char *buffer, size_t length) {
+    base = buffer;
+    if (state != http_parse::INCOMPLETE)
+      return state;
+
+    while (scan < length) {
+      const char *newline =
+          scan_find_byte(buffer + scan, buffer + length, '\n');
+      if (newline == buffer + length) {
+        scan = length;
+        break;
+      }
+      size_t line_end = newline - buffer;
+      scan = line_end + 1;
+      if (scan - start > HTTP_MAX_HEADER_BLOCK ||
+          line_end - line_start > HTTP_MAX_LINE)
+        return state = http_parse::TOO_LARGE;
+
+      // Lines end in CRLF; a bare LF is tolerated
+      size_t content_end = line_end;
+      if (content_end > line_start && buffer[content_end - 1] == '\r')
+        content_end--;
+      size_t begin = line_start;
+      line_start = scan;
+
+      if (!seen_request_line) {
+        if (content_end == begin) {
+          // Stray CRLFs between pipelined requests are skipped
+          start = scan;
+          continue;
+        }
+        if (!parseRequestLine(begin, content_end))
+          return state = http_parse::BAD_REQUEST;
+        seen_request_line = true;
+        continue;
+      }
+      if (content_end == begin) {
+        end = scan;
+        return state = http_parse::COMPLETE;
+      }
+      if (header_count == HTTP_MAX_HEADERS)
+        return state = http_parse::TOO_LARGE;
+      if (!parseHeaderLine(begin, content_end))
+        return state = http_parse::BAD_REQUEST;
+    }
+
+    // The line still being received counts against the limits too
+    if (scan - start > HTTP_MAX_HEADER_BLOCK ||
+        scan - line_start > HTTP_MAX_LINE)
+      return state = http_parse::TOO_LARGE;
+    return state;
+  }
+
+  http_parse status() const { return state; }
+  bool done() const { return state != http_parse::INCOMPLETE; }
+
+  // Bytes up to and including the blank line ending the head
+  size_t length() const { return end; }
+
+  // Valid once COMPLETE, until the buffer passed to parse() changes
+  StrView method() const { return view(method_span); }
+  StrView target() const { return view(target_span); }
+  StrView version() const { return view(version_span); }
+  StrView requestLine() const {
+    return StrView(base + method_span.offset,
+                   version_span.offset + version_span.length -
+                       method_span.offset);
+  }
+  size_t headerCount() const { return header_count; }
+  StrView headerName(size_t i) const { return view(headers[i].name); }
+  StrView headerValue(size_t i) const { return view(headers[i].value); }
+
+  // First header called name (case-insensitive), or an empty view
+  StrView header(const char *name) const {
+    for (size_t i = 0; i < header_count; ++i) {
+      if (headerName(i).iequals(name))
+        return headerValue(i);
+    }
+    return StrView();
+  }
+
+private:
+  struct Span {
+    uint32_t offset;
+    uint32_t length;
+  };
+  struct HeaderSpan {
+    Span name;
+    Span value;
+  };
+
+  http_parse state;
+  const char *base; // Buffer from the most recent parse() call
+  size_t start;      // First byte of this request (after skipped CRLFs)
+  size_t line_start; // First byte of the line being received
+  size_t scan;       // First byte not examined yet
+  size_t end;
+  bool seen_request_line;
+  Span method_span;
+  Span target_span;
+  Span version_span;
+  HeaderSpan headers[HTTP_MAX_HEADERS];
+  size_t header_count;
+
+  StrView view(const Span &span) const {
+    return StrView(base + span.offset, span.length);
+  }
+
+  static Span span(size_t from, size_t to) {
+    Span result = {static_cast<uint32_t>(from),
+                   static_cast<uint32_t>(to - from)};
+    return result;
+  }
+
+  static bool isTokenChar(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+           (ch >= '0' && ch <= '9') ||
+           (ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != NULL);
+  }
+
+  // method SP request-target SP HTTP-version
+  bool parseRequestLine(size_t from, size_t to) {
+    size_t i = from;
+    while (i < to && isTokenChar(base[i]))
+      ++i;
+    if (i == from || i == to || base[i] != ' ')
+      return false;
+    method_span = span(from, i);
+
+    size_t target_start = ++i;
+    while (i < to && base[i] != ' ')
+      ++i;
+    if (i == target_start || i == to)
+      return false;
+    target_span = span(target_start, i);
+
+    size_t version_start = ++i;
+    if (to - version_start < 8 ||
+        memcmp(base + version_start, "HTTP/", 5) != 0)
+      return false;
+    for (size_t j = version_start; j < to; ++j) {
+      if (base[j] == ' ' || base[j] == '\t')
+        return false;
+    }
+    version_span = span(version_start, to);
+    return true;
+  }
+
+  // field-name ":" OWS field-value OWS
+  bool parseHeaderLine(size_t from, size_t to) {
+    size_t i = from;
+    while (i < to && isTokenChar(base[i]))
+      ++i;
+    // Also rejects obsolete line folding (continuation lines start with SP)
+    if (i == from || i == to || base[i] != ':')
+      return false;
+    HeaderSpan &header = headers[header_count++];
+    header.name = span(from, i);
+
+    size_t value_start = i + 1;
+    while (value_start < to &&
+           (base[value_start] == ' ' || base[value_start] == '\t'))
+      ++value_start;
+    size_t value_end = to;
+    while (value_end > value_start &&
+           (base[value_end - 1] == ' ' || base[value_end - 1] == '\t'))
+      --value_end;
+    header.value = span(value_start, value_end);
+    return true;
+  }
+};
+
+#endif
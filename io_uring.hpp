@@ -0,0 +1,271 @@
+#ifndef IO_URING_HPP
+#define IO_URING_HPP
+
+// Minimal io_uring wrapper over the raw system calls (no liburing). Only the
+// event loop thread touches a ring: it fills SQEs during an iteration and
+// submits them all in the same io_uring_enter() that waits for completions.
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Headers from before multishot receive (6.0) also lack the provided buffer
+// rings and cancel flags used here; such builds fall back to epoll
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFFER_COUNT 512 // Provided receive buffers per ring
+#define URING_BUFFER_GROUP 0
+
+// 6.1; a kernel without it rejects the setup flags and gets a plain ring
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+
+class IoUring {
+public:
+  IoUring()
+      : ring_fd(-1), sq_ring(NULL), cq_ring(NULL), sqes(NULL), sq_ring_size(0),
+        cq_ring_size(0), sqes_size(0), buf_ring(NULL),
+        buf_ring_size(0), buffers(NULL), buffer_size(0), buffer_count(0) {}
+
+  ~IoUring() {
+    if (buffers != NULL)
+      munmap(buffers, (size_t)buffer_size * buffer_count);
+    if (buf_ring != NULL)
+      munmap(buf_ring, buf_ring_size);
+    if (sqes != NULL)
+      munmap(sqes, sqes_size);
+    if (cq_ring != NULL && cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    if (sq_ring != NULL)
+      munmap(sq_ring, sq_ring_size);
+    if (ring_fd != -1)
+      close(ring_fd);
+  }
+
+  // False when the kernel lacks io_uring or it is disabled
+  bool init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are only reaped by the submitting thread, inside enter()
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd == -1 && errno == EINVAL) {
+      memset(&params, 0, sizeof(params));
+      ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring_fd == -1)
+      return false;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      if (cq_ring_size > sq_ring_size)
+        sq_ring_size = cq_ring_size;
+      cq_ring_size = sq_ring_size;
+    }
+    sq_ring = (char *)mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd,
+                           IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+      sq_ring = NULL;
+      return false;
+    }
+    if (single_mmap) {
+      cq_ring = sq_ring;
+    } else {
+      cq_ring = (char *)mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd,
+                             IORING_OFF_CQ_RING);
+      if (cq_ring == MAP_FAILED) {
+        cq_ring = NULL;
+        return false;
+      }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqes_size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring_fd,
+                                       IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      sqes = NULL;
+      return false;
+    }
+
+    sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    // Identity mapping; SQEs are used in ring order
+    for (unsigned i = 0; i < sq_entries; ++i)
+      sq_array[i] = i;
+    local_tail = *sq_tail;
+    return true;
+  }
+
+  // Registers count buffers of size bytes as a provided-buffer ring; recvs
+  // with IOSQE_BUFFER_SELECT pick one and report its id in the CQE
+  bool setupBuffers(unsigned count, unsigned size) {
+    buf_ring_size = count * sizeof(struct io_uring_buf);
+    buf_ring = (struct io_uring_buf_ring *)mmap(
+        NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+      buf_ring = NULL;
+      return false;
+    }
+    buffers = (char *)mmap(NULL, (size_t)size * count, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+      buffers = NULL;
+      return false;
+    }
+    buffer_size = size;
+    buffer_count = count;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0)
+      return false;
+
+    buf_tail = 0;
+    for (unsigned i = 0; i < count; ++i)
+      addBuffer(i);
+    publishBuffers();
+    return true;
+  }
+
+  char *buffer(uint16_t id) { return buffers + (size_t)id * buffer_size; }
+
+  // Hands a consumed buffer back to the kernel
+  void recycleBuffer(uint16_t id) {
+    addBuffer(id);
+    publishBuffers();
+  }
+
+  // Makes room for count SQEs, submitting queued ones if needed. Linked
+  // SQEs must be reserved together so a submit cannot split the chain.
+  bool reserve(unsigned count) {
+    if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count <=
+        sq_entries)
+      return true;
+    enter(0, 0, NULL);
+    return local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count <=
+           sq_entries;
+  }
+
+  // Next free SQE, zeroed; NULL if the ring stays full
+  struct io_uring_sqe *getSqe() {
+    if (!reserve(1))
+      return NULL;
+    struct io_uring_sqe *sqe = &sqes[local_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    local_tail++;
+    return sqe;
+  }
+
+  // Submits everything queued this iteration and waits up to timeout_ms for
+  // at least one completion. Returns 0 or -errno (-ETIME on timeout).
+  int submitAndWait(int timeout_ms) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    return enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg);
+  }
+
+  // Completion at the head of the CQ, or NULL when drained
+  struct io_uring_cqe *peekCqe() {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      return NULL;
+    return &cqes[head & cq_mask];
+  }
+
+  void seenCqe() { __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE); }
+
+private:
+  int ring_fd;
+  char *sq_ring;
+  char *cq_ring;
+  struct io_uring_sqe *sqes;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned local_tail; // SQEs filled but not yet published
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned buffer_size;
+  unsigned buffer_count;
+  uint16_t buf_tail; // Local copy of the buffer ring tail
+
+  void addBuffer(uint16_t id) {
+    // Entries start at offset 0, overlapping the tail. Not via bufs[]: the
+    // header's flex-array wrapper puts it at offset 8 when compiled as C++.
+    struct io_uring_buf *buf =
+        reinterpret_cast<struct io_uring_buf *>(buf_ring) +
+        (buf_tail & (buffer_count - 1));
+    buf->addr = (uint64_t)(uintptr_t)buffer(id);
+    buf->len = buffer_size;
+    buf->bid = id;
+    buf_tail++;
+  }
+
+  void publishBuffers() {
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+  }
+
+  int enter(unsigned min_complete, unsigned flags, void *arg) {
+    __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    // Without work to submit or reap there is nothing to enter for
+    if (to_submit == 0 && !(flags & IORING_ENTER_GETEVENTS))
+      return 0;
+    int rc = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                          min_complete, flags, arg,
+                          arg != NULL ? sizeof(struct io_uring_getevents_arg)
+                                      : 0);
+    return rc < 0 ? -errno : 0;
+  }
+};
+
+#endif // HAVE_IO_URING
+#endif
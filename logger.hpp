@@ -0,0 +1,271 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include "http_parser.hpp"
+#include "spsc_ring.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+#define LOG_RING_CAPACITY 4096      // Records per producer (a power of two)
+#define LOG_TEXT_SIZE 232           // Message bytes per record; the rest is cut
+#define LOG_BATCH_SIZE (64 * 1024)  // Formatted bytes per write()
+#define LOG_IDLE_SLEEP_US 1000      // Writer nap when every ring is empty,
+#define LOG_IDLE_SLEEP_MAX_US 32000 // doubled per idle pass up to this
+
+// Calls below this level compile to nothing (0 TRACE, 1 INFO, 2 ERROR);
+// build with -DLOG_COMPILED_LEVEL=1 to drop tracing from the binary
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+enum class log_level { TRACE, INFO, ERROR };
+
+inline const char *log_level_name(log_level level) {
+  switch (level) {
+  case log_level::TRACE:
+    return "TRACE";
+  case log_level::INFO:
+    return "INFO";
+  case log_level::ERROR:
+    return "ERROR";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+// One log line as the producer left it: the message text plus what the
+// writer needs to put the usual prefix in front of it
+struct LogRecord {
+  uint64_t request_id;
+  const char *category; // Static string, or NULL for none
+  int32_t thread_id;
+  log_level level;
+  uint16_t length;
+  char text[LOG_TEXT_SIZE];
+};
+
+// A producing thread's queue of log records (see spsc_ring.hpp)
+class LogRing : public SpscRing<LogRecord, LOG_RING_CAPACITY> {
+public:
+  bool write(log_level level, const char *category, uint64_t request_id,
+             int thread_id, StrView message) {
+    LogRecord *record = claim(level, category, request_id, thread_id);
+    if (record == NULL)
+      return false;
+    size_t length = std::min(message.size, sizeof(record->text));
+    memcpy(record->text, message.data, length);
+    record->length = static_cast<uint16_t>(length);
+    publish();
+    return true;
+  }
+
+  // Formats straight into the slot; format must be a printf format
+  template <typename... Args>
+  bool writef(log_level level, const char *category, uint64_t request_id,
+              int thread_id, const char *format, Args... args) {
+    LogRecord *record = claim(level, category, request_id, thread_id);
+    if (record == NULL)
+      return false;
+    int length = snprintf(record->text, sizeof(record->text), format, args...);
+    if (length < 0)
+      length = 0;
+    record->length = static_cast<uint16_t>(
+        std::min(static_cast<size_t>(length), sizeof(record->text) - 1));
+    publish();
+    return true;
+  }
+
+private:
+  LogRecord *claim(log_level level, const char *category, uint64_t request_id,
+                   int thread_id) {
+    LogRecord *record = SpscRing::claim();
+    if (record != NULL) {
+      record->request_id = request_id;
+      record->category = category;
+      record->thread_id = thread_id;
+      record->level = level;
+    }
+    return record;
+  }
+};
+
+// Asynchronous logger. Each producing thread gets its own LogRing from
+// openRing(); a background thread drains every ring, adds the
+// "[#request]  T:thread LEVEL: " prefix and writes the lines out in large
+// batches, so a log call costs a copy (or a snprintf) into memory the
+// producer already owns: no lock, no syscall. Records dropped because a
+// ring was full are reported in the output. Lines from different threads
+// are not ordered against each other.
+class AsyncLogger {
+public:
+  AsyncLogger()
+      : fd(STDOUT_FILENO), running(false), total_dropped(0), batch_length(0) {
+    pthread_mutex_init(&rings_mutex, NULL);
+  }
+
+  ~AsyncLogger() {
+    stop();
+    for (LogRing *ring : rings)
+      delete ring;
+    pthread_mutex_destroy(&rings_mutex);
+  }
+
+  // Rings live as long as the logger
+  LogRing *openRing() {
+    LogRing *ring = new LogRing();
+    pthread_mutex_lock(&rings_mutex);
+    rings.push_back(ring);
+    pthread_mutex_unlock(&rings_mutex);
+    return ring;
+  }
+
+  bool start(int out_fd = STDOUT_FILENO) {
+    if (running.load())
+      return true;
+    fd = out_fd;
+    running.store(true);
+    if (pthread_create(&thread, NULL, writer_thread, this) != 0) {
+      running.store(false);
+      return false;
+    }
+    return true;
+  }
+
+  // Writes out everything already logged, then stops the writer
+  void stop() {
+    if (!running.exchange(false))
+      return;
+    pthread_join(thread, NULL);
+    drain();
+  }
+
+  uint64_t droppedRecords() const { return total_dropped.load(); }
+
+private:
+  int fd;
+  std::atomic<bool> running;
+  std::atomic<uint64_t> total_dropped;
+  pthread_t thread;
+  pthread_mutex_t rings_mutex;
+  std::vector<LogRing *> rings;
+  char batch[LOG_BATCH_SIZE];
+  size_t batch_length;
+
+  static void *writer_thread(void *arg) {
+    AsyncLogger *logger = static_cast<AsyncLogger *>(arg);
+    // Back off while idle so a quiet server is not woken 1000 times a
+    // second; the first record written drops back to the short nap
+    useconds_t nap = LOG_IDLE_SLEEP_US;
+    while (logger->running.load(std::memory_order_relaxed)) {
+      if (logger->drain()) {
+        nap = LOG_IDLE_SLEEP_US;
+        continue;
+      }
+      usleep(nap);
+      if (nap < LOG_IDLE_SLEEP_MAX_US)
+        nap *= 2;
+    }
+    return NULL;
+  }
+
+  // One pass over every ring; false if there was nothing to write
+  bool drain() {
+    batch_length = 0;
+    bool wrote = false;
+    pthread_mutex_lock(&rings_mutex);
+    for (LogRing *ring : rings) {
+      const LogRecord *record;
+      while ((record = ring->peek()) != NULL) {
+        append(*record);
+        ring->pop();
+        wrote = true;
+      }
+      uint64_t dropped = ring->takeDropped();
+      if (dropped > 0) {
+        total_dropped.fetch_add(dropped);
+        reserve(64);
+        batch_length += snprintf(batch + batch_length, 64,
+                                 "[logger] dropped %llu records\n",
+                                 static_cast<unsigned long long>(dropped));
+        wrote = true;
+      }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    flush();
+    return wrote;
+  }
+
+  // "[#<request>]  T:<thread> <LEVEL>: [TYPE=<category>: ]<text>\n", put
+  // together by hand: this loop is the writer's whole cost per line
+  void append(const LogRecord &record) {
+    reserve(128 + record.length);
+    char *out = batch + batch_length;
+    out = copy(out, "[#");
+    out = decimal(out, record.request_id);
+    out = copy(out, "]  T:");
+    if (record.thread_id < 0) {
+      *out++ = '-';
+      out = decimal(out, -static_cast<int64_t>(record.thread_id));
+    } else {
+      out = decimal(out, record.thread_id);
+    }
+    *out++ = ' ';
+    out = copy(out, log_level_name(record.level));
+    out = copy(out, ": ");
+    if (record.category != NULL) {
+      out = copy(out, "TYPE=");
+      out = copy(out, record.category);
+      out = copy(out, ": ");
+    }
+    memcpy(out, record.text, record.length);
+    out += record.length;
+    *out++ = '\n';
+    batch_length = out - batch;
+  }
+
+  // Only used with the short static strings above and in log_level_name()
+  static char *copy(char *out, const char *text) {
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+  }
+
+  static char *decimal(char *out, uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+      digits[count++] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    while (count > 0)
+      *out++ = digits[--count];
+    return out;
+  }
+
+  void reserve(size_t bytes) {
+    if (batch_length + bytes > sizeof(batch))
+      flush();
+  }
+
+  void flush() {
+    size_t written = 0;
+    while (written < batch_length) {
+      ssize_t n = ::write(fd, batch + written, batch_length - written);
+      if (n > 0) {
+        written += n;
+      } else if (!(n == -1 && errno == EINTR)) {
+        break; // Nowhere to log to; drop the batch
+      }
+    }
+    batch_length = 0;
+  }
+};
+
+#endif
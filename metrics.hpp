@@ -0,0 +1,306 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define METRICS_SUB_BITS 4   // 16 linear steps per power of two (<= 6.25%)
+#define METRICS_MAX_BITS 36  // Latencies up to 2^36 ns (~69 s), then clamped
+#define METRICS_BUCKETS (((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) \
+                          << METRICS_SUB_BITS))
+#define METRICS_TYPES 8      // Request types a shard has room for
+#define METRICS_STATUS_CLASSES 6 // No response, then 1xx .. 5xx
+
+// Where a request's time goes. The worker records the first three, the
+// event loop the last two once the response has left the process.
+enum class metric_stage { QUEUE, PARSE, HANDLE, SEND, TOTAL };
+#define METRICS_STAGES 5
+
+inline const char *metric_stage_name(size_t stage) {
+  static const char *const names[METRICS_STAGES] = {"queue", "parse", "handle",
+                                                    "send", "total"};
+  return names[stage];
+}
+
+// Log-linear (HDR-style) bucketing of nanosecond values: exact below 16,
+// then 16 equal steps between each power of two and the next, so every
+// bucket is within 1/16 of its value at any magnitude
+inline size_t latency_bucket(uint64_t ns) {
+  const uint64_t sub_count = 1 << METRICS_SUB_BITS;
+  if (ns < sub_count)
+    return static_cast<size_t>(ns);
+  if (ns >> METRICS_MAX_BITS)
+    return METRICS_BUCKETS - 1;
+  int top = 63 - __builtin_clzll(ns);
+  int shift = top - METRICS_SUB_BITS;
+  return static_cast<size_t>((top - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+         static_cast<size_t>((ns >> shift) & (sub_count - 1));
+}
+
+// Smallest value that lands in bucket; bucket + 1 gives its upper bound
+inline uint64_t latency_bucket_floor(size_t bucket) {
+  const size_t sub_count = 1 << METRICS_SUB_BITS;
+  if (bucket < sub_count)
+    return bucket;
+  int shift = static_cast<int>(bucket >> METRICS_SUB_BITS) - 1;
+  return static_cast<uint64_t>(sub_count + (bucket & (sub_count - 1)))
+         << shift;
+}
+
+// One thread's counters. Only the owning thread writes them, so an update
+// is a relaxed load and store (no lock prefix, no shared cache line);
+// readers see each value whole and may be a request behind.
+class MetricsShard {
+public:
+  MetricsShard() {
+    for (size_t type = 0; type < METRICS_TYPES; ++type) {
+      for (size_t stage = 0; stage < METRICS_STAGES; ++stage) {
+        for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+          latency[type][stage][i].store(0, std::memory_order_relaxed);
+        latency_sum[type][stage].store(0, std::memory_order_relaxed);
+      }
+      for (size_t status = 0; status < METRICS_STATUS_CLASSES; ++status)
+        requests[type][status].store(0, std::memory_order_relaxed);
+      bytes[type].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(size_t type, metric_stage stage, uint64_t ns) {
+    size_t s = static_cast<size_t>(stage);
+    bump(latency[type][s][latency_bucket(ns)], 1);
+    bump(latency_sum[type][s], ns);
+  }
+
+  void countRequest(size_t type, unsigned status, uint64_t response_bytes) {
+    size_t status_class = status / 100;
+    if (status_class >= METRICS_STATUS_CLASSES)
+      status_class = 0;
+    bump(requests[type][status_class], 1);
+    bump(bytes[type], response_bytes);
+  }
+
+private:
+  friend class Metrics;
+  std::atomic<uint64_t> latency[METRICS_TYPES][METRICS_STAGES][METRICS_BUCKETS];
+  std::atomic<uint64_t> latency_sum[METRICS_TYPES][METRICS_STAGES];
+  std::atomic<uint64_t> requests[METRICS_TYPES][METRICS_STATUS_CLASSES];
+  std::atomic<uint64_t> bytes[METRICS_TYPES];
+
+  static void bump(std::atomic<uint64_t> &counter, uint64_t by) {
+    counter.store(counter.load(std::memory_order_relaxed) + by,
+                  std::memory_order_relaxed);
+  }
+};
+
+// Appends "# HELP" and "# TYPE" for a metric family
+inline void metrics_family(std::string &out, const char *name,
+                           const char *type, const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+inline void metrics_gauge(std::string &out, const char *name,
+                          const char *help, uint64_t value) {
+  metrics_family(out, name, "gauge", help);
+  char line[128];
+  snprintf(line, sizeof(line), "%s %llu\n", name,
+           static_cast<unsigned long long>(value));
+  out += line;
+}
+
+// Registry of every thread's shard. Recording never touches it; a scrape
+// sums the shards into a snapshot and writes Prometheus text format.
+class Metrics {
+public:
+  Metrics() { pthread_mutex_init(&shards_mutex, NULL); }
+
+  ~Metrics() {
+    for (MetricsShard *shard : shards)
+      delete shard;
+    pthread_mutex_destroy(&shards_mutex);
+  }
+
+  // Shards live as long as the registry
+  MetricsShard *openShard() {
+    MetricsShard *shard = new MetricsShard();
+    pthread_mutex_lock(&shards_mutex);
+    shards.push_back(shard);
+    pthread_mutex_unlock(&shards_mutex);
+    return shard;
+  }
+
+  // Request counters and stage histograms for every type with a name in
+  // type_names (METRICS_TYPES entries, NULL for unused ones). Types and
+  // stages that have seen nothing are left out.
+  void render(std::string &out, const char *const *type_names) {
+    Snapshot *total = new Snapshot();
+    pthread_mutex_lock(&shards_mutex);
+    for (MetricsShard *shard : shards)
+      total->add(*shard);
+    pthread_mutex_unlock(&shards_mutex);
+
+    static const char *const status_names[METRICS_STATUS_CLASSES] = {
+        "none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+    char line[256];
+    metrics_family(out, "capture_requests_total", "counter",
+                   "Requests answered, by type and status class");
+    for (size_t type = 0; type < METRICS_TYPES; ++type) {
+      for (size_t status = 0; status < METRICS_STATUS_CLASSES; ++status) {
+        if (type_names[type] == NULL || total->requests[type][status] == 0)
+          continue;
+        snprintf(line, sizeof(line),
+                 "capture_requests_total{type=\"%s\",code=\"%s\"} %llu\n",
+                 type_names[type], status_names[status],
+                 static_cast<unsigned long long>(
+                     total->requests[type][status]));
+        out += line;
+      }
+    }
+    metrics_family(out, "capture_response_bytes_total", "counter",
+                   "Response bytes handed to the socket, headers included");
+    for (size_t type = 0; type < METRICS_TYPES; ++type) {
+      if (type_names[type] == NULL || total->bytes[type] == 0)
+        continue;
+      snprintf(line, sizeof(line),
+               "capture_response_bytes_total{type=\"%s\"} %llu\n",
+               type_names[type],
+               static_cast<unsigned long long>(total->bytes[type]));
+      out += line;
+    }
+
+    // Prometheus buckets are cumulative and coarse; each fine bucket is
+    // counted under the first bound its whole range fits below
+    static const double bounds[] = {10e-6, 25e-6, 50e-6, 100e-6, 250e-6,
+                                    500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3,
+                                    25e-3, 50e-3, 100e-3, 250e-3, 500e-3,
+                                    1, 2.5, 5, 10};
+    static const size_t bound_count = sizeof(bounds) / sizeof(bounds[0]);
+    metrics_family(out, "capture_stage_seconds", "histogram",
+                   "Time spent in each stage of a request: queue (head "
+                   "complete to worker), parse, handle (handler, response "
+                   "queued), send (rest of the response written), total");
+    for (size_t type = 0; type < METRICS_TYPES; ++type) {
+      for (size_t stage = 0; stage < METRICS_STAGES; ++stage) {
+        if (type_names[type] == NULL)
+          continue;
+        const uint64_t *buckets = total->latency[type][stage];
+        uint64_t count = 0;
+        for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+          count += buckets[i];
+        if (count == 0)
+          continue;
+        size_t fine = 0;
+        uint64_t below = 0;
+        for (size_t b = 0; b < bound_count; ++b) {
+          uint64_t bound_ns = static_cast<uint64_t>(bounds[b] * 1e9);
+          while (fine < METRICS_BUCKETS &&
+                 latency_bucket_floor(fine + 1) <= bound_ns + 1)
+            below += buckets[fine++];
+          snprintf(line, sizeof(line),
+                   "capture_stage_seconds_bucket{type=\"%s\",stage=\"%s\","
+                   "le=\"%g\"} %llu\n",
+                   type_names[type], metric_stage_name(stage), bounds[b],
+                   static_cast<unsigned long long>(below));
+          out += line;
+        }
+        snprintf(line, sizeof(line),
+                 "capture_stage_seconds_bucket{type=\"%s\",stage=\"%s\","
+                 "le=\"+Inf\"} %llu\n"
+                 "capture_stage_seconds_sum{type=\"%s\",stage=\"%s\"} %.9f\n"
+                 "capture_stage_seconds_count{type=\"%s\",stage=\"%s\"} "
+                 "%llu\n",
+                 type_names[type], metric_stage_name(stage),
+                 static_cast<unsigned long long>(count), type_names[type],
+                 metric_stage_name(stage),
+                 total->latency_sum[type][stage] / 1e9, type_names[type],
+                 metric_stage_name(stage),
+                 static_cast<unsigned long long>(count));
+        out += line;
+      }
+    }
+
+    // The fine buckets answer quantiles the coarse ones cannot
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    metrics_family(out, "capture_stage_quantile_seconds", "gauge",
+                   "Stage latency quantiles since start, from log-linear "
+                   "histograms accurate to 1/16");
+    for (size_t type = 0; type < METRICS_TYPES; ++type) {
+      for (size_t stage = 0; stage < METRICS_STAGES; ++stage) {
+        if (type_names[type] == NULL)
+          continue;
+        const uint64_t *buckets = total->latency[type][stage];
+        uint64_t count = 0;
+        for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+          count += buckets[i];
+        if (count == 0)
+          continue;
+        for (double quantile : quantiles) {
+          snprintf(line, sizeof(line),
+                   "capture_stage_quantile_seconds{type=\"%s\",stage=\"%s\","
+                   "quantile=\"%g\"} %.9f\n",
+                   type_names[type], metric_stage_name(stage), quantile,
+                   valueAt(buckets, count, quantile) / 1e9);
+          out += line;
+        }
+      }
+    }
+    delete total;
+  }
+
+private:
+  // Plain copy of the shards, summed
+  struct Snapshot {
+    uint64_t latency[METRICS_TYPES][METRICS_STAGES][METRICS_BUCKETS];
+    uint64_t latency_sum[METRICS_TYPES][METRICS_STAGES];
+    uint64_t requests[METRICS_TYPES][METRICS_STATUS_CLASSES];
+    uint64_t bytes[METRICS_TYPES];
+
+    Snapshot() : latency(), latency_sum(), requests(), bytes() {}
+
+    void add(const MetricsShard &shard) {
+      for (size_t type = 0; type < METRICS_TYPES; ++type) {
+        for (size_t stage = 0; stage < METRICS_STAGES; ++stage) {
+          for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+            latency[type][stage][i] += shard.latency[type][stage][i].load(
+                std::memory_order_relaxed);
+          latency_sum[type][stage] +=
+              shard.latency_sum[type][stage].load(std::memory_order_relaxed);
+        }
+        for (size_t status = 0; status < METRICS_STATUS_CLASSES; ++status)
+          requests[type][status] +=
+              shard.requests[type][status].load(std::memory_order_relaxed);
+        bytes[type] += shard.bytes[type].load(std::memory_order_relaxed);
+      }
+    }
+  };
+
+  pthread_mutex_t shards_mutex;
+  std::vector<MetricsShard *> shards;
+
+  // Midpoint of the bucket holding the quantile-th value
+  static double valueAt(const uint64_t *buckets, uint64_t count,
+                        double quantile) {
+    uint64_t rank = static_cast<uint64_t>(quantile * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i) {
+      seen += buckets[i];
+      if (seen >= rank)
+        return (latency_bucket_floor(i) + latency_bucket_floor(i + 1)) / 2.0;
+    }
+    return static_cast<double>(latency_bucket_floor(METRICS_BUCKETS));
+  }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef MPMC_QUEUE_HPP
+#define MPMC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
+
+#define MPMC_CACHE_LINE 64
+#define MPMC_SPIN_LIMIT 200 // Failed polls before a consumer parks
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Spinning only pays off when the thread we wait for runs on another core
+static inline unsigned spin_limit() {
+  static const unsigned limit =
+      sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPIN_LIMIT : 0;
+  return limit;
+}
+
+// Bounded multi-producer/multi-consumer ring (Vyukov). Each slot carries a
+// sequence number telling producers and consumers whose turn it is, so push
+// and pop are a single CAS on their own index with no shared lock.
+//
+// Blocking pop() spins for a while and then parks on a condition variable.
+// Producers only touch the mutex when a consumer is actually parked, so a
+// busy pool never makes a futex call. push() waits for room by spinning and
+// yielding; a full queue means every worker is already busy.
+template <typename T> class MpmcQueue {
+public:
+  // capacity is rounded up to a power of two
+  explicit MpmcQueue(size_t capacity) : closed(false), parked(0) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    mask = size - 1;
+    slots = std::vector<Slot>(size);
+    for (size_t i = 0; i < size; ++i)
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    pthread_mutex_init(&park_mutex, NULL);
+    pthread_cond_init(&park_cond, NULL);
+  }
+
+  ~MpmcQueue() {
+    pthread_cond_destroy(&park_cond);
+    pthread_mutex_destroy(&park_mutex);
+  }
+
+  bool tryPush(const T &item) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          slot.item = item;
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // Full
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T &item) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          item = slot.item;
+          slot.sequence.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // Empty
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void push(const T &item) {
+    for (unsigned spin = 0; !tryPush(item); ++spin) {
+      if (spin < spin_limit())
+        cpu_relax();
+      else
+        sched_yield();
+    }
+    // Pairs with the fence in pop(): either the parked consumer sees the
+    // item on its re-check, or we see it parked and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed) > 0) {
+      pthread_mutex_lock(&park_mutex);
+      pthread_cond_signal(&park_cond);
+      pthread_mutex_unlock(&park_mutex);
+    }
+  }
+
+  // Blocks until an item arrives; false once closed and drained
+  bool pop(T &item) {
+    while (true) {
+      for (unsigned spin = 0; spin < spin_limit(); ++spin) {
+        if (tryPop(item))
+          return true;
+        cpu_relax();
+      }
+
+      pthread_mutex_lock(&park_mutex);
+      parked.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      bool got = tryPop(item);
+      bool done = !got && closed.load(std::memory_order_acquire);
+      if (!got && !done)
+        pthread_cond_wait(&park_cond, &park_mutex);
+      parked.fetch_sub(1, std::memory_order_relaxed);
+      pthread_mutex_unlock(&park_mutex);
+      if (got)
+        return true;
+      if (done)
+        return false;
+    }
+  }
+
+  // Wakes every consumer; pop() keeps returning queued items, then false
+  void close() {
+    pthread_mutex_lock(&park_mutex);
+    closed.store(true, std::memory_order_release);
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_mutex);
+  }
+
+  // Approximate; for monitoring only
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_relaxed);
+    return t > h ? t - h : 0;
+  }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T item;
+
+    Slot() : sequence(0), item() {}
+    // Only copied while the queue is being built
+    Slot(const Slot &other)
+        : sequence(other.sequence.load(std::memory_order_relaxed)),
+          item(other.item) {}
+  };
+
+  std::vector<Slot> slots;
+  size_t mask;
+  // Producers and consumers each get their own cache line. Padding rather
+  // than alignas keeps heap allocation free of C++17 aligned new.
+  char pad0[MPMC_CACHE_LINE];
+  std::atomic<size_t> tail;
+  char pad1[MPMC_CACHE_LINE - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> head;
+  char pad2[MPMC_CACHE_LINE - sizeof(std::atomic<size_t>)];
+  std::atomic<bool> closed;
+  std::atomic<unsigned> parked;
+  pthread_mutex_t park_mutex;
+  pthread_cond_t park_cond;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef ROUTER_HPP
+#define ROUTER_HPP
+
+#include "http_parser.hpp"
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define ROUTER_MAX_PARAMS 32 // Query parameters kept per request
+
+// A query string split into key/value views, in order of appearance. Values
+// are left percent-encoded; nothing is copied or allocated. Parameters past
+// ROUTER_MAX_PARAMS are ignored.
+class QueryParams {
+public:
+  QueryParams() : count(0) {}
+
+  void parse(StrView query) {
+    source = query;
+    count = 0;
+    const char *p = query.data;
+    const char *end = query.data + query.size;
+    while (p < end && count < ROUTER_MAX_PARAMS) {
+      const char *amp = static_cast<const char *>(memchr(p, '&', end - p));
+      const char *pair_end = amp != NULL ? amp : end;
+      const char *eq = static_cast<const char *>(memchr(p, '=', pair_end - p));
+      const char *key_end = eq != NULL ? eq : pair_end;
+      if (key_end != p) {
+        keys[count] = StrView(p, key_end - p);
+        values[count] = eq != NULL ? StrView(eq + 1, pair_end - eq - 1)
+                                   : StrView();
+        count++;
+      }
+      p = pair_end + 1;
+    }
+  }
+
+  StrView raw() const { return source; } // The whole query string
+  size_t size() const { return count; }
+  StrView key(size_t i) const { return keys[i]; }
+  StrView value(size_t i) const { return values[i]; }
+
+  bool has(const char *key) const { return find(key) != count; }
+
+  // First value for key, or an empty view
+  StrView get(const char *key) const {
+    size_t i = find(key);
+    return i != count ? values[i] : StrView();
+  }
+
+private:
+  StrView source;
+  StrView keys[ROUTER_MAX_PARAMS];
+  StrView values[ROUTER_MAX_PARAMS];
+  size_t count;
+
+  size_t find(const char *key) const {
+    for (size_t i = 0; i < count; ++i) {
+      if (keys[i].equals(key))
+        return i;
+    }
+    return count;
+  }
+};
+
+// Resolves "." and ".." segments and collapses repeated slashes in an
+// absolute path, rewriting it in place in a single left-to-right pass (the
+// output never outgrows the input). A trailing slash is kept. Fails, leaving
+// the path unusable, if it is not absolute, holds a NUL byte, or a ".."
+// would climb above the root.
+static inline bool normalize_path(char *path, size_t &length) {
+  if (length == 0 || path[0] != '/')
+    return false;
+  size_t in = 1;
+  size_t out = 1; // path[0, out) is the result so far and ends with '/'
+  while (in < length) {
+    if (path[in] == '/') {
+      ++in;
+      continue;
+    }
+    size_t segment_end = in;
+    while (segment_end < length && path[segment_end] != '/') {
+      if (path[segment_end] == '\0')
+        return false;
+      ++segment_end;
+    }
+    size_t segment_length = segment_end - in;
+    if (segment_length == 1 && path[in] == '.') {
+      in = segment_end + 1;
+      continue;
+    }
+    if (segment_length == 2 && path[in] == '.' && path[in + 1] == '.') {
+      if (out == 1)
+        return false;
+      // Drop the last output segment, keeping the slash before it
+      --out;
+      while (path[out - 1] != '/')
+        --out;
+      in = segment_end + 1;
+      continue;
+    }
+    memmove(path + out, path + in, segment_length);
+    out += segment_length;
+    in = segment_end;
+    if (in < length)
+      path[out++] = '/';
+  }
+  length = out;
+  return true;
+}
+
+// Path router over a radix trie built once at startup. A route is either an
+// exact path or a prefix; a lookup walks the trie once along the path,
+// remembering the deepest prefix route passed, so its cost depends on the
+// path length and not on how many routes exist. An exact match wins over
+// any prefix, and a longer prefix over a shorter one, regardless of the
+// order routes were added in.
+template <typename Handler> class Router {
+public:
+  Router() { nodes.push_back(Node()); }
+
+  void exact(const char *path, Handler handler) {
+    Node &node = nodes[insert(path)];
+    node.exact_handler = handler;
+    node.has_exact = true;
+  }
+
+  void prefix(const char *path, Handler handler) {
+    Node &node = nodes[insert(path)];
+    node.prefix_handler = handler;
+    node.has_prefix = true;
+  }
+
+  // False if no route covers path
+  bool match(StrView path, Handler &handler) const {
+    bool found = false;
+    size_t node = 0;
+    size_t pos = 0;
+    while (true) {
+      const Node &current = nodes[node];
+      if (pos == path.size && current.has_exact) {
+        handler = current.exact_handler;
+        return true;
+      }
+      if (current.has_prefix) {
+        handler = current.prefix_handler;
+        found = true;
+      }
+      if (pos == path.size)
+        break;
+      size_t child = findChild(node, path.data[pos]);
+      if (child == NO_NODE)
+        break;
+      const std::string &label = nodes[child].label;
+      if (path.size - pos < label.size() ||
+          memcmp(path.data + pos, label.data(), label.size()) != 0)
+        break;
+      pos += label.size();
+      node = child;
+    }
+    return found;
+  }
+
+private:
+  static const size_t NO_NODE = static_cast<size_t>(-1);
+
+  // Edges carry whole label strings; siblings differ in their first byte
+  struct Node {
+    std::string label;
+    std::vector<size_t> children;
+    Handler exact_handler;
+    Handler prefix_handler;
+    bool has_exact;
+    bool has_prefix;
+
+    Node() : exact_handler(), prefix_handler(), has_exact(false),
+             has_prefix(false) {}
+  };
+  std::vector<Node> nodes; // nodes[0] is the root, with an empty label
+
+  size_t findChild(size_t node, char first) const {
+    for (size_t child : nodes[node].children) {
+      if (nodes[child].label[0] == first)
+        return child;
+    }
+    return NO_NODE;
+  }
+
+  // Node for path, splitting an edge where path diverges from it
+  size_t insert(const char *path) {
+    size_t node = 0;
+    std::string rest = path;
+    while (!rest.empty()) {
+      size_t child = findChild(node, rest[0]);
+      if (child == NO_NODE) {
+        Node leaf;
+        leaf.label = rest;
+        nodes.push_back(leaf);
+        nodes[node].children.push_back(nodes.size() - 1);
+        return nodes.size() - 1;
+      }
+
+      size_t common = 0;
+      const std::string &label = nodes[child].label;
+      while (common < label.size() && common < rest.size() &&
+             label[common] == rest[common])
+        ++common;
+      if (common < label.size()) {
+        // Put a node at the divergence point, above the existing child
+        Node middle;
+        middle.label = label.substr(0, common);
+        middle.children.push_back(child);
+        nodes[child].label.erase(0, common);
+        nodes.push_back(middle);
+        size_t middle_index = nodes.size() - 1;
+        for (size_t &link : nodes[node].children) {
+          if (link == child)
+            link = middle_index;
+        }
+        child = middle_index;
+      }
+      node = child;
+      rest.erase(0, common);
+    }
+    return node;
+  }
+};
+
+#endif
@@ -14,7 +14,8 @@ if (isset($_GET['file']) && isset($_GET['arguments'])) {
 }
 
 // Handle output
-$body_text =nl2br(htmlspecialchars($argv[1] ?? ''));
+// CLI passes command output as argv[1]; FastCGI sends it as the request body
+$body_text =nl2br(htmlspecialchars($argv[1] ?? file_get_contents('php://input')));
 $selectedFile = $_GET['file'] ?? '';
 $items     = scandir($currentDir);
 $listItems = '';
@@ -0,0 +1,273 @@
+#ifndef SIMD_SCAN_HPP
+#define SIMD_SCAN_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// Byte-scanning kernels for request framing and URL decoding. On x86 the
+// widest of AVX2 and SSE2 the CPU supports is picked once at first use; the
+// AVX2 code is compiled with a target attribute, so the binary needs no
+// -mavx2 and still runs on older machines. Elsewhere the scalar versions
+// (memchr and plain loops) are used.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SCAN_X86 1
+#endif
+
+// One implementation of each primitive. Every function returns end when
+// nothing is found.
+struct ScanKernels {
+  const char *name;
+  const char *(*find_byte)(const char *p, const char *end, char c);
+  const char *(*find_either)(const char *p, const char *end, char a, char b);
+  const char *(*find_header_end)(const char *p, const char *end); // CRLFCRLF
+};
+
+static inline const char *scan_find_byte_scalar(const char *p,
+                                                const char *end, char c) {
+  const void *hit = memchr(p, c, end - p);
+  return hit != NULL ? static_cast<const char *>(hit) : end;
+}
+
+static inline const char *scan_find_either_scalar(const char *p,
+                                                  const char *end, char a,
+                                                  char b) {
+  for (; p < end; ++p) {
+    if (*p == a || *p == b)
+      return p;
+  }
+  return end;
+}
+
+static inline const char *scan_find_header_end_scalar(const char *p,
+                                                      const char *end) {
+  while (end - p >= 4) {
+    p = scan_find_byte_scalar(p, end - 3, '\r');
+    if (p == end - 3)
+      break;
+    if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+      return p;
+    ++p;
+  }
+  return end;
+}
+
+#ifdef SIMD_SCAN_X86
+__attribute__((target("sse2"))) static inline const char *
+scan_find_byte_sse2(const char *p, const char *end, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_either_scalar(p, end, c, c);
+}
+
+__attribute__((target("sse2"))) static inline const char *
+scan_find_either_sse2(const char *p, const char *end, char a, char b) {
+  const __m128i needle_a = _mm_set1_epi8(a);
+  const __m128i needle_b = _mm_set1_epi8(b);
+  for (; end - p >= 16; p += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, needle_a),
+                                _mm_cmpeq_epi8(block, needle_b));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_either_scalar(p, end, a, b);
+}
+
+// Compares four shifted loads so every lane tests a full CRLFCRLF at once
+__attribute__((target("sse2"))) static inline const char *
+scan_find_header_end_sse2(const char *p, const char *end) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  for (; end - p >= 16 + 3; p += 16) {
+    const __m128i *at = reinterpret_cast<const __m128i *>(p);
+    __m128i hits = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(at), cr),
+                      _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<
+                                         const __m128i *>(p + 1)),
+                                     lf)),
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<
+                                         const __m128i *>(p + 2)),
+                                     cr),
+                      _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<
+                                         const __m128i *>(p + 3)),
+                                     lf)));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_header_end_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static inline const char *
+scan_find_byte_avx2(const char *p, const char *end, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    unsigned mask = static_cast<unsigned>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_byte_sse2(p, end, c);
+}
+
+__attribute__((target("avx2"))) static inline const char *
+scan_find_either_avx2(const char *p, const char *end, char a, char b) {
+  const __m256i needle_a = _mm256_set1_epi8(a);
+  const __m256i needle_b = _mm256_set1_epi8(b);
+  for (; end - p >= 32; p += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, needle_a),
+                                   _mm256_cmpeq_epi8(block, needle_b));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_either_sse2(p, end, a, b);
+}
+
+__attribute__((target("avx2"))) static inline const char *
+scan_find_header_end_avx2(const char *p, const char *end) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  for (; end - p >= 32 + 3; p += 32) {
+    __m256i hits = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i *>(p)),
+                              cr),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i *>(p + 1)),
+                              lf)),
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i *>(p + 2)),
+                              cr),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(
+                                  reinterpret_cast<const __m256i *>(p + 3)),
+                              lf)));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_find_header_end_sse2(p, end);
+}
+#endif
+
+static inline const ScanKernels &scan_scalar_kernels() {
+  static const ScanKernels kernels = {"scalar", scan_find_byte_scalar,
+                                      scan_find_either_scalar,
+                                      scan_find_header_end_scalar};
+  return kernels;
+}
+
+#ifdef SIMD_SCAN_X86
+static inline const ScanKernels &scan_sse2_kernels() {
+  static const ScanKernels kernels = {"sse2", scan_find_byte_sse2,
+                                      scan_find_either_sse2,
+                                      scan_find_header_end_sse2};
+  return kernels;
+}
+
+static inline const ScanKernels &scan_avx2_kernels() {
+  static const ScanKernels kernels = {"avx2", scan_find_byte_avx2,
+                                      scan_find_either_avx2,
+                                      scan_find_header_end_avx2};
+  return kernels;
+}
+#endif
+
+// Best implementation for this CPU, chosen on first call
+static inline const ScanKernels &scan_kernels() {
+#ifdef SIMD_SCAN_X86
+  static const ScanKernels &best = __builtin_cpu_supports("avx2")
+                                       ? scan_avx2_kernels()
+                                   : __builtin_cpu_supports("sse2")
+                                       ? scan_sse2_kernels()
+                                       : scan_scalar_kernels();
+  return best;
+#else
+  return scan_scalar_kernels();
+#endif
+}
+
+static inline const char *scan_find_byte(const char *p, const char *end,
+                                         char c) {
+  return scan_kernels().find_byte(p, end, c);
+}
+
+static inline const char *scan_find_header_end(const char *p,
+                                               const char *end) {
+  return scan_kernels().find_header_end(p, end);
+}
+
+static inline int scan_hex_value(char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch - '0';
+  if (ch >= 'a' && ch <= 'f')
+    return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F')
+    return ch - 'A' + 10;
+  return -1;
+}
+
+// Decodes every %XX escape in one pass (and '+' to a space for form-encoded
+// query values). Runs with nothing to decode are found with the vector
+// kernel and copied in bulk. Malformed escapes are kept as they are. out may
+// equal in; returns the decoded length, never more than length.
+static inline size_t scan_url_decode_with(const ScanKernels &kernels,
+                                          const char *in, size_t length,
+                                          char *out, bool plus_as_space) {
+  const char *p = in;
+  const char *end = in + length;
+  char *dest = out;
+  char plus = plus_as_space ? '+' : '%';
+  while (p < end) {
+    const char *special = kernels.find_either(p, end, '%', plus);
+    size_t run = special - p;
+    if (dest != p)
+      memmove(dest, p, run);
+    dest += run;
+    p = special;
+    if (p == end)
+      break;
+    if (*p == '+') {
+      *dest++ = ' ';
+      ++p;
+      continue;
+    }
+    int high = end - p >= 3 ? scan_hex_value(p[1]) : -1;
+    int low = high != -1 ? scan_hex_value(p[2]) : -1;
+    if (low == -1) {
+      *dest++ = *p++;
+      continue;
+    }
+    *dest++ = static_cast<char>(high * 16 + low);
+    p += 3;
+  }
+  return dest - out;
+}
+
+static inline size_t scan_url_decode(const char *in, size_t length, char *out,
+                                     bool plus_as_space) {
+  return scan_url_decode_with(scan_kernels(), in, length, out, plus_as_space);
+}
+
+static inline void url_decode_in_place(std::string &value,
+                                       bool plus_as_space) {
+  if (value.empty())
+    return;
+  value.resize(scan_url_decode(&value[0], value.size(), &value[0],
+                               plus_as_space));
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define SPSC_CACHE_LINE 64
+
+// Single-producer single-consumer ring of fixed-size records, filled in
+// place. The producer claims a slot, writes it and publishes it with one
+// release store; when the ring is full the record is dropped and counted
+// instead of waiting, so a slow consumer never stalls the producer.
+// Capacity must be a power of two.
+template <typename Record, size_t Capacity> class SpscRing {
+public:
+  SpscRing() : head(0), tail(0), head_seen(0), dropped(0) {}
+
+  // Producer: slot to fill and then publish(), or NULL if the ring is full
+  Record *claim() {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    if (position - head_seen == Capacity) {
+      head_seen = head.load(std::memory_order_acquire);
+      if (position - head_seen == Capacity) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+      }
+    }
+    return &records[position & (Capacity - 1)];
+  }
+
+  void publish() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  // Consumer: oldest record, or NULL if empty
+  const Record *peek() const {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    if (position == tail.load(std::memory_order_acquire))
+      return NULL;
+    return &records[position & (Capacity - 1)];
+  }
+
+  void pop() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  uint64_t takeDropped() {
+    // Read first so the producer's cache line is only written after drops
+    if (dropped.load(std::memory_order_relaxed) == 0)
+      return 0;
+    return dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+private:
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "capacity must be a power of two");
+
+  Record records[Capacity];
+  // Padding rather than alignas, as in mpmc_queue.hpp
+  char pad0[SPSC_CACHE_LINE];
+  std::atomic<uint64_t> head; // Next record the consumer reads
+  char pad1[SPSC_CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> tail; // Next slot the producer fills
+  uint64_t head_seen; // Producer's last look at head, refreshed when full
+  std::atomic<uint64_t> dropped;
+};
+
+#endif
@@ -0,0 +1,63 @@
+// Prints a binary access log (--access-log-format binary) as text, in the
+// same common or combined format the server writes. Records are in the
+// server's byte order, so decode on a machine of the same endianness.
+//
+//   access_log_decode [--common] file...
+#include "access_log.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static bool decode(const char *path, access_format format) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  char magic[8];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, ACCESS_BINARY_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s: not a binary access log\n", path);
+    fclose(file);
+    return false;
+  }
+
+  static const size_t header_size = offsetof(AccessEntry, text);
+  AccessEntry entry;
+  char line[ACCESS_LINE_MAX];
+  bool ok = true;
+  while (fread(&entry, 1, header_size, file) == header_size) {
+    size_t text_length = entry.record_length - header_size;
+    if (entry.record_length < header_size ||
+        text_length > sizeof(entry.text) || text_length != entry.text_length ||
+        static_cast<size_t>(entry.method_length) + entry.target_length +
+                entry.version_length + entry.referer_length +
+                entry.agent_length !=
+            text_length ||
+        fread(entry.text, 1, text_length, file) != text_length) {
+      fprintf(stderr, "%s: truncated or corrupt record\n", path);
+      ok = false;
+      break;
+    }
+    fwrite(line, 1, access_format_line(entry, format, line), stdout);
+  }
+  fclose(file);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  access_format format = access_format::COMBINED;
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "--common") == 0) {
+    format = access_format::COMMON;
+    first = 2;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "usage: %s [--common] file...\n", argv[0]);
+    return 2;
+  }
+  bool ok = true;
+  for (int i = first; i < argc; ++i)
+    ok = decode(argv[i], format) && ok;
+  return ok ? 0 : 1;
+}
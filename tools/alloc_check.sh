@@ -0,0 +1,50 @@
+#!/bin/sh
+# Heap allocations per request on a hot path. The server runs twice under
+# the malloc_count shim, serving WARMUP and then WARMUP + COUNT requests for
+# the same URL over kept-alive connections; the difference between the
+# two totals, over COUNT, is what each request costs once caches and the
+# request arenas are warm. The server closes a connection every
+# KEEPALIVE_MAX_REQUESTS (100) requests, so a share of accepting the next
+# one is included: a few allocations per 100 requests. Exits non-zero if the
+# figure is above MAX.
+#
+#   tools/alloc_check.sh [server] [path] [max per request]
+set -e
+
+SERVER=${1:-./capture_server}
+URL_PATH=${2:-/style/main.css}
+MAX=${3:-0.05}
+PORT=${PORT:-18180}
+WARMUP=200
+COUNT=2000
+SHIM=$(dirname "$0")/build/libmalloc_count.so
+
+if [ ! -f "$SHIM" ]; then
+  echo "build the tools first: cmake -S tools -B tools/build && cmake --build tools/build" >&2
+  exit 2
+fi
+
+run() {
+  config=$(mktemp)
+  i=0
+  while [ "$i" -lt "$1" ]; do
+    printf 'url = "http://127.0.0.1:%s%s"\noutput = "/dev/null"\n' \
+      "$PORT" "$URL_PATH" >> "$config"
+    i=$((i + 1))
+  done
+  log=$(mktemp)
+  LD_PRELOAD=$SHIM "$SERVER" --port "$PORT" > /dev/null 2> "$log" &
+  pid=$!
+  sleep 0.5
+  curl -s -K "$config"
+  kill -TERM "$pid"
+  wait "$pid" || true
+  sed -n 's/^malloc_count: //p' "$log"
+  rm -f "$config" "$log"
+}
+
+base=$(run "$WARMUP")
+total=$(run $((WARMUP + COUNT)))
+per_request=$(awk "BEGIN { printf \"%.2f\", ($total - $base) / $COUNT }")
+echo "$URL_PATH: $per_request allocations per request ($base -> $total)"
+awk "BEGIN { exit !($per_request <= $MAX) }"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Throughput and latency of the current tree, one CSV line per scenario,
+# for comparing commits. Starts SERVER on PORT, runs load_gen against it
+# for each scenario below and appends the results, labelled with the
+# commit, to RESULTS:
+#
+#   commit,loop,connections,connection,rps,p50_us,...,max_us,errors
+#
+# Open-loop latencies are from scheduled send times; closed-loop ones are
+# corrected for coordinated omission (see tools/load_gen.cpp).
+#
+#   tools/load_check.sh [server] [results file]
+set -e
+
+SERVER=${1:-./capture_server}
+RESULTS=${2:-$(dirname "$0")/build/load_results.csv}
+PORT=${PORT:-18190}
+DURATION=${DURATION:-5}
+LOAD_GEN=$(dirname "$0")/build/load_gen
+
+if [ ! -x "$LOAD_GEN" ]; then
+  echo "build the tools first: cmake -S tools -B tools/build && cmake --build tools/build" >&2
+  exit 2
+fi
+
+[ -s "$RESULTS" ] ||
+  echo "commit,loop,connections,connection,rps,p50_us,p90_us,p99_us,p999_us,max_us,errors" > "$RESULTS"
+label=$(git describe --always --dirty 2>/dev/null || echo unknown)
+"$SERVER" --port "$PORT" > /dev/null 2>&1 &
+pid=$!
+trap 'kill -TERM $pid 2>/dev/null; wait $pid 2>/dev/null || true' EXIT
+sleep 0.5
+
+run() {
+  "$LOAD_GEN" --port "$PORT" --duration "$DURATION" --csv "$label" "$@" |
+    tee -a "$RESULTS"
+}
+
+# Cached static file: kept-alive, connection per request, and at a fixed
+# rate well below saturation
+run --connections 32 --mix static=1
+run --connections 32 --mix static=1 --no-keepalive
+run --connections 32 --mix static=1 --rate 5000
+# Static, PHP and command routes together
+run --connections 32 --mix static=8,php=1,command=1 --rate 500
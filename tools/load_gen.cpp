@@ -0,0 +1,657 @@
+// HTTP load generator for capture_server. Connections are spread over a few
+// threads, each running its own epoll loop.
+//
+// Closed loop (default): every connection sends its next request as soon as
+// the last response is in. Open loop (--rate): every connection follows a
+// fixed schedule and latency is counted from when a request was due, not
+// from when it could finally be sent, so a stalled server shows up in the
+// percentiles instead of just slowing the load down (coordinated omission).
+// Closed-loop runs report both the measured latencies and a corrected set
+// that back-fills the requests a stall held back, as HdrHistogram does,
+// taking the mean latency as the expected interval.
+//
+//   load_gen [--host A] [--port N] [--connections N] [--threads N]
+//            [--duration S] [--warmup S] [--rate R] [--no-keepalive]
+//            [--mix static=8,php=1,command=1] [--path PATH[=WEIGHT]]...
+//            [--csv LABEL]
+#include "metrics.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static uint64_t monotonic_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear latency histogram, bucketed like the server's /metrics
+struct Histogram {
+  std::vector<uint64_t> buckets;
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+
+  Histogram() : buckets(METRICS_BUCKETS), count(0), sum_ns(0), max_ns(0) {}
+
+  void record(uint64_t ns, uint64_t times = 1) {
+    buckets[latency_bucket(ns)] += times;
+    count += times;
+    sum_ns += ns * times;
+    max_ns = std::max(max_ns, ns);
+  }
+
+  void merge(const Histogram &other) {
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i)
+      buckets[i] += other.buckets[i];
+    count += other.count;
+    sum_ns += other.sum_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+  }
+
+  double mean() const { return count == 0 ? 0 : double(sum_ns) / count; }
+
+  // Midpoint of the bucket holding the value at this quantile
+  double at(double quantile) const {
+    if (count == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i) {
+      seen += buckets[i];
+      if (seen >= rank)
+        return std::min<double>(
+            (latency_bucket_floor(i) + latency_bucket_floor(i + 1)) / 2.0,
+            max_ns);
+    }
+    return max_ns;
+  }
+
+  // A sample of L with requests expected every E stood in for the ones
+  // that would have been sent during it: add L - E, L - 2E, ... down to E
+  Histogram corrected(uint64_t expected_ns) const {
+    Histogram out = *this;
+    if (expected_ns == 0)
+      return out;
+    for (size_t i = 0; i < METRICS_BUCKETS; ++i) {
+      if (buckets[i] == 0)
+        continue;
+      uint64_t value = latency_bucket_floor(i);
+      for (uint64_t missing = value - std::min(value, expected_ns);
+           missing >= expected_ns; missing -= expected_ns)
+        out.record(missing, buckets[i]);
+    }
+    return out;
+  }
+};
+
+struct Route {
+  std::string name;
+  std::string path;
+  unsigned weight;
+};
+
+struct Options {
+  std::string host;
+  int port;
+  int connections;
+  int threads;
+  double duration;
+  double warmup;
+  double rate; // Requests per second over all connections; 0 = closed loop
+  bool keep_alive;
+  std::vector<Route> routes;
+  std::string csv_label;
+};
+
+// Per-route results of one thread, merged after the run
+struct RouteStats {
+  uint64_t requests;
+  uint64_t bad_status; // Anything but 2xx and 3xx
+  uint64_t bytes;
+  Histogram service;  // Request written -> response complete
+  Histogram response; // Request due -> response complete
+
+  RouteStats() : requests(0), bad_status(0), bytes(0) {}
+
+  void merge(const RouteStats &other) {
+    requests += other.requests;
+    bad_status += other.bad_status;
+    bytes += other.bytes;
+    service.merge(other.service);
+    response.merge(other.response);
+  }
+};
+
+struct Client {
+  int fd;
+  bool busy;           // A request is in flight
+  bool connecting;     // Non-blocking connect not finished yet
+  size_t route;
+  std::string request;
+  size_t written;
+  std::string in;
+  uint64_t due_ns;     // When this request was scheduled to go out
+  uint64_t sent_ns;    // When it was written (or the connect started)
+  size_t head_length;  // 0 until the response head is in
+  int status;
+  bool chunked;
+  bool close_delimited;
+  bool server_closes;
+  size_t body_length;  // Content-Length
+  size_t chunk_scan;   // Chunked bodies: next chunk size line
+};
+
+struct Worker {
+  const Options *options;
+  int index;
+  std::vector<Client> clients;
+  std::vector<RouteStats> stats;
+  uint64_t socket_errors;
+  uint64_t warmup_end_ns;
+  uint64_t end_ns;
+  uint64_t interval_ns; // Open loop: time between a connection's requests
+  uint32_t random_state;
+  int epoll_fd;
+  struct sockaddr_in address;
+};
+
+static size_t pick_route(Worker &worker) {
+  const std::vector<Route> &routes = worker.options->routes;
+  unsigned total = 0;
+  for (const Route &route : routes)
+    total += route.weight;
+  // xorshift32; the mix only has to be right on average
+  uint32_t x = worker.random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  worker.random_state = x;
+  unsigned ticket = x % total;
+  for (size_t i = 0; i < routes.size(); ++i) {
+    if (ticket < routes[i].weight)
+      return i;
+    ticket -= routes[i].weight;
+  }
+  return 0;
+}
+
+static void watch(Worker &worker, Client &client, bool for_write, bool add) {
+  struct epoll_event ev;
+  ev.events = for_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = &client;
+  epoll_ctl(worker.epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, client.fd,
+            &ev);
+}
+
+static void disconnect(Worker &worker, Client &client) {
+  if (client.fd == -1)
+    return;
+  epoll_ctl(worker.epoll_fd, EPOLL_CTL_DEL, client.fd, NULL);
+  close(client.fd);
+  client.fd = -1;
+}
+
+static bool open_connection(Worker &worker, Client &client) {
+  client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (client.fd == -1)
+    return false;
+  int one = 1;
+  setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(client.fd, reinterpret_cast<struct sockaddr *>(&worker.address),
+              sizeof(worker.address)) == -1 &&
+      errno != EINPROGRESS) {
+    close(client.fd);
+    client.fd = -1;
+    return false;
+  }
+  client.connecting = true;
+  watch(worker, client, true, true);
+  return true;
+}
+
+static void send_some(Worker &worker, Client &client) {
+  while (client.written < client.request.size()) {
+    ssize_t n = write(client.fd, client.request.data() + client.written,
+                      client.request.size() - client.written);
+    if (n > 0) {
+      client.written += n;
+    } else if (n == -1 && errno == EINTR) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  watch(worker, client, client.written < client.request.size(), false);
+}
+
+static void start_request(Worker &worker, Client &client, uint64_t due_ns) {
+  const Options &options = *worker.options;
+  client.busy = true;
+  client.route = pick_route(worker);
+  client.request = "GET " + options.routes[client.route].path +
+                   " HTTP/1.1\r\nHost: " + options.host + "\r\n" +
+                   (options.keep_alive ? "" : "Connection: close\r\n") +
+                   "User-Agent: load_gen\r\n\r\n";
+  client.written = 0;
+  client.in.clear();
+  client.due_ns = due_ns;
+  client.sent_ns = monotonic_nanos();
+  client.head_length = 0;
+  client.chunk_scan = 0;
+  if (client.fd == -1) {
+    if (!open_connection(worker, client)) {
+      worker.socket_errors++;
+      client.busy = false;
+    }
+    return;
+  }
+  send_some(worker, client);
+}
+
+// Reads the status line and the framing headers once the head is in
+static bool parse_head(Client &client) {
+  size_t end = client.in.find("\r\n\r\n");
+  if (end == std::string::npos)
+    return false;
+  client.head_length = end + 4;
+  client.status = atoi(client.in.c_str() + client.in.find(' ') + 1);
+  client.chunked = false;
+  client.close_delimited = true;
+  client.server_closes = false;
+  client.body_length = 0;
+  for (size_t line = client.in.find("\r\n") + 2; line < end;) {
+    size_t next = client.in.find("\r\n", line);
+    std::string header = client.in.substr(line, next - line);
+    for (size_t i = 0; i < header.size() && header[i] != ':'; ++i)
+      header[i] = static_cast<char>(tolower(header[i]));
+    if (header.compare(0, 15, "content-length:") == 0) {
+      client.body_length = strtoul(header.c_str() + 15, NULL, 10);
+      client.close_delimited = false;
+    } else if (header.compare(0, 18, "transfer-encoding:") == 0 &&
+               header.find("chunked") != std::string::npos) {
+      client.chunked = true;
+      client.close_delimited = false;
+    } else if (header.compare(0, 11, "connection:") == 0 &&
+               header.find("close") != std::string::npos) {
+      client.server_closes = true;
+    }
+    line = next + 2;
+  }
+  client.chunk_scan = client.head_length;
+  return true;
+}
+
+// True once the whole body is in (close-delimited bodies end at EOF)
+static bool body_complete(Client &client) {
+  if (client.close_delimited)
+    return false;
+  if (!client.chunked)
+    return client.in.size() >= client.head_length + client.body_length;
+  for (;;) {
+    size_t line_end = client.in.find("\r\n", client.chunk_scan);
+    if (line_end == std::string::npos)
+      return false;
+    size_t size = strtoul(client.in.c_str() + client.chunk_scan, NULL, 16);
+    size_t next = line_end + 2 + size + 2;
+    if (size == 0)
+      return client.in.size() >= next; // No trailers from this server
+    if (next > client.in.size())
+      return false;
+    client.chunk_scan = next;
+  }
+}
+
+static void finish_request(Worker &worker, Client &client, uint64_t now_ns) {
+  client.busy = false;
+  if (client.sent_ns >= worker.warmup_end_ns) {
+    RouteStats &stats = worker.stats[client.route];
+    stats.requests++;
+    stats.bytes += client.in.size();
+    if (client.status < 200 || client.status >= 400)
+      stats.bad_status++;
+    stats.service.record(now_ns - client.sent_ns);
+    stats.response.record(now_ns - client.due_ns);
+  }
+  if (!worker.options->keep_alive || client.server_closes ||
+      client.close_delimited)
+    disconnect(worker, client);
+}
+
+static void fail_request(Worker &worker, Client &client) {
+  disconnect(worker, client);
+  client.busy = false;
+  if (client.sent_ns >= worker.warmup_end_ns)
+    worker.socket_errors++;
+}
+
+// Next request on this connection, now (closed loop) or when it is due
+static void schedule_next(Worker &worker, Client &client, uint64_t now_ns) {
+  if (worker.interval_ns == 0) {
+    start_request(worker, client, now_ns);
+  } else {
+    uint64_t due_ns = client.due_ns + worker.interval_ns;
+    client.due_ns = due_ns;
+    if (due_ns <= now_ns)
+      start_request(worker, client, due_ns);
+  }
+}
+
+static void on_event(Worker &worker, Client &client, uint32_t events) {
+  if (client.connecting) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      fail_request(worker, client);
+      return;
+    }
+    client.connecting = false;
+  }
+  if ((events & EPOLLOUT) && client.written < client.request.size())
+    send_some(worker, client);
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
+
+  char buffer[16384];
+  bool eof = false;
+  for (;;) {
+    ssize_t n = read(client.fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      client.in.append(buffer, n);
+    } else if (n == 0) {
+      eof = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        eof = true;
+      break;
+    }
+  }
+  if (!client.busy) {
+    // Server closed an idle kept-alive connection; reopen on next request
+    if (eof)
+      disconnect(worker, client);
+    return;
+  }
+  uint64_t now_ns = monotonic_nanos();
+  if (client.head_length == 0 && !parse_head(client)) {
+    if (eof)
+      fail_request(worker, client);
+    return;
+  }
+  if (body_complete(client) || (eof && client.close_delimited)) {
+    if (eof)
+      client.server_closes = true;
+    finish_request(worker, client, now_ns);
+    if (now_ns < worker.end_ns)
+      schedule_next(worker, client, now_ns);
+  } else if (eof) {
+    fail_request(worker, client);
+  }
+}
+
+static void run_worker(Worker *worker) {
+  const Options &options = *worker->options;
+  worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  uint64_t start_ns = monotonic_nanos();
+  worker->warmup_end_ns = start_ns + uint64_t(options.warmup * 1e9);
+  worker->end_ns = worker->warmup_end_ns + uint64_t(options.duration * 1e9);
+  for (Client &client : worker->clients)
+    client.fd = -1;
+
+  // Stagger the open-loop schedules so requests are evenly spaced overall
+  for (size_t i = 0; i < worker->clients.size(); ++i) {
+    size_t global = i * options.threads + worker->index;
+    uint64_t offset = worker->interval_ns * global / options.connections;
+    worker->clients[i].due_ns = start_ns + offset;
+    worker->clients[i].busy = false;
+    if (worker->interval_ns == 0 || offset == 0)
+      start_request(*worker, worker->clients[i], start_ns + offset);
+  }
+
+  std::vector<struct epoll_event> events(worker->clients.size() + 1);
+  for (;;) {
+    uint64_t now_ns = monotonic_nanos();
+    bool in_flight = false;
+    uint64_t next_due = worker->end_ns;
+    for (Client &client : worker->clients) {
+      if (!client.busy && now_ns < worker->end_ns) {
+        if (worker->interval_ns == 0 || client.due_ns <= now_ns)
+          start_request(*worker, client,
+                        worker->interval_ns == 0 ? now_ns : client.due_ns);
+        else
+          next_due = std::min(next_due, client.due_ns);
+      }
+      in_flight = in_flight || client.busy;
+    }
+    // Responses still in flight at the end get a second to arrive
+    if (now_ns >= worker->end_ns &&
+        (!in_flight || now_ns >= worker->end_ns + 1000000000))
+      break;
+    int timeout_ms = now_ns >= worker->end_ns
+                         ? 10
+                         : static_cast<int>((next_due - now_ns) / 1000000);
+    int n = epoll_wait(worker->epoll_fd, events.data(), events.size(),
+                       std::max(timeout_ms, 0));
+    for (int i = 0; i < n; ++i)
+      on_event(*worker, *static_cast<Client *>(events[i].data.ptr),
+               events[i].events);
+  }
+  for (Client &client : worker->clients)
+    disconnect(*worker, client);
+  close(worker->epoll_fd);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [--host A] [--port N] [--connections N] [--threads N]\n"
+          "          [--duration S] [--warmup S] [--rate R] [--no-keepalive]\n"
+          "          [--mix static=8,php=1,command=1] [--path PATH[=WEIGHT]]"
+          "...\n          [--csv LABEL]\n",
+          program);
+}
+
+static bool parse_options(int argc, char *argv[], Options &options) {
+  options.host = "127.0.0.1";
+  options.port = 8080;
+  options.connections = 16;
+  options.threads = 2;
+  options.duration = 10;
+  options.warmup = 1;
+  options.rate = 0;
+  options.keep_alive = true;
+  std::string mix = "static=1";
+  std::vector<Route> paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--no-keepalive") {
+      options.keep_alive = false;
+      continue;
+    }
+    if (i + 1 >= argc)
+      return false;
+    const char *value = argv[++i];
+    if (arg == "--host") {
+      options.host = value;
+    } else if (arg == "--port") {
+      options.port = atoi(value);
+    } else if (arg == "--connections") {
+      options.connections = atoi(value);
+    } else if (arg == "--threads") {
+      options.threads = atoi(value);
+    } else if (arg == "--duration") {
+      options.duration = atof(value);
+    } else if (arg == "--warmup") {
+      options.warmup = atof(value);
+    } else if (arg == "--rate") {
+      options.rate = atof(value);
+    } else if (arg == "--mix") {
+      mix = value;
+    } else if (arg == "--path") {
+      std::string path = value;
+      size_t equals = path.rfind('=');
+      Route route;
+      route.weight = 1;
+      if (equals != std::string::npos && path.find('?') == std::string::npos) {
+        route.weight = atoi(path.c_str() + equals + 1);
+        path.resize(equals);
+      }
+      route.name = route.path = path;
+      paths.push_back(route);
+    } else if (arg == "--csv") {
+      options.csv_label = value;
+    } else {
+      return false;
+    }
+  }
+
+  // Routes the server treats differently: cached static files, PHP through
+  // FastCGI, and a spawned command
+  static const Route known[] = {
+      {"static", "/style/main.css", 0},
+      {"php", "/index.php", 0},
+      {"command", "/?raw_command=ascii_art&arguments=hi", 0},
+  };
+  for (size_t start = 0; start < mix.size();) {
+    size_t end = std::min(mix.find(',', start), mix.size());
+    std::string item = mix.substr(start, end - start);
+    size_t equals = item.find('=');
+    std::string name = item.substr(0, equals);
+    unsigned weight =
+        equals == std::string::npos ? 1 : atoi(item.c_str() + equals + 1);
+    bool found = false;
+    for (const Route &route : known) {
+      if (route.name == name) {
+        found = true;
+        if (weight > 0)
+          options.routes.push_back(Route{route.name, route.path, weight});
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "unknown route class '%s'\n", name.c_str());
+      return false;
+    }
+    start = end + 1;
+  }
+  if (!paths.empty())
+    options.routes = paths;
+  return !options.routes.empty() && options.connections > 0 &&
+         options.threads > 0 && options.duration > 0;
+}
+
+static void print_latency(const char *label, const Histogram &histogram) {
+  printf("  %-22s %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", label,
+         histogram.mean() / 1e3, histogram.at(0.5) / 1e3,
+         histogram.at(0.9) / 1e3, histogram.at(0.99) / 1e3,
+         histogram.at(0.999) / 1e3, histogram.max_ns / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    usage(argv[0]);
+    return 2;
+  }
+  options.threads = std::min(options.threads, options.connections);
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.port);
+  if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+    fprintf(stderr, "--host must be an IPv4 address\n");
+    return 2;
+  }
+
+  std::vector<Worker> workers(options.threads);
+  for (int t = 0; t < options.threads; ++t) {
+    Worker &worker = workers[t];
+    worker.options = &options;
+    worker.index = t;
+    worker.clients.resize(options.connections / options.threads +
+                          (t < options.connections % options.threads));
+    worker.stats.resize(options.routes.size());
+    worker.socket_errors = 0;
+    worker.interval_ns =
+        options.rate > 0 ? uint64_t(options.connections / options.rate * 1e9)
+                         : 0;
+    worker.random_state = 2463534242u + t * 7919;
+    worker.address = address;
+  }
+  std::vector<std::thread> threads;
+  for (Worker &worker : workers)
+    threads.push_back(std::thread(run_worker, &worker));
+  for (std::thread &thread : threads)
+    thread.join();
+
+  std::vector<RouteStats> routes(options.routes.size());
+  RouteStats total;
+  uint64_t socket_errors = 0;
+  for (Worker &worker : workers) {
+    for (size_t i = 0; i < routes.size(); ++i) {
+      routes[i].merge(worker.stats[i]);
+      total.merge(worker.stats[i]);
+    }
+    socket_errors += worker.socket_errors;
+  }
+  // Closed loop: the response histogram equals the service one; correct it
+  // for the requests a slow response kept from being sent
+  Histogram response =
+      options.rate > 0 ? total.response
+                       : total.service.corrected(uint64_t(total.service.mean()));
+  double rps = total.requests / options.duration;
+
+  if (!options.csv_label.empty()) {
+    printf("%s,%s,%d,%s,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%llu\n",
+           options.csv_label.c_str(), options.rate > 0 ? "open" : "closed",
+           options.connections, options.keep_alive ? "keepalive" : "close",
+           rps, response.at(0.5) / 1e3, response.at(0.9) / 1e3,
+           response.at(0.99) / 1e3, response.at(0.999) / 1e3,
+           response.max_ns / 1e3,
+           static_cast<unsigned long long>(total.bad_status + socket_errors));
+    return 0;
+  }
+
+  if (options.rate > 0)
+    printf("open loop at %.0f req/s", options.rate);
+  else
+    printf("closed loop");
+  printf(", %d connections on %d threads, %s, %gs after %gs warmup\n",
+         options.connections, options.threads,
+         options.keep_alive ? "keep-alive" : "connection per request",
+         options.duration, options.warmup);
+  printf("  requests   %llu (%.1f/s, %.2f MB/s)\n",
+         static_cast<unsigned long long>(total.requests), rps,
+         total.bytes / options.duration / 1e6);
+  printf("  errors     %llu bad status, %llu socket\n",
+         static_cast<unsigned long long>(total.bad_status),
+         static_cast<unsigned long long>(socket_errors));
+  printf("  latency (us)              mean       p50       p90       p99"
+         "     p99.9       max\n");
+  for (size_t i = 0; i < routes.size(); ++i) {
+    if (routes.size() > 1 && routes[i].requests > 0)
+      print_latency(options.routes[i].name.c_str(),
+                    options.rate > 0 ? routes[i].response : routes[i].service);
+  }
+  print_latency("service time", total.service);
+  print_latency(options.rate > 0 ? "from scheduled send" : "corrected",
+                response);
+  return total.requests > 0 ? 0 : 1;
+}
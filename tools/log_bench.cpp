@@ -0,0 +1,83 @@
+// Cost of one log line from each of several threads at once: the old
+// ConnectionContext::log (an iostream with std::endl, so a lock and a
+// write() per line) against the async logger's per-thread rings, with its
+// writer thread draining into /dev/null. Lines go out in bursts of a
+// quarter ring with a pause between them, which is how a worker logs (a
+// handful of lines per request); only the bursts are timed. Drops are
+// reported, since a dropped line costs the producer almost nothing.
+//
+//   log_bench [threads] [lines per thread]
+#include "logger.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const long kBurst = LOG_RING_CAPACITY / 4;
+
+// Mean over threads of the time each spent inside its bursts, per line
+template <typename Fn>
+static double nanos_per_line(int threads, long lines, Fn fn) {
+  std::vector<std::thread> workers;
+  std::vector<double> busy(threads, 0);
+  for (int t = 0; t < threads; ++t)
+    workers.push_back(std::thread([=, &busy] {
+      for (long i = 0; i < lines;) {
+        long burst_end = std::min(lines, i + kBurst);
+        auto start = std::chrono::steady_clock::now();
+        for (; i < burst_end; ++i)
+          fn(t, i);
+        busy[t] += std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }));
+  double total = 0;
+  for (int t = 0; t < threads; ++t) {
+    workers[t].join();
+    total += busy[t];
+  }
+  return total / threads / lines;
+}
+
+int main(int argc, char *argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  long lines = argc > 2 ? atol(argv[2]) : 50000;
+  const char *path = "/style/web/fonts/hack-regular.woff2";
+  printf("%d threads, %ld lines each (ns/line, per thread)\n", threads, lines);
+
+  std::ofstream sink("/dev/null");
+  std::mutex stream_mutex; // std::cout's own lock, made explicit
+  printf("  iostream + endl     %8.1f\n",
+         nanos_per_line(threads, lines, [&](int t, long i) {
+           std::lock_guard<std::mutex> hold(stream_mutex);
+           sink << "[#" << i << "] " << " T:" << t << " "
+                << "TRACE" << ": " << "recv GET " << path << std::endl;
+         }));
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  AsyncLogger logger;
+  std::vector<LogRing *> rings;
+  for (int t = 0; t < threads; ++t)
+    rings.push_back(logger.openRing());
+  logger.start(null_fd);
+  printf("  ring, copied text   %8.1f\n",
+         nanos_per_line(threads, lines, [&](int t, long i) {
+           rings[t]->write(log_level::TRACE, NULL, i, t,
+                           "handleFileRequest:begin");
+         }));
+  printf("  ring, snprintf      %8.1f\n",
+         nanos_per_line(threads, lines, [&](int t, long i) {
+           rings[t]->writef(log_level::TRACE, NULL, i, t, "recv GET %s", path);
+         }));
+  logger.stop();
+  printf("  dropped by rings    %8llu of %ld\n",
+         static_cast<unsigned long long>(logger.droppedRecords()),
+         2 * threads * lines);
+  return 0;
+}
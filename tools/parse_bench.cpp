@@ -0,0 +1,141 @@
+// Per-request cost of turning a buffered request head into a routed path,
+// before and after the parser rework. "before" is the old readRequest and
+// parseRequest front half: copy the head out, two istringstreams, lowercased
+// header copies, and a std::regex built and applied for "../". "after" is
+// HttpParser, normalize_path, QueryParams and a Router lookup. Path
+// sanitization alone is timed separately.
+//
+//   parse_bench [iterations]
+#include "router.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <regex>
+#include <sstream>
+#include <string>
+
+template <typename Fn> static double nanos_per_call(long iterations, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i)
+    fn();
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         iterations;
+}
+
+static volatile size_t g_sink; // Keeps results alive past the optimizer
+
+static const std::string kHead =
+    "GET /style/web/../web/fonts//hack-regular.woff2?v=3.003 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:8080/style/web/hack.css\r\n\r\n";
+
+static size_t parse_before(const std::string &buffer) {
+  size_t end = buffer.find("\r\n\r\n");
+  std::string raw = buffer.substr(0, end + 4);
+
+  std::istringstream request_stream(raw);
+  std::string request_line;
+  std::getline(request_stream, request_line);
+  std::istringstream request_line_stream(request_line);
+  std::string method, path, version;
+  request_line_stream >> method >> path >> version;
+
+  bool keep_alive = false;
+  std::string header_line;
+  while (std::getline(request_stream, header_line) && header_line != "\r") {
+    size_t colon = header_line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = header_line.substr(0, colon);
+    std::string value = header_line.substr(colon + 1);
+    for (char &ch : name)
+      ch = std::tolower(static_cast<unsigned char>(ch));
+    for (char &ch : value)
+      ch = std::tolower(static_cast<unsigned char>(ch));
+    if (name == "connection")
+      keep_alive = value.find("keep-alive") != std::string::npos;
+  }
+
+  std::regex dotdot_regex("\\.\\./");
+  path = std::regex_replace(path, dotdot_regex, "");
+  if (!path.empty() && path[0] == '/')
+    path = path.substr(1);
+  size_t qmark = path.find("?");
+  if (qmark != std::string::npos)
+    path = path.substr(0, qmark);
+  path = "./serving_files/" + path;
+  return path.size() + keep_alive;
+}
+
+static int route_static(StrView path) { return static_cast<int>(path.size); }
+static int route_viewer(StrView path) { return -static_cast<int>(path.size); }
+
+static size_t parse_after(std::string &buffer, HttpParser &parser,
+                          const Router<int (*)(StrView)> &routes) {
+  parser.reset();
+  if (parser.parse(buffer.data(), buffer.size()) != http_parse::COMPLETE)
+    abort();
+  bool keep_alive = parser.header("connection").icontains("keep-alive");
+
+  // normalize_path rewrites the target in place inside the receive buffer
+  StrView target = parser.target();
+  char *path = &buffer[target.data - buffer.data()];
+  const char *qmark =
+      static_cast<const char *>(memchr(target.data, '?', target.size));
+  size_t path_length = qmark != NULL ? qmark - target.data : target.size;
+  QueryParams query;
+  if (qmark != NULL)
+    query.parse(StrView(qmark + 1, target.data + target.size - qmark - 1));
+  if (!normalize_path(path, path_length))
+    abort();
+  int (*route)(StrView) = NULL;
+  if (!routes.match(StrView(path, path_length), route))
+    abort();
+  return route(StrView(path, path_length)) + query.size() + keep_alive;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+
+  std::string target = "/style/web/../web/fonts//hack-regular.woff2";
+  printf("sanitizing %s (ns/request)\n", target.c_str());
+  printf("  std::regex \"../\"    %8.1f\n", nanos_per_call(iterations, [&] {
+           std::regex dotdot_regex("\\.\\./");
+           g_sink = std::regex_replace(target, dotdot_regex, "").size();
+         }));
+  std::string work = target;
+  printf("  normalize_path      %8.1f\n", nanos_per_call(iterations, [&] {
+           memcpy(&work[0], target.data(), target.size());
+           size_t length = target.size();
+           g_sink = normalize_path(&work[0], length) ? length : 0;
+         }));
+
+  Router<int (*)(StrView)> routes;
+  routes.exact("/", route_static);
+  routes.exact("/browse_files.php", route_viewer);
+  routes.exact("/code_view.php", route_viewer);
+  routes.prefix("/", route_static);
+  HttpParser parser;
+  std::string buffer = kHead;
+
+  printf("\nparsing a %zu byte head up to the route (ns/request)\n",
+         kHead.size());
+  printf("  before              %8.1f\n", nanos_per_call(iterations, [&] {
+           g_sink = parse_before(kHead);
+         }));
+  printf("  after               %8.1f\n", nanos_per_call(iterations, [&] {
+           memcpy(&buffer[0], kHead.data(), kHead.size());
+           g_sink = parse_after(buffer, parser, routes);
+         }));
+  return 0;
+}
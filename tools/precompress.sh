@@ -0,0 +1,105 @@
+#!/bin/sh
+# Writes .br, .zst and .gz sidecars next to the compressible static files
+# under DIR (serving_files by default), which the server then sends to
+# clients that accept them. Uses whichever of brotli, zstd and gzip are
+# installed, at their highest levels. Only sidecars missing or older than
+# their file are rebuilt, and one that saves less than a tenth of the file
+# is removed instead of kept.
+#
+#   tools/precompress.sh [--clean] [dir]
+#
+# --clean deletes the sidecars instead, leaving compressed files that have
+# no uncompressed file beside them. Also available as the precompress
+# target of the tools build.
+set -e
+
+clean=false
+if [ "$1" = "--clean" ]; then
+  clean=true
+  shift
+fi
+DIR=${1:-$(dirname "$0")/../serving_files}
+MIN_SIZE=${MIN_SIZE:-256} # Bytes; smaller files gain nothing
+
+files() {
+  find "$DIR" -type f -size +"$((MIN_SIZE - 1))"c \( -name '*.html' \
+    -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.mjs' \
+    -o -name '*.json' -o -name '*.map' -o -name '*.svg' -o -name '*.xml' \
+    -o -name '*.txt' -o -name '*.md' -o -name '*.csv' -o -name '*.wasm' \
+    -o -name '*.ttf' -o -name '*.otf' -o -name '*.ico' \)
+}
+
+# Only X.br, X.zst and X.gz next to an X are sidecars; any other
+# compressed file is content. .gitignore cannot tell the two apart, so in
+# a git checkout each sidecar is excluded by its exact path through the
+# clone's info/exclude, and dropped from it again when deleted.
+TOP=$(git -C "$DIR" rev-parse --show-toplevel 2>/dev/null || true)
+EXCLUDE=
+if [ -n "$TOP" ]; then
+  EXCLUDE=$(git -C "$DIR" rev-parse --absolute-git-dir)/info/exclude
+  mkdir -p "$(dirname "$EXCLUDE")"
+  touch "$EXCLUDE"
+fi
+
+# exclude_pattern FILE: FILE anchored at the repository root, with the
+# characters gitignore treats as wildcards escaped
+exclude_pattern() {
+  path="$(cd "$(dirname "$1")" && pwd -P)/$(basename "$1")"
+  printf '/%s\n' "${path#"$TOP"/}" | sed 's/[][*?\\]/\\&/g'
+}
+
+exclude_add() {
+  [ -n "$EXCLUDE" ] || return 0
+  pattern=$(exclude_pattern "$1")
+  grep -qxF "$pattern" "$EXCLUDE" || echo "$pattern" >> "$EXCLUDE"
+}
+
+exclude_remove() {
+  [ -n "$EXCLUDE" ] || return 0
+  pattern=$(exclude_pattern "$1")
+  grep -vxF "$pattern" "$EXCLUDE" > "$EXCLUDE.tmp" || true
+  mv "$EXCLUDE.tmp" "$EXCLUDE"
+}
+
+if $clean; then
+  find "$DIR" -type f \( -name '*.br' -o -name '*.zst' -o -name '*.gz' \) |
+    while IFS= read -r sidecar; do
+      [ -f "${sidecar%.*}" ] || continue
+      echo "$sidecar"
+      exclude_remove "$sidecar"
+      rm -f "$sidecar"
+    done
+  exit 0
+fi
+
+# compress SUFFIX TOOL ARGS...: TOOL reads stdin and writes stdout
+compress() {
+  suffix=$1
+  shift
+  command -v "$1" > /dev/null 2>&1 || {
+    echo "$1 not found; skipping $suffix" >&2
+    return 0
+  }
+  files | while IFS= read -r file; do
+    sidecar=$file$suffix
+    if [ -f "$sidecar" ] && [ ! "$file" -nt "$sidecar" ]; then
+      exclude_add "$sidecar"
+      continue
+    fi
+    "$@" < "$file" > "$sidecar.tmp"
+    size=$(wc -c < "$file")
+    packed=$(wc -c < "$sidecar.tmp")
+    if [ $((packed * 10)) -lt $((size * 9)) ]; then
+      mv "$sidecar.tmp" "$sidecar"
+      exclude_add "$sidecar"
+      echo "$sidecar: $size -> $packed"
+    else
+      [ -f "$sidecar" ] && exclude_remove "$sidecar"
+      rm -f "$sidecar.tmp" "$sidecar"
+    fi
+  done
+}
+
+compress .br brotli -q 11 -c
+compress .zst zstd -19 -q -c
+compress .gz gzip -9 -n -c
@@ -0,0 +1,187 @@
+// Compares the thread pool's lock-free MpmcQueue against the mutex/condvar
+// std::queue it replaced. P producers push N items each, C consumers pop
+// until all have arrived, and we report throughput in items per second.
+// Then checks the scheduler's work-stealing deque: its owner pushes N tasks
+// in bursts past DEQUE_INITIAL_CAPACITY (so the array grows) and takes some
+// back while C thieves steal; every task must run exactly once.
+//
+//   queue_bench [producers] [consumers] [items per producer]
+#include "mpmc_queue.hpp"
+#include "work_scheduler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// The original ThreadPool queue: one mutex, one condvar, a signal per item
+class MutexQueue {
+public:
+  MutexQueue() : closed(false) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+  }
+
+  ~MutexQueue() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  void push(long item) {
+    pthread_mutex_lock(&mutex);
+    items.push(item);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  bool pop(long &item) {
+    pthread_mutex_lock(&mutex);
+    while (items.empty() && !closed)
+      pthread_cond_wait(&cond, &mutex);
+    if (items.empty()) {
+      pthread_mutex_unlock(&mutex);
+      return false;
+    }
+    item = items.front();
+    items.pop();
+    pthread_mutex_unlock(&mutex);
+    return true;
+  }
+
+  void close() {
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::queue<long> items;
+  bool closed;
+};
+
+template <typename Queue>
+static double run(Queue &queue, int producers, int consumers, long per_producer) {
+  std::vector<std::thread> threads;
+  std::vector<long> sums(consumers, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int c = 0; c < consumers; ++c) {
+    threads.emplace_back([&queue, &sums, c] {
+      long item;
+      while (queue.pop(item))
+        sums[c] += item;
+    });
+  }
+  std::vector<std::thread> pushers;
+  for (int p = 0; p < producers; ++p) {
+    pushers.emplace_back([&queue, per_producer] {
+      for (long i = 1; i <= per_producer; ++i)
+        queue.push(i);
+    });
+  }
+  for (std::thread &thread : pushers)
+    thread.join();
+  queue.close();
+  for (std::thread &thread : threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  // Every item must come out exactly once
+  long total = 0;
+  for (long sum : sums)
+    total += sum;
+  long expected = producers * (per_producer * (per_producer + 1) / 2);
+  if (total != expected) {
+    fprintf(stderr, "checksum mismatch: %ld != %ld\n", total, expected);
+    exit(1);
+  }
+  return producers * per_producer / seconds;
+}
+
+static void count_run(void *arg, void *runs) {
+  static_cast<std::atomic<int> *>(runs)[reinterpret_cast<long>(arg)]
+      .fetch_add(1, std::memory_order_relaxed);
+}
+
+static void check_deque(int thieves, long tasks) {
+  const long burst = DEQUE_INITIAL_CAPACITY * 12 + 7;
+  WorkDeque deque;
+  std::vector<std::atomic<int>> runs(tasks);
+  std::atomic<bool> owner_done(false);
+  std::vector<long> stolen(thieves, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thieves; ++t) {
+    threads.emplace_back([&deque, &runs, &owner_done, &stolen, t] {
+      Task task;
+      while (!owner_done.load(std::memory_order_acquire) || deque.size() > 0) {
+        if (deque.steal(task)) {
+          task.fn(task.arg, runs.data());
+          stolen[t]++;
+        }
+      }
+    });
+  }
+  // Owner: a burst in, two thirds of it back out, so the deque both grows
+  // and keeps a backlog for the thieves; then drain what is left
+  Task task;
+  for (long next = 0; next < tasks;) {
+    long end = std::min(tasks, next + burst);
+    for (; next < end; ++next)
+      deque.push(Task{count_run, reinterpret_cast<void *>(next)});
+    for (long i = 0; i < burst * 2 / 3 && deque.take(task); ++i)
+      task.fn(task.arg, runs.data());
+  }
+  while (deque.take(task))
+    task.fn(task.arg, runs.data());
+  owner_done.store(true, std::memory_order_release);
+  for (std::thread &thread : threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  long total_stolen = 0;
+  for (long count : stolen)
+    total_stolen += count;
+  for (long i = 0; i < tasks; ++i) {
+    int count = runs[i].load(std::memory_order_relaxed);
+    if (count != 1) {
+      fprintf(stderr, "deque: task %ld ran %d times\n", i, count);
+      exit(1);
+    }
+  }
+  printf("  work-stealing deque, %d thieves: %6.2f M tasks/s, %ld stolen, "
+         "each ran once\n",
+         thieves, tasks / seconds / 1e6, total_stolen);
+}
+
+int main(int argc, char *argv[]) {
+  int producers = argc > 1 ? atoi(argv[1]) : 1;
+  int consumers = argc > 2 ? atoi(argv[2]) : 4;
+  long per_producer = argc > 3 ? atol(argv[3]) : 1000000;
+
+  printf("%d producer(s), %d consumer(s), %ld items each\n", producers,
+         consumers, per_producer);
+  for (int round = 0; round < 3; ++round) {
+    MutexQueue mutex_queue;
+    double mutex_rate = run(mutex_queue, producers, consumers, per_producer);
+    MpmcQueue<long> ring(1024);
+    double ring_rate = run(ring, producers, consumers, per_producer);
+    printf("  mutex+condvar: %6.2f M items/s   mpmc ring: %6.2f M items/s\n",
+           mutex_rate / 1e6, ring_rate / 1e6);
+  }
+  for (int round = 0; round < 3; ++round)
+    check_deque(consumers, per_producer);
+  return 0;
+}
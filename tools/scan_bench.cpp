@@ -0,0 +1,164 @@
+// Compares the simd_scan.hpp kernels against the std::string code they
+// replaced: finding the "\r\n\r\n" header terminator (once over a large
+// buffer, and again after every read of a head trickling in the way the old
+// readRequest did) and decoding a query value, where the old code only
+// rewrote %2F with a find/replace loop. Every kernel is first checked
+// against the scalar one on random input.
+//
+//   scan_bench [iterations]
+#include "simd_scan.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static std::vector<const ScanKernels *> available_kernels() {
+  std::vector<const ScanKernels *> kernels;
+  kernels.push_back(&scan_scalar_kernels());
+#ifdef SIMD_SCAN_X86
+  if (__builtin_cpu_supports("sse2"))
+    kernels.push_back(&scan_sse2_kernels());
+  if (__builtin_cpu_supports("avx2"))
+    kernels.push_back(&scan_avx2_kernels());
+#endif
+  return kernels;
+}
+
+template <typename Fn> static double nanos_per_call(long iterations, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i)
+    fn();
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         iterations;
+}
+
+static volatile size_t g_sink; // Keeps results alive past the optimizer
+
+static void check_kernels(const std::vector<const ScanKernels *> &kernels) {
+  const ScanKernels &reference = scan_scalar_kernels();
+  const char alphabet[] = "\r\n%+aB2F ";
+  srand(1);
+  for (int round = 0; round < 20000; ++round) {
+    std::string input(rand() % 100, ' ');
+    for (char &ch : input)
+      ch = alphabet[rand() % (sizeof(alphabet) - 1)];
+    const char *begin = input.data();
+    const char *end = begin + input.size();
+    std::string expected(input.size(), '\0');
+    expected.resize(scan_url_decode_with(reference, begin, input.size(),
+                                         &expected[0], true));
+    for (const ScanKernels *kernels_under_test : kernels) {
+      const ScanKernels &k = *kernels_under_test;
+      std::string decoded(input.size(), '\0');
+      decoded.resize(
+          scan_url_decode_with(k, begin, input.size(), &decoded[0], true));
+      if (k.find_byte(begin, end, '\n') != reference.find_byte(begin, end,
+                                                               '\n') ||
+          k.find_either(begin, end, '%', '+') !=
+              reference.find_either(begin, end, '%', '+') ||
+          k.find_header_end(begin, end) !=
+              reference.find_header_end(begin, end) ||
+          decoded != expected) {
+        fprintf(stderr, "%s disagrees with scalar on input %d\n", k.name,
+                round);
+        exit(1);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 20000;
+  std::vector<const ScanKernels *> kernels = available_kernels();
+  check_kernels(kernels);
+  printf("kernels agree; dispatch picks %s\n", scan_kernels().name);
+
+  // A 64KB head (the largest accepted) with the terminator at the very end
+  std::string big;
+  while (big.size() < 64 * 1024 - 4)
+    big += "X-Filler: abcdefghijklmnopqrstuvwxyz0123456789\r\n";
+  big += "\r\n\r\n";
+  printf("\nheader terminator in a %zu byte head (ns/search)\n", big.size());
+  printf("  std::string::find  %10.1f\n", nanos_per_call(iterations, [&] {
+           g_sink = big.find("\r\n\r\n");
+         }));
+  for (const ScanKernels *k : kernels) {
+    printf("  %-18s %10.1f\n", k->name, nanos_per_call(iterations, [&] {
+             g_sink = k->find_header_end(big.data(), big.data() + big.size()) -
+                      big.data();
+           }));
+  }
+
+  // A typical browser head arriving 64 bytes per read. The old readRequest
+  // searched the whole buffer after every read.
+  std::string head = "GET /browse_files.php?dir=style%2Fweb HTTP/1.1\r\n"
+                     "Host: localhost:8080\r\n"
+                     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+                     "Gecko/20100101 Firefox/128.0\r\n"
+                     "Accept: text/html,application/xhtml+xml,application/"
+                     "xml;q=0.9,*/*;q=0.8\r\n"
+                     "Accept-Language: en-US,en;q=0.5\r\n"
+                     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+                     "Connection: keep-alive\r\n"
+                     "Upgrade-Insecure-Requests: 1\r\n\r\n";
+  const size_t read_size = 64;
+  printf("\n%zu byte head in %zu byte reads (ns/request)\n", head.size(),
+         read_size);
+  std::string buffer;
+  buffer.reserve(head.size());
+  printf("  rescan per read    %10.1f\n", nanos_per_call(iterations, [&] {
+           buffer.clear();
+           size_t found = std::string::npos;
+           for (size_t at = 0; found == std::string::npos; at += read_size) {
+             buffer.append(head, at, read_size);
+             found = buffer.find("\r\n\r\n");
+           }
+           g_sink = found;
+         }));
+  for (const ScanKernels *k : kernels) {
+    printf("  %-18s %10.1f\n", k->name, nanos_per_call(iterations, [&] {
+             // Resume three bytes back so a straddling terminator is seen
+             buffer.clear();
+             size_t resume = 0;
+             const char *found = NULL;
+             for (size_t at = 0; found == NULL; at += read_size) {
+               buffer.append(head, at, read_size);
+               const char *end = buffer.data() + buffer.size();
+               const char *hit =
+                   k->find_header_end(buffer.data() + resume, end);
+               if (hit != end)
+                 found = hit;
+               resume = buffer.size() < 3 ? 0 : buffer.size() - 3;
+             }
+             g_sink = found - buffer.data();
+           }));
+  }
+
+  std::string query = "dir=serving_files%2Fstyle%2Fweb%2Ffonts%2Fsubset&file="
+                      "serving_files%2Fstyle%2Fweb%2Ffonts%2Fhack-regular."
+                      "woff2+%28copy%29";
+  printf("\npercent-decoding a %zu byte query (ns/decode)\n", query.size());
+  std::string work;
+  work.reserve(query.size());
+  printf("  %%2F find/replace   %10.1f\n", nanos_per_call(iterations, [&] {
+           work = query;
+           size_t pos = 0;
+           while ((pos = work.find("%2F", pos)) != std::string::npos) {
+             work.replace(pos, 3, "/");
+             pos += 1;
+           }
+           g_sink = work.size();
+         }));
+  for (const ScanKernels *k : kernels) {
+    printf("  %-18s %10.1f\n", k->name, nanos_per_call(iterations, [&] {
+             work = query;
+             work.resize(scan_url_decode_with(*k, &work[0], work.size(),
+                                              &work[0], true));
+             g_sink = work.size();
+           }));
+  }
+  return 0;
+}
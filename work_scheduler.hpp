@@ -0,0 +1,287 @@
+#ifndef WORK_SCHEDULER_HPP
+#define WORK_SCHEDULER_HPP
+
+#include "mpmc_queue.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <vector>
+
+#define DEQUE_INITIAL_CAPACITY 256 // Per-worker deque, grows on demand
+#define INBOX_CAPACITY 256         // Per-worker queue for outside submissions
+
+// A unit of work. worker_state is the pointer registered for the worker that
+// runs it (e.g. that thread's ConnectionContext).
+struct Task {
+  void (*fn)(void *arg, void *worker_state);
+  void *arg;
+};
+
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owner pushes and takes at the
+// bottom without contention; thieves steal from the top with one CAS.
+// Outgrown arrays are kept until destruction since a thief may still be
+// reading one.
+class WorkDeque {
+public:
+  WorkDeque() : top(0), bottom(0) {
+    array.store(new Array(DEQUE_INITIAL_CAPACITY), std::memory_order_relaxed);
+  }
+
+  ~WorkDeque() {
+    delete array.load(std::memory_order_relaxed);
+    for (Array *old : retired)
+      delete old;
+  }
+
+  // Owner only
+  void push(const Task &task) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+    if (b - t > (int64_t)a->mask) {
+      a = grow(a, t, b);
+    }
+    a->put(b, task);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only; newest first for cache locality
+  bool take(Task &task) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    task = a->get(b);
+    if (t == b) {
+      // Last item: race any thief for it
+      bool won = top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread; oldest first
+  bool steal(Task &task) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return false;
+    Array *a = array.load(std::memory_order_acquire);
+    task = a->get(t);
+    // Losing the race means another thread got it; the caller moves on
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed);
+  }
+
+  // Approximate; for monitoring only
+  size_t size() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b > t ? static_cast<size_t>(b - t) : 0;
+  }
+
+private:
+  struct Array {
+    size_t mask;
+    // Split so a racing (and then discarded) read is still race-free
+    std::atomic<void (*)(void *, void *)> *fns;
+    std::atomic<void *> *args;
+
+    explicit Array(size_t capacity)
+        : mask(capacity - 1),
+          fns(new std::atomic<void (*)(void *, void *)>[capacity]),
+          args(new std::atomic<void *>[capacity]) {}
+    ~Array() {
+      delete[] fns;
+      delete[] args;
+    }
+
+    void put(int64_t index, const Task &task) {
+      fns[index & mask].store(task.fn, std::memory_order_relaxed);
+      args[index & mask].store(task.arg, std::memory_order_relaxed);
+    }
+    Task get(int64_t index) const {
+      Task task;
+      task.fn = fns[index & mask].load(std::memory_order_relaxed);
+      task.arg = args[index & mask].load(std::memory_order_relaxed);
+      return task;
+    }
+  };
+
+  std::atomic<int64_t> top; // Thieves
+  char pad[MPMC_CACHE_LINE - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> bottom; // Owner
+  std::atomic<Array *> array;
+  std::vector<Array *> retired; // Owner only
+
+  Array *grow(Array *old, int64_t t, int64_t b) {
+    Array *bigger = new Array((old->mask + 1) * 2);
+    for (int64_t i = t; i < b; ++i)
+      bigger->put(i, old->get(i));
+    retired.push_back(old);
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+};
+
+// Work-stealing scheduler. Every worker owns a WorkDeque for tasks it spawns
+// itself and an MpmcQueue inbox that outside threads (the event loop) fill
+// round-robin. A worker runs its own deque first, then its inbox, then
+// steals from the others, and parks only when it finds nothing anywhere.
+class WorkScheduler {
+public:
+  WorkScheduler() : stopping(false), parked(0), next_inbox(0) {
+    pthread_mutex_init(&park_mutex, NULL);
+    pthread_cond_init(&park_cond, NULL);
+  }
+
+  ~WorkScheduler() {
+    stop();
+    for (Worker *worker : workers)
+      delete worker;
+    pthread_cond_destroy(&park_cond);
+    pthread_mutex_destroy(&park_mutex);
+  }
+
+  // One worker thread per entry; each task receives its worker's state
+  void start(const std::vector<void *> &worker_states) {
+    for (size_t i = 0; i < worker_states.size(); ++i) {
+      Worker *worker = new Worker;
+      worker->scheduler = this;
+      worker->index = i;
+      worker->state = worker_states[i];
+      workers.push_back(worker);
+    }
+    for (Worker *worker : workers)
+      pthread_create(&worker->thread, NULL, worker_thread, worker);
+  }
+
+  // Finishes all queued tasks and joins the workers
+  void stop() {
+    pthread_mutex_lock(&park_mutex);
+    bool was_running = !stopping && !workers.empty();
+    stopping = true;
+    pthread_cond_broadcast(&park_cond);
+    pthread_mutex_unlock(&park_mutex);
+    if (!was_running)
+      return;
+    for (Worker *worker : workers)
+      pthread_join(worker->thread, NULL);
+  }
+
+  // From a worker: onto its own deque. From anywhere else: round-robin
+  // into the inboxes.
+  void submit(const Task &task) {
+    Worker *self = current();
+    if (self != nullptr && self->scheduler == this) {
+      self->deque.push(task);
+    } else {
+      size_t first = next_inbox.fetch_add(1, std::memory_order_relaxed);
+      bool queued = false;
+      for (size_t i = 0; i < workers.size() && !queued; ++i)
+        queued = workers[(first + i) % workers.size()]->inbox.tryPush(task);
+      if (!queued)
+        workers[first % workers.size()]->inbox.push(task);
+    }
+    // Pairs with the fence in park()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed) > 0) {
+      pthread_mutex_lock(&park_mutex);
+      pthread_cond_signal(&park_cond);
+      pthread_mutex_unlock(&park_mutex);
+    }
+  }
+
+  // Tasks waiting in inboxes and deques; approximate, for monitoring
+  size_t queued() const {
+    size_t total = 0;
+    for (Worker *worker : workers)
+      total += worker->inbox.size() + worker->deque.size();
+    return total;
+  }
+
+private:
+  struct Worker {
+    WorkScheduler *scheduler;
+    size_t index;
+    void *state;
+    pthread_t thread;
+    WorkDeque deque;
+    MpmcQueue<Task> inbox;
+
+    Worker() : inbox(INBOX_CAPACITY) {}
+  };
+
+  std::vector<Worker *> workers;
+  pthread_mutex_t park_mutex;
+  pthread_cond_t park_cond;
+  bool stopping;
+  std::atomic<unsigned> parked;
+  std::atomic<size_t> next_inbox;
+
+  static Worker *&current() {
+    static thread_local Worker *worker = nullptr;
+    return worker;
+  }
+
+  bool findWork(Worker *self, Task &task) {
+    if (self->deque.take(task) || self->inbox.tryPop(task))
+      return true;
+    for (size_t i = 1; i < workers.size(); ++i) {
+      Worker *victim = workers[(self->index + i) % workers.size()];
+      if (victim->deque.steal(task) || victim->inbox.tryPop(task))
+        return true;
+    }
+    return false;
+  }
+
+  // Sleeps until work may be available; false when it is time to exit
+  bool park(Worker *self, Task &task, bool &found) {
+    pthread_mutex_lock(&park_mutex);
+    parked.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    found = findWork(self, task);
+    bool exit = !found && stopping;
+    if (!found && !exit)
+      pthread_cond_wait(&park_cond, &park_mutex);
+    parked.fetch_sub(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&park_mutex);
+    return !exit;
+  }
+
+  static void *worker_thread(void *arg) {
+    Worker *self = static_cast<Worker *>(arg);
+    WorkScheduler *scheduler = self->scheduler;
+    current() = self;
+
+    Task task;
+    while (true) {
+      bool found = false;
+      for (unsigned spin = 0; spin <= spin_limit() && !found; ++spin) {
+        found = scheduler->findWork(self, task);
+        if (!found)
+          cpu_relax();
+      }
+      if (!found && !scheduler->park(self, task, found))
+        break;
+      if (found)
+        task.fn(task.arg, self->state);
+    }
+    current() = nullptr;
+    return NULL;
+  }
+};
+
+#endif